@@ -0,0 +1,519 @@
+// Benchmark of the TOML parser.
+//
+// Synthetic documents of various shapes are generated in memory and parsed
+// repeatedly; for each of them, the throughput of toml_parse_n() and
+// toml_parse_file(), the time per token, the number of heap allocations and
+// bytes allocated per parse, the time to visit the whole tree with the
+// accessors, the time of toml_free() and the peak resident set size are
+// reported. toml.c is compiled into this program, with malloc() and
+// realloc() counted, and its tokenizer is used to count the tokens.
+//
+// With -f, the float decoder of the parser is timed against strtod() on the
+// same inputs instead.
+//
+// Usage: toml-bench [-f] [-s SCALE] [-t SECONDS] [NAME...]
+#define _POSIX_C_SOURCE 200809L
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+static size_t bench_nalloc; /// number of calls to malloc() and realloc()
+static size_t bench_nbytes; /// number of bytes requested
+
+static void *bench_malloc(size_t n) {
+	bench_nalloc++;
+	bench_nbytes += n;
+	return malloc(n);
+}
+
+static void *bench_realloc(void *p, size_t n) {
+	bench_nalloc++;
+	bench_nbytes += n;
+	return realloc(p, n);
+}
+
+#define malloc(n) bench_malloc(n)
+#define realloc(p, n) bench_realloc(p, n)
+#include "toml.c"
+#undef malloc
+#undef realloc
+
+// Text buffer of the generators.
+typedef struct text_t text_t;
+struct text_t {
+	char *buf;
+	size_t len;
+	size_t cap;
+};
+
+static void text_printf(text_t *t, const char *fmt, ...) {
+	for (;;) {
+		va_list ap;
+		va_start(ap, fmt);
+		int n = vsnprintf(t->buf + t->len, t->cap - t->len, fmt, ap);
+		va_end(ap);
+		if (n < 0) {
+			fprintf(stderr, "toml-bench: bad format\n");
+			exit(1);
+		}
+		if ((size_t)n < t->cap - t->len) {
+			t->len += n;
+			return;
+		}
+		t->cap = 2 * t->cap + n + 1;
+		if (!(t->buf = realloc(t->buf, t->cap))) {
+			fprintf(stderr, "toml-bench: out of memory\n");
+			exit(1);
+		}
+	}
+}
+
+/// Pseudo-random numbers, the same for every run.
+static uint64_t rng_state = 0x9e3779b97f4a7c15u;
+
+static uint64_t rng(void) {
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state;
+}
+
+/* Generators. Each one appends about n bytes of text. */
+static void gen_wide(text_t *t, size_t n) {
+	text_printf(t, "[wide]\n");
+	for (long i = 0; t->len < n; i++)
+		text_printf(t, "key_%ld = %ld\n", i, (long)(rng() % 1000000));
+}
+
+static void gen_deep(text_t *t, size_t n) {
+	for (long i = 0; t->len < n; i++) {
+		text_printf(t, "[d%ld.a.b.c.d.e.f.g]\n", i);
+		text_printf(t, "x = ");
+		for (int k = 0; k < 32; k++)
+			text_printf(t, "{ y = [");
+		text_printf(t, "%ld", i);
+		for (int k = 0; k < 32; k++)
+			text_printf(t, "] }");
+		text_printf(t, "\n");
+	}
+}
+
+static void gen_long_array(text_t *t, size_t n) {
+	text_printf(t, "ints = [");
+	for (long i = 0; t->len < n / 2; i++)
+		text_printf(t, "%ld, ", (long)(rng() % 100000000));
+	text_printf(t, "0]\nstrs = [");
+	for (long i = 0; t->len < n; i++)
+		text_printf(t, "\"item %ld\", ", i);
+	text_printf(t, "\"\"]\n");
+}
+
+static void gen_multiline(text_t *t, size_t n) {
+	for (long i = 0; t->len < n; i++) {
+		text_printf(t, "text_%ld = \"\"\"\n", i);
+		for (int k = 0; k < 64; k++)
+			text_printf(t, "Line %d of a long text, with \\\"escapes\\\" \\u00e9 and \\t tabs.\n", k);
+		text_printf(t, "\"\"\"\nraw_%ld = '''\n", i);
+		for (int k = 0; k < 64; k++)
+			text_printf(t, "Line %d of a literal text, with \\ backslashes.\n", k);
+		text_printf(t, "'''\n");
+	}
+}
+
+static void gen_array_of_tables(text_t *t, size_t n) {
+	for (long i = 0; t->len < n; i++) {
+		text_printf(t, "[[record]]\nid = %ld\nname = \"record %ld\"\nenabled = %s\n",
+				i, i, (i & 1) ? "true" : "false");
+		text_printf(t, "date = 2021-%02ld-%02ldT12:34:56Z\n", 1 + i % 12, 1 + i % 28);
+		text_printf(t, "[record.position]\nx = %ld\ny = %ld\n",
+				(long)(rng() % 4096), (long)(rng() % 4096));
+	}
+}
+
+static void gen_floats(text_t *t, size_t n) {
+	text_printf(t, "[floats]\n");
+	for (long i = 0; t->len < n; i++) {
+		text_printf(t, "f%ld = [", i);
+		for (int k = 0; k < 16; k++) {
+			double x = (double)(rng() >> 11) / 9007199254740992.0;
+			int e = (int)(rng() % 41) - 20;
+			text_printf(t, "%.17g, ", x * pow(10, e));
+		}
+		text_printf(t, "%.6f]\n", (double)(rng() % 1000000) / 1000);
+	}
+}
+
+typedef struct generator_t generator_t;
+struct generator_t {
+	const char *name;
+	void (*gen)(text_t *t, size_t n);
+};
+
+static const generator_t generators[] = {
+	{"wide",          gen_wide},
+	{"deep",          gen_deep},
+	{"long-array",    gen_long_array},
+	{"multiline",     gen_multiline},
+	{"array-tables",  gen_array_of_tables},
+	{"floats",        gen_floats},
+};
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+/* Peak resident set size in MiB. */
+static double peak_rss(void) {
+#ifndef _WIN32
+	struct rusage ru;
+	if (getrusage(RUSAGE_SELF, &ru) == 0)
+#ifdef __APPLE__
+		return ru.ru_maxrss / (1024.0 * 1024.0); /// in bytes
+#else
+		return ru.ru_maxrss / 1024.0; /// in KiB
+#endif
+#endif
+	return 0;
+}
+
+/* Number of tokens of the text, as seen by the parser. */
+static long count_tokens(const char *text, size_t len) {
+	char errbuf[200];
+	context_t ctx;
+	if (init_context(&ctx, text, len, errbuf, sizeof(errbuf)))
+		return 0;
+	long n = 0;
+	set_token(&ctx, NEWLINE, 1, ctx.start, 0);
+	while (!ctx.tok.eof && next_token(&ctx, true) == 0)
+		n++;
+	arena_free(ctx.scratch);
+	return n;
+}
+
+/* Visit all the values of the tree with the accessors. Returns the number
+ * of values. */
+static long visit_table(const toml_table_t *tab);
+
+static long visit_array(const toml_array_t *arr) {
+	long n = 0;
+	for (int i = 0; i < toml_array_len(arr); i++) {
+		const toml_array_t *a;
+		const toml_table_t *t;
+		toml_value_t v;
+		if ((a = toml_array_array(arr, i)) != 0)
+			n += visit_array(a);
+		else if ((t = toml_array_table(arr, i)) != 0)
+			n += visit_table(t);
+		else if ((v = toml_array_string(arr, i)).ok)
+			free(v.u.s), n++;
+		else if ((v = toml_array_timestamp(arr, i)).ok)
+			free(v.u.ts), n++;
+		else
+			n += toml_array_int(arr, i).ok || toml_array_double(arr, i).ok ||
+				toml_array_bool(arr, i).ok;
+	}
+	return n;
+}
+
+static long visit_table(const toml_table_t *tab) {
+	long n = 0;
+	for (int i = 0; i < toml_table_len(tab); i++) {
+		int keylen;
+		const char *key = toml_table_key(tab, i, &keylen);
+		const toml_array_t *a;
+		const toml_table_t *t;
+		toml_value_t v;
+		if ((a = toml_table_array(tab, key)) != 0)
+			n += visit_array(a);
+		else if ((t = toml_table_table(tab, key)) != 0)
+			n += visit_table(t);
+		else if ((v = toml_table_string(tab, key)).ok)
+			free(v.u.s), n++;
+		else if ((v = toml_table_timestamp(tab, key)).ok)
+			free(v.u.ts), n++;
+		else
+			n += toml_table_int(tab, key).ok || toml_table_double(tab, key).ok ||
+				toml_table_bool(tab, key).ok;
+	}
+	return n;
+}
+
+/* Visit all the values of a tape, from node idx. Returns the number of
+ * values; their sum in *sum keeps the reads from being optimized out. */
+static long visit_tape(const toml_tape_t *tape, int idx, double *sum) {
+	const toml_node_t *node = &tape->node[idx];
+	long n = 0;
+	for (int i = node->u.sub.first, end = i + node->u.sub.n; i < end; i++) {
+		const toml_node_t *sub = &tape->node[i];
+		if (sub->kind != 'v') {
+			n += visit_tape(tape, i, sum);
+			continue;
+		}
+		switch (sub->type) {
+			case 'i': *sum += sub->u.i; break;
+			case 'd': *sum += sub->u.d; break;
+			case 'b': *sum += sub->u.b; break;
+			case 's': *sum += sub->u.s.len; break;
+			case 'u': continue;
+			default:  *sum += sub->u.ts->year; break;
+		}
+		n++;
+	}
+	return n;
+}
+
+static void die(const char *what, const char *errbuf) {
+	fprintf(stderr, "toml-bench: %s: %s\n", what, errbuf);
+	exit(1);
+}
+
+/* Run the benchmark of a document for about mintime seconds per measure. */
+static void bench(const char *name, const text_t *t, double mintime, const char *tmpname) {
+	char errbuf[200];
+	double mb = t->len / 1e6;
+	long ntok = count_tokens(t->buf, t->len);
+
+	/// toml_parse_n(), with its allocations, and toml_free()
+	double tparse = 1e30, tfree = 1e30, start = now();
+	size_t nalloc = 0, nbytes = 0;
+	int reps = 0;
+	do {
+		size_t n0 = bench_nalloc, b0 = bench_nbytes;
+		double t0 = now();
+		toml_table_t *tab = toml_parse_n(t->buf, t->len, errbuf, sizeof(errbuf));
+		double t1 = now();
+		if (!tab)
+			die(name, errbuf);
+		nalloc = bench_nalloc - n0;
+		nbytes = bench_nbytes - b0;
+		toml_free(tab);
+		double t2 = now();
+		if (t1 - t0 < tparse)
+			tparse = t1 - t0;
+		if (t2 - t1 < tfree)
+			tfree = t2 - t1;
+	} while (++reps < 3 || now() - start < mintime);
+
+	/// toml_parse_file()
+	FILE *fp = fopen(tmpname, "wb");
+	if (!fp || fwrite(t->buf, 1, t->len, fp) != t->len || fclose(fp))
+		die(tmpname, strerror(errno));
+	double tfile = 1e30;
+	start = now();
+	reps = 0;
+	do {
+		double t0 = now();
+		if (!(fp = fopen(tmpname, "rb")))
+			die(tmpname, strerror(errno));
+		toml_table_t *tab = toml_parse_file(fp, errbuf, sizeof(errbuf));
+		fclose(fp);
+		double t1 = now();
+		if (!tab)
+			die(name, errbuf);
+		toml_free(tab);
+		if (t1 - t0 < tfile)
+			tfile = t1 - t0;
+	} while (++reps < 3 || now() - start < mintime);
+	remove(tmpname);
+
+	/// accessors
+	toml_table_t *tab = toml_parse_n(t->buf, t->len, errbuf, sizeof(errbuf));
+	if (!tab)
+		die(name, errbuf);
+	double tvisit = 1e30;
+	long nval = 0;
+	start = now();
+	reps = 0;
+	do {
+		double t0 = now();
+		nval = visit_table(tab);
+		double t1 = now();
+		if (t1 - t0 < tvisit)
+			tvisit = t1 - t0;
+	} while (++reps < 3 || now() - start < mintime);
+
+	/// full traversal of the tape
+	toml_tape_t *tape = toml_tape_new(tab, 0, errbuf, sizeof(errbuf));
+	if (!tape)
+		die(name, errbuf);
+	double ttape = 1e30, sum = 0;
+	long ntape = 0;
+	start = now();
+	reps = 0;
+	do {
+		double t0 = now();
+		ntape = visit_tape(tape, 0, &sum);
+		double t1 = now();
+		if (t1 - t0 < ttape)
+			ttape = t1 - t0;
+	} while (++reps < 3 || now() - start < mintime);
+	toml_tape_free(tape);
+	toml_free(tab);
+
+	printf("%-13s %7.2f %9.1f %8.2f %9zu %9.2f %9.1f %9.1f %9.2f %8.3f %8.1f\n",
+			name, mb, mb / tparse, (ntok > 0 ? 1e9 * tparse / ntok : 0),
+			nalloc, nbytes / 1e6, mb / tfile,
+			(nval > 0 ? 1e9 * tvisit / nval : 0),
+			(ntape > 0 ? 1e9 * ttape / ntape : 0), 1e3 * tfree, peak_rss());
+}
+
+// Float decoding. The inputs are written in one buffer, each followed by a
+// NUL for strtod(), and decoded by decode_float() and by strtod() in turn.
+typedef struct floatgen_t floatgen_t;
+struct floatgen_t {
+	const char *name;
+	int prec;  /// significant digits, 0 for the shortest round-trip string
+};
+
+static const floatgen_t floatgens[] = {
+	{"shortest",  0},
+	{"17-digit", 17},
+	{"6-digit",   6},
+	{"25-digit", 25},
+};
+
+/* Make n inputs of g in t, and store their offsets in off. */
+static void gen_float_inputs(text_t *t, long *off, long n, const floatgen_t *g) {
+	for (long i = 0; i < n; i++) {
+		double x = (double)(rng() >> 11) / 9007199254740992.0;
+		x *= pow(10, (int)(rng() % 41) - 20);
+		off[i] = (long)t->len;
+		if (g->prec > 0) {
+			text_printf(t, "%.*g", g->prec, x);
+		} else {
+			for (int prec = 1; prec <= 17; prec++) {
+				t->len = off[i];
+				text_printf(t, "%.*g", prec, x);
+				if (strtod(t->buf + off[i], 0) == x)
+					break;
+			}
+		}
+		text_printf(t, "%c", 0);
+	}
+	off[n] = (long)t->len;
+}
+
+/* Run the benchmark of decode_float() against strtod() on inputs of g. */
+static void bench_float(const floatgen_t *g, long n, double mintime) {
+	text_t t = {0, 0, 0};
+	long *off = malloc((n + 1) * sizeof(*off));
+	if (!off)
+		die(g->name, "out of memory");
+	gen_float_inputs(&t, off, n, g);
+
+	/// decode_float(), then strtod(), on the same inputs; the sums of the
+	/// values keep the calls from being optimized out and must agree
+	double tdecode = 1e30, tstrtod = 1e30, sdecode = 0, sstrtod = 0;
+	double start = now();
+	int reps = 0;
+	do {
+		double s = 0, t0 = now();
+		for (long i = 0; i < n; i++) {
+			double x;
+			if (decode_float(t.buf + off[i], t.buf + off[i + 1] - 1, &x))
+				die(g->name, t.buf + off[i]);
+			s += x;
+		}
+		double t1 = now();
+		if (t1 - t0 < tdecode)
+			tdecode = t1 - t0;
+		sdecode = s;
+	} while (++reps < 3 || now() - start < mintime);
+	start = now();
+	reps = 0;
+	do {
+		double s = 0, t0 = now();
+		for (long i = 0; i < n; i++)
+			s += strtod(t.buf + off[i], 0);
+		double t1 = now();
+		if (t1 - t0 < tstrtod)
+			tstrtod = t1 - t0;
+		sstrtod = s;
+	} while (++reps < 3 || now() - start < mintime);
+	if (sdecode != sstrtod)
+		die(g->name, "decode_float() and strtod() disagree");
+
+	printf("%-13s %9ld %9.2f %9.1f %9.1f %8.2f\n", g->name, n,
+			(t.len - n) / (double)n, 1e9 * tdecode / n, 1e9 * tstrtod / n,
+			tstrtod / tdecode);
+	free(off);
+	free(t.buf);
+}
+
+static void usage(void) {
+	fprintf(stderr, "usage: toml-bench [-f] [-s SCALE] [-t SECONDS] [NAME...]\n");
+	fprintf(stderr, "  -f          benchmark the float decoder against strtod()\n");
+	fprintf(stderr, "  -s SCALE    size of the documents in MB [4]\n");
+	fprintf(stderr, "  -t SECONDS  minimal duration of each measure [0.5]\n");
+	fprintf(stderr, "  NAME        documents to benchmark, among:");
+	for (size_t i = 0; i < sizeof(generators) / sizeof(generators[0]); i++)
+		fprintf(stderr, " %s", generators[i].name);
+	fprintf(stderr, "\n              or, with -f, inputs among:");
+	for (size_t i = 0; i < sizeof(floatgens) / sizeof(floatgens[0]); i++)
+		fprintf(stderr, " %s", floatgens[i].name);
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	double scale = 4, mintime = 0.5;
+	bool floats = false;
+	int i;
+	for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+		if (strcmp(argv[i], "-f") == 0)
+			floats = true;
+		else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+			scale = atof(argv[++i]);
+		else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+			mintime = atof(argv[++i]);
+		else
+			usage();
+	}
+	if (scale <= 0 || mintime < 0)
+		usage();
+	char **names = argv + i;
+	int nnames = argc - i;
+
+	if (floats) {
+		/// about SCALE MB of inputs of each kind
+		printf("%-13s %9s %9s %9s %9s %8s\n", "input", "count", "length",
+				"decode", "strtod", "speedup");
+		printf("%-13s %9s %9s %9s %9s %8s\n", "", "", "bytes", "ns/value",
+				"ns/value", "");
+		for (size_t k = 0; k < sizeof(floatgens) / sizeof(floatgens[0]); k++) {
+			const floatgen_t *g = &floatgens[k];
+			bool wanted = (nnames == 0);
+			for (int j = 0; j < nnames; j++)
+				wanted |= (strcmp(names[j], g->name) == 0);
+			if (wanted)
+				bench_float(g, (long)(scale * 1e5), mintime);
+		}
+		return 0;
+	}
+
+	printf("%-13s %7s %9s %8s %9s %9s %9s %9s %9s %8s %8s\n", "document", "MB",
+			"parse", "ns/tok", "allocs", "alloc", "file", "ns/value",
+			"tape", "free", "peak");
+	printf("%-13s %7s %9s %8s %9s %9s %9s %9s %9s %8s %8s\n", "", "", "MB/s",
+			"", "", "MB", "MB/s", "", "ns/value", "ms", "RSS MiB");
+	for (size_t k = 0; k < sizeof(generators) / sizeof(generators[0]); k++) {
+		const generator_t *g = &generators[k];
+		bool wanted = (nnames == 0);
+		for (int j = 0; j < nnames; j++)
+			wanted |= (strcmp(names[j], g->name) == 0);
+		if (!wanted)
+			continue;
+		text_t t = {0, 0, 0};
+		g->gen(&t, (size_t)(scale * 1e6));
+		bench(g->name, &t, mintime, "toml-bench.tmp");
+		free(t.buf);
+	}
+	return 0;
+}
@@ -1,5 +1,9 @@
 autoload, "toml.i",
+    toml_cache,
     toml_collect,
+    toml_datetime,
+    toml_epoch,
+    toml_format,
     toml_format_boolean,
     toml_format_float,
     toml_format_integer,
@@ -11,5 +15,11 @@ autoload, "toml.i",
     toml_load,
     toml_parse,
     toml_parse_file,
+    toml_parse_files,
+    toml_path,
+    toml_query,
+    toml_stats,
     toml_timestamp,
-    toml_type;
+    toml_type,
+    toml_values,
+    toml_write;
@@ -0,0 +1,345 @@
+// Tests of the TOML library from C: the parts which have no Yorick interface,
+// the round trip of deep documents through the writer, and the decoding of
+// floats checked against strtod() on a corpus of inputs made by a seeded
+// generator, the same for every run.
+//
+// toml.c is compiled into this program. It prints the failed tests and a
+// summary, and exits with a non-zero status if any test failed.
+//
+// Usage: toml-tests
+#include <errno.h>
+#include <float.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "toml.c"
+
+static int ntests;  /// number of tests run
+static int nfailed; /// number of failed tests
+
+#define TEST(expr)                                                      \
+	do {                                                                \
+		ntests++;                                                       \
+		if (!(expr)) {                                                  \
+			nfailed++;                                                  \
+			printf("TEST FAILED at line %d: `%s`\n", __LINE__, #expr);  \
+		}                                                               \
+	} while (0)
+
+static const char *doc =
+	"host = 'example.com'\n"
+	"port = 80\n"
+	"empty = ''\n"
+	"t = 07:32:00\n"
+	"d = 1979-05-27\n"
+	"mixed = [1, 'one', 1.5, [2, 3]]\n"
+	"\n"
+	"[tbl]\n"
+	"key = 'value'\n"
+	"[tbl.sub]\n"
+	"ints = [1, 2, 3]\n"
+	"\n"
+	"[[aot]]\n"
+	"key = 'one'\n"
+	"[[aot]]\n"
+	"key = 'two'\n";
+
+static void test_tape(void) {
+	char errbuf[200];
+	toml_table_t *root = toml_parse_n(doc, strlen(doc), errbuf, sizeof(errbuf));
+	TEST(root != 0);
+	if (!root)
+		return;
+	toml_tape_t *tape = toml_tape_new(root, 0, errbuf, sizeof(errbuf));
+	TEST(tape != 0);
+	if (!tape) {
+		toml_free(root);
+		return;
+	}
+	const toml_node_t *node = tape->node;
+	TEST(node[0].kind == 't');
+	TEST(node[0].u.sub.n == toml_table_len(root));
+
+	/// values, copied out of the document
+	int i = toml_tape_find(tape, 0, "host");
+	TEST(i > 0 && node[i].kind == 'v' && node[i].type == 's');
+	TEST(i > 0 && node[i].u.s.len == 11 && strcmp(node[i].u.s.ptr, "example.com") == 0);
+	TEST(i > 0 && node[i].keylen == 4 && strcmp(node[i].key, "host") == 0);
+	i = toml_tape_find(tape, 0, "port");
+	TEST(i > 0 && node[i].kind == 'v' && node[i].type == 'i' && node[i].u.i == 80);
+	i = toml_tape_find(tape, 0, "empty");
+	TEST(i > 0 && node[i].type == 's' && node[i].u.s.len == 0 && node[i].u.s.ptr[0] == 0);
+	i = toml_tape_find(tape, 0, "d");
+	TEST(i > 0 && node[i].type == 'D' && node[i].u.ts->year == 1979);
+
+	/// a local time is a value, not a table
+	i = toml_tape_find(tape, 0, "t");
+	TEST(i > 0 && node[i].kind == 'v' && node[i].type == 't');
+	TEST(i > 0 && node[i].u.ts->hour == 7 && node[i].u.ts->minute == 32);
+	TEST(toml_tape_find(tape, i, "x") == -1);
+	TEST(toml_tape_find(tape, toml_tape_find(tape, 0, "none"), "x") == -1);
+	TEST(toml_tape_find(tape, tape->nnode, "host") == -1);
+
+	/// arrays and nested tables
+	i = toml_tape_find(tape, 0, "mixed");
+	TEST(i > 0 && node[i].kind == 'a' && node[i].type == 'm' && node[i].u.sub.n == 4);
+	if (i > 0) {
+		const toml_node_t *item = &node[node[i].u.sub.first];
+		TEST(item[0].kind == 'v' && item[0].type == 'i' && item[0].u.i == 1);
+		TEST(item[0].key == 0);
+		TEST(item[1].type == 's' && strcmp(item[1].u.s.ptr, "one") == 0);
+		TEST(item[2].type == 'd' && item[2].u.d == 1.5);
+		TEST(item[3].kind == 'a' && item[3].u.sub.n == 2);
+		TEST(toml_tape_find(tape, node[i].u.sub.first + 3, "x") == -1);
+	}
+	i = toml_tape_find(tape, toml_tape_find(tape, toml_tape_find(tape, 0, "tbl"), "sub"), "ints");
+	TEST(i > 0 && node[i].kind == 'a' && node[i].type == 'v' && node[i].u.sub.n == 3);
+	if (i > 0)
+		TEST(node[node[i].u.sub.first + 2].u.i == 3);
+	i = toml_tape_find(tape, 0, "aot");
+	TEST(i > 0 && node[i].kind == 'a' && node[i].type == 't' && node[i].u.sub.n == 2);
+	if (i > 0) {
+		int k = toml_tape_find(tape, node[i].u.sub.first + 1, "key");
+		TEST(k > 0 && strcmp(node[k].u.s.ptr, "two") == 0);
+	}
+
+	/// distinct keys are stored once
+	int k1 = toml_tape_find(tape, 0, "aot");
+	if (k1 > 0) {
+		int first = node[k1].u.sub.first;
+		TEST(node[toml_tape_find(tape, first, "key")].key ==
+				node[toml_tape_find(tape, first + 1, "key")].key);
+	}
+	toml_tape_free(tape);
+
+	/// tape of an array
+	toml_array_t *ints = toml_table_array(toml_table_table(toml_table_table(root, "tbl"), "sub"), "ints");
+	tape = toml_tape_new(0, ints, errbuf, sizeof(errbuf));
+	TEST(tape != 0);
+	if (tape) {
+		TEST(tape->nnode == 4);
+		TEST(tape->node[0].kind == 'a' && tape->node[0].u.sub.first == 1);
+		TEST(tape->node[1].u.i == 1 && tape->node[3].u.i == 3);
+		TEST(toml_tape_find(tape, 0, "x") == -1);
+		toml_tape_free(tape);
+	}
+	toml_free(root);
+}
+
+/* Write the table of a document into *text, to be freed by the caller. */
+static bool write_text(const toml_table_t *tab, char **text, size_t *len) {
+	char errbuf[200];
+	toml_writer_t *w = toml_writer_new(0);
+	if (!w)
+		return false;
+	bool ok = (toml_write_table(w, tab, errbuf, sizeof(errbuf)) == 0);
+	const char *s = (ok ? toml_writer_text(w, len) : 0);
+	if ((*text = (s ? malloc(*len + 1) : 0)) != 0)
+		memcpy(*text, s, *len + 1);
+	return toml_writer_close(w) == 0 && *text != 0;
+}
+
+/* Write the document src, parse the text back, and write it again: the two
+ * texts must be the same. Returns the root table parsed back, or 0. */
+static toml_table_t *round_trip(const char *src) {
+	char errbuf[200];
+	char *text1 = 0, *text2 = 0;
+	size_t len1 = 0, len2 = 0;
+	toml_table_t *tab = toml_parse_n(src, strlen(src), errbuf, sizeof(errbuf));
+	TEST(tab != 0);
+	TEST(tab && write_text(tab, &text1, &len1));
+	toml_free(tab);
+	tab = (text1 ? toml_parse_n(text1, len1, errbuf, sizeof(errbuf)) : 0);
+	if (text1 && !tab)
+		printf("%s\n", errbuf);
+	TEST(tab != 0);
+	TEST(tab && write_text(tab, &text2, &len2));
+	TEST(text1 && text2 && len1 == len2 && memcmp(text1, text2, len1) == 0);
+	free(text1);
+	free(text2);
+	return tab;
+}
+
+/* Query the integer at path in tab, -1 if there is none. */
+static int64_t query_int(const toml_table_t *tab, const char *path) {
+	char errbuf[200];
+	toml_path_t *p = toml_path_compile(path, errbuf, sizeof(errbuf));
+	toml_match_t m;
+	int64_t ret = -1;
+	if (p && toml_table_query(tab, p, &m, 1) == 1 && m.kind == 'v' && m.valtype == 'i')
+		ret = m.u->i;
+	toml_path_free(p);
+	return ret;
+}
+
+/* Tables and arrays of tables nested deeper than the headers the parser
+ * reads are written inline. */
+static void test_write_deep(void) {
+	toml_table_t *tab = round_trip(
+		"[a.b.c.d.e.f.g.h.i.j]\n"
+		"x = 1\n"
+		"t = {u = {v = 2}, w = [{x = [{y = 3}]}]}\n"
+		"[a.b.c.d.e.f.g.h.k.l]\n"
+		"m = {n = 4}\n"
+		"[[a.b.c.d.e.f.g.h.i.p]]\n"
+		"q = [{r = 5}, {r = 6}]\n");
+	if (tab) {
+		TEST(query_int(tab, "a.b.c.d.e.f.g.h.i.j.x") == 1);
+		TEST(query_int(tab, "a.b.c.d.e.f.g.h.i.j.t.u.v") == 2);
+		TEST(query_int(tab, "a.b.c.d.e.f.g.h.i.j.t.w[1].x[1].y") == 3);
+		TEST(query_int(tab, "a.b.c.d.e.f.g.h.k.l.m.n") == 4);
+		TEST(query_int(tab, "a.b.c.d.e.f.g.h.i.p[1].q[2].r") == 6);
+		toml_free(tab);
+	}
+
+	/// as the "deep" document of toml-bench
+	char src[1024];
+	size_t n = (size_t)snprintf(src, sizeof(src), "[d0.a.b.c.d.e.f.g]\nx = ");
+	for (int k = 0; k < 32; k++)
+		n += (size_t)snprintf(src + n, sizeof(src) - n, "{ y = [");
+	n += (size_t)snprintf(src + n, sizeof(src) - n, "7");
+	for (int k = 0; k < 32; k++)
+		n += (size_t)snprintf(src + n, sizeof(src) - n, "] }");
+	snprintf(src + n, sizeof(src) - n, "\n");
+	if ((tab = round_trip(src)) != 0) {
+		char path[512] = "d0.a.b.c.d.e.f.g.x";
+		for (int k = 0; k < 31; k++)
+			strcat(path, ".y[1]");
+		strcat(path, ".y[1]");
+		TEST(query_int(tab, path) == 7);
+		toml_free(tab);
+	}
+}
+
+/// Pseudo-random numbers, the same for every run.
+static uint64_t rng_state = 0x2545f4914f6cdd1du;
+
+static uint64_t rng(void) {
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state;
+}
+
+/* A random finite double, subnormals included. */
+static double random_double(void) {
+	for (;;) {
+		uint64_t bits = rng();
+		double x;
+		memcpy(&x, &bits, sizeof(x));
+		if (isfinite(x))
+			return x;
+	}
+}
+
+/* Write in buf an input of kind k of the float corpus. */
+static void float_input(char *buf, size_t size, int k) {
+	double x = random_double();
+	switch (k) {
+		case 0: /// shortest string which reads back as x
+			for (int prec = 0; prec < 17; prec++) {
+				snprintf(buf, size, "%.*e", prec, x);
+				if (strtod(buf, 0) == x)
+					break;
+			}
+			break;
+		case 1: /// 17 significant digits
+			snprintf(buf, size, "%.16e", x);
+			break;
+		case 2: /// subnormal
+			x = ldexp((double)((rng() >> 12) | 1), -1074);
+			snprintf(buf, size, "%.*e", (int)(rng() % 18), x);
+			break;
+		case 3: /// halfway between two doubles, or close to it, with
+		        /// more digits than are accumulated
+#if LDBL_MANT_DIG >= 64
+			snprintf(buf, size, "%.*Le", 19 + (int)(rng() % 22),
+					((long double)x + nextafter(x, HUGE_VAL)) / 2);
+#else
+			snprintf(buf, size, "%.*e", 19 + (int)(rng() % 22), x);
+#endif
+			break;
+		default: { /// random digits and exponent, out of range ones included
+			int nd = 1 + (int)(rng() % 40);
+			size_t n = 0;
+			buf[n++] = '1' + (char)(rng() % 9);
+			if (nd > 1)
+				buf[n++] = '.';
+			for (int i = 1; i < nd; i++)
+				buf[n++] = '0' + (char)(rng() % 10);
+			snprintf(buf + n, size - n, "e%d", (int)(rng() % 701) - 350);
+			break;
+		}
+	}
+}
+
+/* Check decode_float() against strtod() on the corpus. A value which
+ * strtod() rounds to zero or to infinity must be rejected as out of range. */
+static void test_floats(void) {
+	const long ninput = 500000;
+	long nbad = 0;
+	for (long i = 0; i < ninput; i++) {
+		char buf[80];
+		float_input(buf, sizeof(buf), (int)(i % 5));
+		if (i & 1) { /// negative values too
+			memmove(buf + 1, buf, strlen(buf) + 1);
+			buf[0] = '-';
+		}
+		double ref = strtod(buf, 0), x;
+		int ret = decode_float(buf, buf + strlen(buf), &x);
+		bool ok = (ref == 0 || isinf(ref) ? ret == -1 :
+				ret == 0 && memcmp(&x, &ref, sizeof(x)) == 0);
+		if (!ok && nbad++ < 10)
+			printf("TEST FAILED: decode_float(\"%s\") gives %.17g (%d), strtod() gives %.17g\n",
+					buf, x, ret, ref);
+	}
+	ntests++;
+	if (nbad > 0) {
+		nfailed++;
+		printf("TEST FAILED: %ld of %ld floats decoded differently than by strtod()\n", nbad, ninput);
+	}
+}
+
+/* The writer gives the shortest string which reads back as a double. */
+static void test_format_double(void) {
+	char buf[32], tmp[32];
+	format_double(-9.058460677711424e-100, buf);
+	TEST(strcmp(buf, "-9.058460677711424e-100") == 0);
+	format_double(0.1, buf);
+	TEST(strcmp(buf, "0.1") == 0);
+	format_double(5e-324, buf);
+	TEST(strcmp(buf, "5e-324") == 0);
+	long nbad = 0;
+	for (long i = 0; i < 100000; i++) {
+		double x = random_double();
+		int nd;
+		for (nd = 1; nd < 17; nd++) {
+			snprintf(tmp, sizeof(tmp), "%.*e", nd - 1, x);
+			if (strtod(tmp, 0) == x)
+				break;
+		}
+		format_double(x, buf);
+		/// significant digits of buf, without leading or trailing zeros
+		int n = 0, nz = 0;
+		for (const char *p = buf; *p && *p != 'e'; p++) {
+			if (*p < '0' || *p > '9' || (*p == '0' && n == 0))
+				continue;
+			nz = (*p == '0' ? nz + 1 : 0);
+			n++;
+		}
+		if ((strtod(buf, 0) != x || n - nz != nd) && nbad++ < 10)
+			printf("TEST FAILED: format_double(%.17g) gives \"%s\", %d digits expected\n", x, buf, nd);
+	}
+	ntests++;
+	if (nbad > 0)
+		nfailed++;
+}
+
+int main(void) {
+	test_tape();
+	test_write_deep();
+	test_format_double();
+	test_floats();
+	printf("%d test(s) passed, %d test(s) failed\n", ntests - nfailed, nfailed);
+	return nfailed > 0;
+}
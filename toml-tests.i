@@ -30,6 +30,13 @@ for (i = -1; i <= root.len; ++i) {
 test_eval, "toml_key(root, root.len+1) == string()";
 test_eval, "root(keys(1)) == root(1)";
 test_eval, "root(keys(2)) == root(2)";
+for (i = 1; i <= root.len; ++i) {
+    test_assert, toml_type(root(i)) == toml_type(root(keys(i))),
+        "TEST FAILED: `%s` with `i = %d`\n",
+        "toml_type(root(i)) == toml_type(root(keys(i)))", i;
+}
+test_eval, "root(0).len == root(keys(0)).len";
+test_eval, "is_void(root(\"nothing\"))";
 
 // Timestamp.
 ts = root("date");
@@ -96,6 +103,160 @@ test_eval, "tbl_sub_mix(0) == tbl_sub_mix(tbl_sub_mix.len)";
 test_eval, "tbl_sub_mix(-1) == tbl_sub_mix(tbl_sub_mix.len - 1)";
 test_eval, "tbl_sub_mix(-2) == tbl_sub_mix(tbl_sub_mix.len - 2)";
 
+// Numbers, compared with Yorick's own decoding.
+nums = ["0.1", "0.3", "1e23", "8.98846567431158e307", "1.7976931348623157e308",
+        "2.2250738585072011e-308", "2.2250738585072014e-308", "4.9e-324",
+        "5e-324", "9007199254740993.0", "0.30000000000000004",
+        "123456789012345678901234567890.0", "6.02214076e23", "-0.0",
+        "3.141592653589793238462643383279", "7.0e-10", "1E+2", "1e-05"];
+src = "x = [" + nums(1);
+for (i = 2; i <= numberof(nums); ++i) src += ", " + nums(i);
+arr = toml_parse(src + "]")("x");
+for (i = 1; i <= numberof(nums); ++i) {
+    test_assert, arr(i) == tonum(nums(i)),
+        "TEST FAILED: `%s` with `i = %d`\n", "arr(i) == tonum(nums(i))", i;
+}
+num = toml_parse("a = 1_000.000_1\nb = -9223372036854775808\n" +
+                 "c = 9223372036854775807\nd = 0xdead_beef\ne = 0o755\n" +
+                 "f = 0b1101\ng = 1_000\nh = +inf\ni = -1.5e-3");
+test_eval, "num(\"a\") == 1000.0001";
+test_eval, "num(\"b\") == -9223372036854775807 - 1";
+test_eval, "num(\"c\") == 9223372036854775807";
+test_eval, "num(\"d\") == 0xdeadbeef";
+test_eval, "num(\"e\") == 493";
+test_eval, "num(\"f\") == 13";
+test_eval, "num(\"g\") == 1000";
+test_eval, "num(\"h\") > 1e308";
+test_eval, "num(\"i\") == -0.0015";
+
+// Parse a vector of bytes, with or without a final null.
+buf = strchar(doc);
+test_eval, "toml_parse(buf).len == root.len";
+test_eval, "toml_parse(buf(1:-1)).len == root.len";
+test_eval, "toml_parse(buf(1:-1))(\"tbl\")(\"sub\")(\"ints\")(0) == 3";
+
+// Parse a file in place.
+tmp = "toml-tests.tmp";
+write, open(tmp, "w"), format="%s", doc;
+for (mmap = 0; mmap <= 1; ++mmap) {
+    froot = toml_parse_file(tmp, mmap=mmap);
+    test_assert, froot.len == root.len,
+        "TEST FAILED: `%s` with `mmap = %d`\n", "froot.len == root.len", mmap;
+    test_assert, froot("host") == "example.com",
+        "TEST FAILED: `%s` with `mmap = %d`\n", "froot(\"host\") == \"example.com\"", mmap;
+    test_assert, froot("tbl")("sub")("subkey") == "subvalue",
+        "TEST FAILED: `%s` with `mmap = %d`\n", "froot(\"tbl\")(\"sub\")(\"subkey\") == \"subvalue\"", mmap;
+}
+old = toml_cache(1e6);
+froot = toml_parse_file(tmp, cache=1);
+test_eval, "toml_cache()(3) == 1";
+test_eval, "toml_cache()(2) > 0";
+test_eval, "toml_parse_file(tmp, cache=1).len == root.len";
+test_eval, "toml_cache()(3) == 1";
+test_eval, "h_get(toml_load(tmp, cache=1), \"host\") == \"example.com\"";
+test_eval, "toml_cache()(3) == 1";
+toml_cache, 0;
+test_eval, "toml_cache()(3) == 0";
+test_eval, "toml_cache()(2) == 0";
+test_eval, "toml_parse_file(tmp, cache=1).len == root.len";
+test_eval, "toml_cache()(3) == 0";
+toml_cache, old(1);
+froot = toml_parse_file(tmp, lazy=1);
+test_eval, "froot.len == root.len";
+test_eval, "froot(\"tbl\")(\"sub\")(\"ints\")(0) == 3";
+test_eval, "froot(\"aot\")(2)(\"k\") == \"two\"";
+froot = toml_parse_file(tmp, threads=4);
+test_eval, "froot.len == root.len";
+test_eval, "froot(\"tbl\")(\"sub\")(\"ints\")(0) == 3";
+test_eval, "froot(\"aot\")(2)(\"k\") == \"two\"";
+test_eval, "toml_parse(doc, threads=0)(\"aot\")(1)(\"k\") == \"one\"";
+lst = toml_parse_files([tmp, tmp, tmp], threads=2);
+test_eval, "lst.len == 3";
+test_eval, "lst(3)(\"aot\")(2)(\"k\") == \"two\"";
+test_eval, "lst(1).len == root.len";
+lst = [];
+write, open(tmp, "w"), format="%s", "[a]\nx = 1\n[b]\ny =\n";
+froot = toml_parse_file(tmp, lazy=1);
+test_eval, "froot(\"a\")(\"x\") == 1";
+froot = [];
+remove, tmp;
+
+// Statistics.
+toml_stats, enable=1;
+test_eval, "toml_stats().enabled == 1";
+sroot = toml_parse("a = 1\n[t]\nb = [1, 2]\n");
+test_eval, "h_get(toml_stats(sroot), \"collected\") == 1";
+test_eval, "h_get(toml_stats(sroot), \"tables\") == 2";
+test_eval, "h_get(toml_stats(sroot), \"arrays\") == 1";
+test_eval, "h_get(toml_stats(sroot), \"keyvals\") == 1";
+test_eval, "h_get(toml_stats(sroot(\"t\")), \"values\") == 2";
+test_eval, "h_get(toml_stats(sroot), \"tokens\") > 0";
+ntok = h_get(toml_stats(toml_parse(doc)), "tokens");
+test_eval, "h_get(toml_stats(toml_parse(doc, threads=4)), \"tokens\") == ntok";
+write, open(tmp, "w"), format="%s", doc;
+froot = toml_parse_file(tmp, lazy=1);
+for (i = 1; i <= froot.len; ++i) {
+    item = froot(i); // load all the lazy entries
+}
+test_eval, "h_get(toml_stats(froot), \"tokens\") == ntok";
+test_eval, "h_get(toml_stats(toml_parse_file(tmp, threads=4)), \"tokens\") == ntok";
+froot = item = [];
+remove, tmp;
+toml_stats, enable=0;
+test_eval, "toml_stats().enabled == 0";
+test_eval, "h_get(toml_stats(toml_parse(\"a = 1\")), \"collected\") == 0";
+sroot = [];
+
+// Bulk conversion.
+test_eval, "allof(toml_values(tbl_sub_ints) == [1,2,3])";
+test_eval, "structof(toml_values(tbl_sub_ints)) == long";
+test_eval, "is_void(toml_values(tbl_sub_mix))";
+mat = toml_values(toml_parse("m = [[1.5, 2.0, 3.0], [4.0, 5.0, 6.5]]")("m"));
+test_eval, "structof(mat) == double";
+test_eval, "allof(dimsof(mat) == [2,3,2])";
+test_eval, "mat(3,2) == 6.5";
+test_eval, "allof(toml_values(toml_parse(\"b = [true, false]\")(\"b\")) == [1n,0n])";
+strs = toml_parse("s = ['a', \"b\\tc\", '', \"\"\"d\"\"\"]")("s");
+test_eval, "allof(toml_values(strs) == [\"a\", \"b\\tc\", \"\", \"d\"])";
+test_eval, "strs(2) == \"b\\tc\" && strs(3) == \"\"";
+strs = [];
+tss = toml_parse("t = [1970-01-01T00:00:00Z, 1979-05-27T07:32:00-08:00, " +
+                 "1969-12-31T23:59:59.5Z, 2024-01-01T00:30:00+05:30]")("t");
+test_eval, "is_void(toml_values(tss))";
+test_eval, "allof(toml_epoch(tss) == [0, 296667120, -0.5, 1704049200])";
+flds = toml_datetime(tss);
+test_eval, "allof(dimsof(flds) == [2,8,4])";
+test_eval, "allof(flds(,2) == [1979,5,27,7,32,0,0,-480])";
+test_eval, "allof(flds(,3) == [1969,12,31,23,59,59,500,0])";
+test_eval, "flds(8,4) == 330";
+test_eval, "allof(toml_epoch(toml_parse(\"d = [[2000-02-29], [1970-01-02]]\")(\"d\")) == [[951782400], [86400]])";
+test_eval, "allof(toml_epoch(toml_parse(\"t = [00:00:01.25, 12:00:00]\")(\"t\")) == [1.25, 43200])";
+test_eval, "is_void(toml_epoch(toml_parse(\"t = [1970-01-01, 00:00:00]\")(\"t\")))";
+test_eval, "is_void(toml_epoch(tbl_sub_ints))";
+tss = flds = [];
+
+// Collect.
+data = toml_collect(root);
+test_eval, "allof(h_get(h_get(h_get(data, \"tbl\"), \"sub\"), \"ints\") == [1,2,3])";
+ragged = toml_parse("m = [[1, 2], [3]]");
+test_eval, "allof(h_get(toml_collect(ragged, broadcast=1), \"m\") == [[1,2],[3,3]])";
+test_eval, "is_mvect(h_get(toml_collect(ragged), \"m\"))";
+
+// Queries.
+test_eval, "allof(toml_query(root, \"tbl.sub.ints[*]\") == [1,2,3])";
+test_eval, "allof(toml_query(root, \"tbl.sub.ints[0:1:-1]\") == [3,2,1])";
+test_eval, "toml_query(root, \"tbl.sub.ints[0]\") == 3";
+test_eval, "allof(toml_query(root, \"tbl.sub.ints[1::2147483647]\") == [1])";
+test_eval, "allof(toml_query(root, \"tbl.sub.ints[-7::5]\") == [1])";
+test_eval, "allof(toml_query(root, \"aot[*].k\") == [\"one\",\"two\"])";
+test_eval, "is_void(toml_query(root, \"tbl.none\"))";
+test_eval, "toml_query(root, \"tbl.sub.mixed[*]\").len == 4";
+path = toml_path("tbl.sub.subkey");
+test_eval, "path(root) == \"subvalue\"";
+test_eval, "toml_query(toml_parse(buf), path) == \"subvalue\"";
+test_eval, "toml_query(toml_parse(\"s = ''\\nt = 'x'\"), \"s\") == \"\"";
+test_eval, "allof(toml_query(toml_parse(\"a = ['', 'b']\"), \"a[*]\") == [\"\", \"b\"])";
+
 // Format.
 test_eval, "toml_format_boolean(0n) == \"false\"";
 test_eval, "toml_format_boolean(1n) == \"true\"";
@@ -106,5 +267,35 @@ test_eval, "toml_format_string(\"hello, Joe\") == \"\\\"hello, Joe\\\"\"";
 test_eval, "toml_format_string(\"Joe's \\\"bar\\\"\") == \"\\\"Joe's \\\\\\\"bar\\\\\\\"\\\"\"";
 test_eval, "toml_format_timestamp(ts) == \"1979-05-27T07:32:00.000-08:00\"";
 
+// Write.
+test_eval, "toml_format(0.1) == \"0.1\"";
+test_eval, "toml_format(0.1 + 0.2) == \"0.30000000000000004\"";
+test_eval, "toml_format(-9.058460677711424e-100) == \"-9.058460677711424e-100\"";
+test_eval, "toml_format(\"a\\tb\") == \"\\\"a\\\\tb\\\"\"";
+test_eval, "toml_format([[1,2],[3,4]]) == \"[[1, 2], [3, 4]]\"";
+for (pass = 1; pass <= 2; ++pass) {
+    src = (pass == 1 ? root : toml_collect(root));
+    toml_write, tmp, src;
+    froot = toml_parse_file(tmp);
+    test_assert, froot("port") == 80,
+        "TEST FAILED: `%s` with `pass = %d`\n", "froot(\"port\") == 80", pass;
+    test_assert, allof(toml_values(froot("tbl")("sub")("ints")) == [1,2,3]),
+        "TEST FAILED: `%s` with `pass = %d`\n", "ints == [1,2,3]", pass;
+    test_assert, froot("aot")(2)("k") == "two",
+        "TEST FAILED: `%s` with `pass = %d`\n", "froot(\"aot\")(2)(\"k\") == \"two\"", pass;
+}
+deep = toml_parse("[a.b.c.d.e.f.g.h.i.j]\nt = {u = [{v = 1}]}\nm = [2, {x = 3}]\n");
+for (pass = 1; pass <= 2; ++pass) {
+    toml_write, tmp, (pass == 1 ? deep : toml_collect(deep));
+    froot = toml_parse_file(tmp);
+    test_assert, toml_query(froot, "a.b.c.d.e.f.g.h.i.j.t.u[1].v") == 1,
+        "TEST FAILED: `%s` with `pass = %d`\n", "t.u[1].v == 1", pass;
+    test_assert, toml_query(froot, "a.b.c.d.e.f.g.h.i.j.m[2].x") == 3,
+        "TEST FAILED: `%s` with `pass = %d`\n", "m[2].x == 3", pass;
+}
+deep = [];
+froot = [];
+remove, tmp;
+
 // Summary.
 test_summary;
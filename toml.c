@@ -2,61 +2,180 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <float.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <math.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <io.h>
+#endif
 
 #include "toml.h"
 
 #define ALIGN8(sz) (((sz) + 7) & ~7)
-#define calloc(x, y) error - forbidden - use CALLOC instead
-static void *CALLOC(size_t nmemb, size_t sz) {
-	int nb = ALIGN8(sz) * nmemb;
-	void *p = malloc(nb);
-	if (p) {
-		memset(p, 0, nb);
+
+// Memory arena. All nodes, keys and raw values of a document are
+// bump-allocated from a list of large blocks owned by the root table, so
+// that toml_free() only has to release a handful of blocks instead of
+// walking the whole tree.
+#define ARENA_MINBLK (4 * 1024)    /// size of the first block
+#define ARENA_MAXBLK (1024 * 1024) /// block size stops doubling here
+
+typedef struct arena_block_t arena_block_t;
+struct arena_block_t {
+	arena_block_t *next;
+	size_t size; /// usable size of data[]
+	size_t used; /// number of bytes handed out
+	char data[];
+};
+
+typedef struct keyslot_t keyslot_t;
+struct keyslot_t {
+	uint32_t hash;
+	const char *key; /// 0 for an empty slot
+};
+
+struct toml_arena_t {
+	arena_block_t *head; /// block being filled, followed by older ones
+	size_t blksz;        /// size of the next block to allocate
+	char *text;          /// TOML text owned by the document, if any
+	size_t textlen;      /// its size in bytes
+	int textowner;       /// how to release the text
+	toml_stats_t *stats; /// statistics of the parse, if enabled
+	keyslot_t *keyslot;  /// index of the interned keys (see intern_key)
+	int nkeyslot;
+	int nkey;
+};
+
+// Owner of the TOML text given to the parser. Unless owned by the caller, the
+// text is kept alive with the document and parsed values may point into it.
+#define TEXT_CALLER 0 /// owned by the caller, values must be copied
+#define TEXT_MALLOC 1 /// allocated by malloc()
+#define TEXT_MMAP   2 /// memory mapped file
+
+static void release_text(char *text, size_t len, int owner) {
+	if (owner == TEXT_MALLOC)
+		free(text);
+#ifndef _WIN32
+	else if (owner == TEXT_MMAP)
+		munmap(text, len);
+#endif
+}
+
+static toml_arena_t *arena_new(void) {
+	toml_arena_t *a = malloc(sizeof(*a));
+	if (a) {
+		a->head = 0;
+		a->blksz = ARENA_MINBLK;
+		a->text = 0;
+		a->textlen = 0;
+		a->textowner = TEXT_CALLER;
+		a->stats = 0;
+		a->keyslot = 0;
+		a->nkeyslot = a->nkey = 0;
 	}
-	return p;
+	return a;
 }
 
-// some old platforms define strdup macro -- drop it.
-#undef strdup
-#define strdup(x) error - forbidden - use STRDUP instead
-static char *STRDUP(const char *s) {
-	int len = strlen(s);
-	char *p = malloc(len + 1);
-	if (p) {
-		memcpy(p, s, len);
-		p[len] = 0;
+static void arena_free(toml_arena_t *a) {
+	if (!a)
+		return;
+	for (arena_block_t *b = a->head, *next; b; b = next) {
+		next = b->next;
+		free(b);
+	}
+	release_text(a->text, a->textlen, a->textowner);
+	free(a->keyslot);
+	free(a);
+}
+
+static void *arena_alloc(toml_arena_t *a, size_t sz) {
+	sz = ALIGN8(sz);
+	arena_block_t *b = a->head;
+	if (!b || b->size - b->used < sz) {
+		if (sz > a->blksz / 4) {
+			/// Large request: give it a block of its own and keep it
+			/// behind the head so that the head keeps its free space.
+			if (!(b = malloc(sizeof(*b) + sz)))
+				return 0;
+			b->size = b->used = sz;
+			if (a->head) {
+				b->next = a->head->next;
+				a->head->next = b;
+			} else {
+				b->next = 0;
+				a->head = b;
+			}
+			return b->data;
+		}
+		if (!(b = malloc(sizeof(*b) + a->blksz)))
+			return 0;
+		b->size = a->blksz;
+		b->used = 0;
+		b->next = a->head;
+		a->head = b;
+		if (a->blksz < ARENA_MAXBLK)
+			a->blksz *= 2;
 	}
+	void *p = b->data + b->used;
+	b->used += sz;
+	return p;
+}
+
+// Give back p and all the more recent allocations to the arena, if p is in
+// the block being filled; otherwise this is a no-op and the space is
+// reclaimed with the whole arena. This makes the arena usable as a stack.
+static void arena_release(toml_arena_t *a, const void *p) {
+	arena_block_t *b = a->head;
+	uintptr_t off = (uintptr_t)p - (uintptr_t)(b ? b->data : 0);
+	if (b && off < b->used)
+		b->used = off;
+}
+
+#define calloc(x, y) error - forbidden - use arena_calloc instead
+static void *arena_calloc(toml_arena_t *a, size_t nmemb, size_t sz) {
+	size_t nb = ALIGN8(sz) * nmemb;
+	void *p = arena_alloc(a, nb);
+	if (p)
+		memset(p, 0, nb);
 	return p;
 }
 
-// some old platforms define strndup macro -- drop it.
+// some old platforms define strdup/strndup macros -- drop them.
+#undef strdup
+#define strdup(x) error - forbidden - use arena_strndup instead
 #undef strndup
-#define strndup(x) error - forbiden - use STRNDUP instead
-static char *STRNDUP(const char *s, size_t n) {
-	size_t len = strnlen(s, n);
-	char *p = malloc(len + 1);
+#define strndup(x) error - forbidden - use arena_strndup instead
+static char *arena_strndup(toml_arena_t *a, const char *s, size_t n) {
+	char *p = arena_alloc(a, n + 1);
 	if (p) {
-		memcpy(p, s, len);
-		p[len] = 0;
+		memcpy(p, s, n);
+		p[n] = 0;
 	}
 	return p;
 }
 
 // Unparsed values.
 typedef const char *toml_unparsed_t;
-toml_unparsed_t toml_table_unparsed  (const toml_table_t *table, const char *key);
-toml_unparsed_t toml_array_unparsed  (const toml_array_t *array, int idx);
 int             toml_value_string    (toml_unparsed_t s, char **ret, int *len);
 int             toml_value_bool      (toml_unparsed_t s, bool *ret);
 int             toml_value_int       (toml_unparsed_t s, int64_t *ret);
 int             toml_value_double    (toml_unparsed_t s, double *ret);
 int             toml_value_timestamp (toml_unparsed_t s, toml_timestamp_t *ret);
+static int      decode_int           (const char *p, const char *end, int64_t *ret);
+static int      decode_float         (const char *p, const char *end, double *ret);
 
 // Convert escape to UTF-8; return #bytes used in buf to encode the char, or -1
 // on error.
@@ -115,6 +234,155 @@ static inline void xfree(const void *x) {
 		free((void *)(intptr_t)x);
 }
 
+// Character classes of the bytes of a TOML text, to classify them with a
+// single table lookup.
+#define CC_SPACE 0x01 /// blank: space, tab, CR
+#define CC_BARE  0x02 /// in a bare key: [A-Za-z0-9_-]
+#define CC_LIT   0x04 /// in a literal value: [A-Za-z0-9+-_.]
+#define CC_HEX   0x08 /// hexadecimal digit
+#define CC_ESC   0x10 /// escaped by a backslash: [btnfr"\]
+#define CC_STAMP 0x20 /// in a timestamp: [0-9.:+-Tt Zz]
+#define CC_DIGIT 0x40 /// decimal digit
+#define CC_CTRL  0x80 /// control char that must be escaped in strings
+#define CCLASS(ch, cc) (char_class[(uint8_t)(ch)] & (cc))
+
+static const uint8_t char_class[256] = {
+	0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x01, 0x80, 0x80, 0x80, 0x81, 0x80, 0x80,
+	0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+	0x21, 0x00, 0x10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x24, 0x00, 0x26, 0x24, 0x00,
+	0x6e, 0x6e, 0x6e, 0x6e, 0x6e, 0x6e, 0x6e, 0x6e, 0x6e, 0x6e, 0x20, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x0e, 0x0e, 0x0e, 0x0e, 0x0e, 0x0e, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06,
+	0x06, 0x06, 0x06, 0x06, 0x26, 0x06, 0x06, 0x06, 0x06, 0x06, 0x26, 0x00, 0x10, 0x00, 0x00, 0x06,
+	0x00, 0x0e, 0x1e, 0x0e, 0x0e, 0x0e, 0x1e, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x16, 0x06,
+	0x06, 0x06, 0x16, 0x06, 0x36, 0x06, 0x06, 0x06, 0x06, 0x06, 0x26, 0x00, 0x00, 0x00, 0x00, 0x80,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
+
+// Stage 1 of the tokenizer: vectorized kernels to skip the bulk of the text
+// (blanks, comments, string contents) in 16 or 32 byte blocks. They all scan
+// [p, end) and return end if no byte of interest is found. The best set for
+// the CPU is selected at run time; the scalar kernels are the reference.
+typedef struct scan_kernels_t scan_kernels_t;
+struct scan_kernels_t {
+	/// first byte equal to a, b or c
+	const char *(*find3)(const char *p, const char *end, int a, int b, int c);
+	/// first byte which is not a blank
+	const char *(*skip_blanks)(const char *p, const char *end);
+	/// first byte which is a control char, DEL or not ASCII
+	const char *(*find_special)(const char *p, const char *end);
+	/// number of bytes equal to c
+	size_t (*count)(const char *p, const char *end, int c);
+};
+
+static const char *find3_scalar(const char *p, const char *end, int a, int b, int c) {
+	for (; p < end; p++)
+		if (*p == a || *p == b || *p == c)
+			break;
+	return p;
+}
+
+static const char *skip_blanks_scalar(const char *p, const char *end) {
+	while (p < end && CCLASS(*p, CC_SPACE))
+		p++;
+	return p;
+}
+
+static const char *find_special_scalar(const char *p, const char *end) {
+	for (; p < end; p++)
+		if ((uint8_t)*p < 0x20 || (uint8_t)*p >= 0x7f)
+			break;
+	return p;
+}
+
+static size_t count_scalar(const char *p, const char *end, int c) {
+	size_t n = 0;
+	for (; p < end; p++)
+		n += (*p == c);
+	return n;
+}
+
+static const scan_kernels_t scan_scalar = {
+	find3_scalar, skip_blanks_scalar, find_special_scalar, count_scalar
+};
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !defined(TOML_NO_SIMD)
+#define TOML_SIMD_X86
+#include <immintrin.h>
+
+// Define the 4 kernels for vectors of type V of N bytes. The mask of a
+// comparison has bit i set if byte i matched.
+#define DEFINE_SCAN_KERNELS(isa, attr, V, N, LOAD, SET1, CMPEQ, CMPGT, OR, MOVEMASK) \
+	attr static const char *find3_##isa(const char *p, const char *end, int a, int b, int c) { \
+		const V va = SET1((char)a), vb = SET1((char)b), vc = SET1((char)c);                   \
+		for (; end - p >= N; p += N) {                                                          \
+			V x = LOAD((const V *)p);                                                           \
+			uint32_t m = MOVEMASK(OR(OR(CMPEQ(x, va), CMPEQ(x, vb)), CMPEQ(x, vc)));            \
+			if (m)                                                                              \
+				return p + __builtin_ctz(m);                                                    \
+		}                                                                                       \
+		return find3_scalar(p, end, a, b, c);                                                   \
+	}                                                                                           \
+	attr static const char *skip_blanks_##isa(const char *p, const char *end) {                \
+		const V sp = SET1(' '), ht = SET1('\t'), cr = SET1('\r');                               \
+		for (; end - p >= N; p += N) {                                                          \
+			V x = LOAD((const V *)p);                                                           \
+			uint32_t m = ~MOVEMASK(OR(OR(CMPEQ(x, sp), CMPEQ(x, ht)), CMPEQ(x, cr)));           \
+			if (N < 32)                                                                         \
+				m &= (1u << (N & 31)) - 1;                                                      \
+			if (m)                                                                              \
+				return p + __builtin_ctz(m);                                                    \
+		}                                                                                       \
+		return skip_blanks_scalar(p, end);                                                      \
+	}                                                                                           \
+	attr static const char *find_special_##isa(const char *p, const char *end) {               \
+		/* signed bytes: non-ASCII are negative, hence less than ' ' */                         \
+		const V us = SET1(0x20), del = SET1(0x7f);                                              \
+		for (; end - p >= N; p += N) {                                                          \
+			V x = LOAD((const V *)p);                                                           \
+			uint32_t m = MOVEMASK(OR(CMPGT(us, x), CMPEQ(x, del)));                             \
+			if (m)                                                                              \
+				return p + __builtin_ctz(m);                                                    \
+		}                                                                                       \
+		return find_special_scalar(p, end);                                                     \
+	}                                                                                           \
+	attr static size_t count_##isa(const char *p, const char *end, int c) {                    \
+		const V vc = SET1((char)c);                                                             \
+		size_t n = 0;                                                                           \
+		for (; end - p >= N; p += N)                                                            \
+			n += __builtin_popcount(MOVEMASK(CMPEQ(LOAD((const V *)p), vc)));                   \
+		return n + count_scalar(p, end, c);                                                     \
+	}                                                                                           \
+	static const scan_kernels_t scan_##isa = {                                                  \
+		find3_##isa, skip_blanks_##isa, find_special_##isa, count_##isa                         \
+	};
+
+#define MOVEMASK_SSE2(x) ((uint32_t)_mm_movemask_epi8(x))
+#define MOVEMASK_AVX2(x) ((uint32_t)_mm256_movemask_epi8(x))
+DEFINE_SCAN_KERNELS(sse2, __attribute__((target("sse2"))), __m128i, 16,
+	_mm_loadu_si128, _mm_set1_epi8, _mm_cmpeq_epi8, _mm_cmpgt_epi8, _mm_or_si128, MOVEMASK_SSE2)
+DEFINE_SCAN_KERNELS(avx2, __attribute__((target("avx2"))), __m256i, 32,
+	_mm256_loadu_si256, _mm256_set1_epi8, _mm256_cmpeq_epi8, _mm256_cmpgt_epi8, _mm256_or_si256, MOVEMASK_AVX2)
+#endif
+
+/* Select the scanning kernels for this CPU. */
+static const scan_kernels_t *scan_kernels(void) {
+#ifdef TOML_SIMD_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return &scan_avx2;
+	if (__builtin_cpu_supports("sse2"))
+		return &scan_sse2;
+#endif
+	return &scan_scalar;
+}
+
 enum tokentype_t {
 	INVALID,
 	DOT,
@@ -138,6 +406,8 @@ struct token_t {
 	int eof;
 };
 
+#define TABPATH_MAXLEN 10 /// maximum number of keys in a [header]
+
 typedef struct context_t context_t;
 struct context_t {
 	char *start;
@@ -146,14 +416,23 @@ struct context_t {
 	int errbufsz;
 
 	token_t tok;
-	toml_table_t *root;
-	toml_table_t *curtab;
+	toml_arena_t *arena;   /// decoded values, owned by root when making a tree
+	toml_arena_t *scratch; /// keys, released once their events are emitted
+	bool borrow;           /// values may point into the text
+	bool transient;        /// values are only needed by their events
+	const scan_kernels_t *scan; /// stage 1 kernels
+
+	const toml_handler_t *h; /// consumer of the events
+	void *ud;                /// its data
+	int rc;                  /// nonzero value returned by a callback
+
+	toml_stats_t *stats;     /// statistics of the document, if enabled
+	size_t ntoken;           /// number of tokens seen
 
 	struct {
 		int top;
-		char *key[10];
-		int keylen[10];
-		token_t tok[10];
+		char *key[TABPATH_MAXLEN];
+		int keylen[TABPATH_MAXLEN];
 	} tpath;
 };
 
@@ -162,6 +441,9 @@ struct context_t {
 #define FLINE __FILE__ ":" TOSTRING(__LINE__)
 
 static int next_token(context_t *ctx, bool dotisspecial);
+static void set_token(context_t *ctx, tokentype_t tok, int lineno, char *ptr, int len);
+static void xfree_tab(toml_table_t *p);
+static int shrink_to_fit(context_t *ctx, toml_table_t *tab);
 
 // Error reporting. Call when an error is detected. Always return -1.
 static int e_outofmemory(context_t *ctx, const char *fline) {
@@ -189,6 +471,25 @@ static int e_keyexists(context_t *ctx, int lineno) {
 	return -1;
 }
 
+/* Emit an event without argument. */
+static int emit_event(context_t *ctx, int (*cb)(void *ud)) {
+	if (cb && (ctx->rc = cb(ctx->ud)) != 0)
+		return -1;
+	return 0;
+}
+
+static int emit_key(context_t *ctx, const char *key, int keylen) {
+	if (ctx->h->key && (ctx->rc = ctx->h->key(ctx->ud, key, keylen)) != 0)
+		return -1;
+	return 0;
+}
+
+static int emit_scalar(context_t *ctx, int valtype, const toml_scalar_t *val) {
+	if (ctx->h->scalar && (ctx->rc = ctx->h->scalar(ctx->ud, valtype, val)) != 0)
+		return -1;
+	return 0;
+}
+
 static int e_forbid(context_t *ctx, int lineno, const char *msg) {
 	snprintf(ctx->errbuf, ctx->errbufsz, "line %d: %s", lineno, msg);
 	return -1;
@@ -206,21 +507,39 @@ static void *expand(void *p, int sz, int newsz) {
 	return s;
 }
 
-static void **expand_ptrarr(void **p, int n) {
-	void **s = malloc((n + 1) * sizeof(void *));
+/* Make room for element n in vector p of elements of size sz whose capacity
+ * is *cap. The capacity grows geometrically, so that filling a vector is
+ * linear in its final size. A vector that does not own heap memory (*cap is
+ * 0, e.g. after it has been moved into the arena) is copied, not freed. */
+static void *expand_vec(void *p, int n, int *cap, size_t sz) {
+	if (n < *cap)
+		return p;
+	if (n > INT_MAX / 2)
+		return 0;
+	int newcap = (n < 4 ? 4 : 2 * n);
+	void *s;
+	if (*cap > 0) {
+		s = realloc(p, newcap * sz);
+	} else if ((s = malloc(newcap * sz)) != 0 && n > 0) {
+		memcpy(s, p, n * sz);
+	}
+	if (!s)
+		return 0;
+	*cap = newcap;
+	return s;
+}
+
+static void **expand_ptrarr(void **p, int n, int *cap) {
+	void **s = expand_vec(p, n, cap, sizeof(void *));
 	if (!s)
 		return 0;
 
 	s[n] = 0;
-	if (p) {
-		memcpy(s, p, n * sizeof(void *));
-		free(p);
-	}
 	return s;
 }
 
-static toml_arritem_t *expand_arritem(toml_arritem_t *p, int n) {
-	toml_arritem_t *pp = expand(p, n * sizeof(*p), (n + 1) * sizeof(*p));
+static toml_arritem_t *expand_arritem(toml_arritem_t *p, int n, int *cap) {
+	toml_arritem_t *pp = expand_vec(p, n, cap, sizeof(*p));
 	if (!pp)
 		return 0;
 
@@ -240,7 +559,7 @@ static char *norm_lit_str(const char *src, int srclen, int *len, bool multiline,
 
 	for (;;) { /// scan forward on src
 		if (off >= max - 10) { /// have some slack for misc stuff
-			int newmax = max + 50;
+			int newmax = 2 * max + 50;
 			char *x = expand(dst, max, newmax);
 			if (!x) {
 				xfree(dst);
@@ -308,7 +627,7 @@ static char *norm_basic_str(const char *src, int srclen, int *len, bool multilin
 	/// scan forward on src
 	for (;;) {
 		if (off >= max - 10) { /// have some slack for misc stuff
-			int newmax = max + 50;
+			int newmax = 2 * max + 50;
 			char *x = expand(dst, max, newmax);
 			if (!x) {
 				xfree(dst);
@@ -441,7 +760,7 @@ static char *normalize_key(context_t *ctx, token_t strtok, int *keylen) {
 	// Quoted string
 	if (ch == '\'' || ch == '\"') {
 		/// if ''' or """, take 3 chars off front and back. Else, take 1 char off.
-		bool multiline = (sp[1] == ch && sp[2] == ch);
+		bool multiline = (strtok.len >= 6 && sp[1] == ch && sp[2] == ch);
 		if (multiline)
 			sp += 3, sq -= 3;
 		else
@@ -456,29 +775,213 @@ static char *normalize_key(context_t *ctx, token_t strtok, int *keylen) {
 			e_syntax(ctx, lineno, ebuf);
 			return 0;
 		}
-		return ret;
+		char *key = arena_strndup(ctx->scratch, ret, *keylen);
+		xfree(ret);
+		if (!key)
+			e_outofmemory(ctx, FLINE);
+		return key;
 	}
 
 	*keylen = 0;
 	for (const char *c = sp; c != sq; c++) { /// Bare key: allow: [A-Za-z0-9_-]+
 		*keylen = *keylen + 1;
-		if (isalnum(*c) || *c == '_' || *c == '-')
+		if (CCLASS(*c, CC_BARE))
 			continue;
 		e_badkey(ctx, lineno);
 		return 0;
 	}
 
-	if (!(ret = STRNDUP(sp, sq - sp))) { /// dup and return
+	if (!(ret = arena_strndup(ctx->scratch, sp, sq - sp))) { /// dup and return
 		e_outofmemory(ctx, FLINE);
 		return 0;
 	}
 	return ret;
 }
 
-/* Look up key in tab. Return 0 if not found, or
+// Hash index of the keys of a table. Small tables are searched linearly;
+// from INDEX_MINLEN entries on, a table gets an open-addressing hash index
+// (power of 2 size, linear probing, at most half full) that is maintained by
+// the parser and used by all key lookups. An entry is encoded as its index in
+// the kval, arr or tab vector shifted left by 2 and or'ed with its kind.
+#define INDEX_MINLEN 8
+#define ENTRY_KVAL 1
+#define ENTRY_ARR  2
+#define ENTRY_TAB  3
+#define ENTRY(idx, kind) (((idx) << 2) | (kind))
+
+struct toml_keyslot_t {
+	uint32_t hash;
+	int entry; /// 0 for an empty slot
+};
+
+static uint32_t hash_key(const char *key) {
+	uint32_t h = 2166136261u; /// FNV-1a
+	for (const unsigned char *p = (const unsigned char *)key; *p; p++)
+		h = (h ^ *p) * 16777619u;
+	return h;
+}
+
+// Interned keys. The keys of the tables are stored in the arena preceded by
+// their length and their hash, and an open-addressing index of the arena
+// (power of 2 size, linear probing, at most half full) finds them again while
+// parsing, so that the entries of a document share the allocation of their
+// key: the field names of an array of tables are stored once, not once per
+// item. The index is bounded to stay in cache; once full, it is cleared, so
+// a key may be stored again after many others. Keys then compare by address
+// first, and by hash before the characters otherwise.
+#define KEYHASH(key) (((const uint32_t *)(key))[-1])
+#define KEYLEN(key)  (((const uint32_t *)(key))[-2])
+#define KEYSLOT_MINLEN 64
+#define KEYSLOT_MAXLEN 4096
+
+static void insert_keyslot(keyslot_t *slot, int nslot, uint32_t hash, const char *key) {
+	uint32_t mask = nslot - 1;
+	uint32_t i = hash & mask;
+	while (slot[i].key)
+		i = (i + 1) & mask;
+	slot[i].hash = hash;
+	slot[i].key = key;
+}
+
+/* Return the interned copy of key in arena a, making it if needed. Return 0
+ * if out of memory. */
+static const char *intern_key(toml_arena_t *a, const char *key, int keylen) {
+	uint32_t hash = hash_key(key);
+	uint32_t mask = a->nkeyslot - 1;
+	if (a->nkeyslot) {
+		for (uint32_t i = hash & mask; a->keyslot[i].key; i = (i + 1) & mask) {
+			const char *k = a->keyslot[i].key;
+			if (a->keyslot[i].hash == hash && KEYLEN(k) == (uint32_t)keylen && memcmp(k, key, keylen) == 0)
+				return k;
+		}
+	}
+
+	uint32_t *hdr = arena_alloc(a, 2 * sizeof(*hdr) + keylen + 1);
+	if (!hdr)
+		return 0;
+	hdr[0] = keylen;
+	hdr[1] = hash;
+	char *k = (char *)(hdr + 2);
+	memcpy(k, key, keylen);
+	k[keylen] = 0;
+
+	if (2 * (a->nkey + 1) > a->nkeyslot && a->nkeyslot < KEYSLOT_MAXLEN) {
+		int nslot = a->nkeyslot ? 2 * a->nkeyslot : KEYSLOT_MINLEN;
+		keyslot_t *slot = malloc(nslot * sizeof(*slot));
+		if (slot) { /// otherwise, keep the index as it is
+			memset(slot, 0, nslot * sizeof(*slot));
+			for (int i = 0; i < a->nkeyslot; i++)
+				if (a->keyslot[i].key)
+					insert_keyslot(slot, nslot, a->keyslot[i].hash, a->keyslot[i].key);
+			free(a->keyslot);
+			a->keyslot = slot;
+			a->nkeyslot = nslot;
+		}
+	}
+	if (a->nkeyslot == 0) /// no index: the key is not shared
+		return k;
+	if (2 * (a->nkey + 1) > a->nkeyslot) { /// full: start again
+		memset(a->keyslot, 0, a->nkeyslot * sizeof(*a->keyslot));
+		a->nkey = 0;
+	}
+	insert_keyslot(a->keyslot, a->nkeyslot, hash, k);
+	a->nkey++;
+	return k;
+}
+
+/* Forget the interned keys of arena a, once the parser is done with it. */
+static void drop_keyslots(toml_arena_t *a) {
+	free(a->keyslot);
+	a->keyslot = 0;
+	a->nkeyslot = a->nkey = 0;
+}
+
+static const char *entry_key(const toml_table_t *tab, int entry) {
+	int i = entry >> 2;
+	switch (entry & 3) {
+		case ENTRY_KVAL: return tab->kval[i]->key;
+		case ENTRY_ARR:  return tab->arr[i]->key;
+		default:         return tab->tab[i]->key;
+	}
+}
+
+static void insert_slot(toml_keyslot_t *slot, int nslot, uint32_t hash, int entry) {
+	uint32_t mask = nslot - 1;
+	uint32_t i = hash & mask;
+	while (slot[i].entry)
+		i = (i + 1) & mask;
+	slot[i].hash = hash;
+	slot[i].entry = entry;
+}
+
+/* Whether the interned key k is key, whose hash is given. */
+#define SAME_KEY(k, key, hash) \
+	((k) == (key) || (KEYHASH(k) == (hash) && strcmp((k), (key)) == 0))
+
+/* Find the entry for key, whose hash is given, in tab. Return 0 if not
+ * found. */
+static int find_key(const toml_table_t *tab, const char *key, uint32_t hash) {
+	int i;
+
+	if (tab->nslot) {
+		uint32_t mask = tab->nslot - 1;
+		for (uint32_t j = hash & mask; tab->slot[j].entry; j = (j + 1) & mask) {
+			const char *k = entry_key(tab, tab->slot[j].entry);
+			if (tab->slot[j].hash == hash && (k == key || strcmp(key, k) == 0))
+				return tab->slot[j].entry;
+		}
+		return 0;
+	}
+
+	for (i = 0; i < tab->nkval; i++)
+		if (SAME_KEY(tab->kval[i]->key, key, hash))
+			return ENTRY(i, ENTRY_KVAL);
+	for (i = 0; i < tab->narr; i++)
+		if (SAME_KEY(tab->arr[i]->key, key, hash))
+			return ENTRY(i, ENTRY_ARR);
+	for (i = 0; i < tab->ntab; i++)
+		if (SAME_KEY(tab->tab[i]->key, key, hash))
+			return ENTRY(i, ENTRY_TAB);
+	return 0;
+}
+
+/* Register a newly appended entry in the hash index of tab, creating or
+ * growing the index as needed. Return -1 if out of memory. */
+static int index_entry(toml_table_t *tab, int entry) {
+	int n = tab->nkval + tab->narr + tab->ntab;
+	if (n < INDEX_MINLEN)
+		return 0;
+	if (2 * n <= tab->nslot) {
+		insert_slot(tab->slot, tab->nslot, KEYHASH(entry_key(tab, entry)), entry);
+		return 0;
+	}
+
+	int nslot = 4 * INDEX_MINLEN;
+	while (nslot < 4 * n) {
+		if (nslot > INT_MAX / 2)
+			return -1;
+		nslot *= 2;
+	}
+	toml_keyslot_t *slot = malloc(nslot * sizeof(*slot));
+	if (!slot)
+		return -1;
+	memset(slot, 0, nslot * sizeof(*slot));
+	for (int i = 0; i < tab->nkval; i++)
+		insert_slot(slot, nslot, KEYHASH(tab->kval[i]->key), ENTRY(i, ENTRY_KVAL));
+	for (int i = 0; i < tab->narr; i++)
+		insert_slot(slot, nslot, KEYHASH(tab->arr[i]->key), ENTRY(i, ENTRY_ARR));
+	for (int i = 0; i < tab->ntab; i++)
+		insert_slot(slot, nslot, KEYHASH(tab->tab[i]->key), ENTRY(i, ENTRY_TAB));
+	if (tab->slotcap)
+		xfree(tab->slot);
+	tab->slot = slot;
+	tab->nslot = tab->slotcap = nslot;
+	return 0;
+}
+
+/* Look up the interned key in tab. Return 0 if not found, or
  * 'v'alue, 'a'rray or 't'able depending on the element. */
 static int check_key(toml_table_t *tab, const char *key, toml_keyval_t **ret_val, toml_array_t **ret_arr, toml_table_t **ret_tab) {
-	int i;
 	void *dummy;
 
 	if (!ret_tab)
@@ -492,23 +995,17 @@ static int check_key(toml_table_t *tab, const char *key, toml_keyval_t **ret_val
 	*ret_arr = 0;
 	*ret_val = 0;
 
-	for (i = 0; i < tab->nkval; i++) {
-		if (strcmp(key, tab->kval[i]->key) == 0) {
-			*ret_val = tab->kval[i];
+	int entry = find_key(tab, key, KEYHASH(key));
+	switch (entry & 3) {
+		case ENTRY_KVAL:
+			*ret_val = tab->kval[entry >> 2];
 			return 'v';
-		}
-	}
-	for (i = 0; i < tab->narr; i++) {
-		if (strcmp(key, tab->arr[i]->key) == 0) {
-			*ret_arr = tab->arr[i];
+		case ENTRY_ARR:
+			*ret_arr = tab->arr[entry >> 2];
 			return 'a';
-		}
-	}
-	for (i = 0; i < tab->ntab; i++) {
-		if (strcmp(key, tab->tab[i]->key) == 0) {
-			*ret_tab = tab->tab[i];
+		case ENTRY_TAB:
+			*ret_tab = tab->tab[entry >> 2];
 			return 't';
-		}
 	}
 	return 0;
 }
@@ -517,121 +1014,107 @@ static int key_kind(toml_table_t *tab, const char *key) {
 	return check_key(tab, key, 0, 0, 0);
 }
 
-/* Create a keyval in the table. */
-static toml_keyval_t *create_keyval_in_table(context_t *ctx, toml_table_t *tab, token_t keytok) {
-	int keylen;
-	char *newkey = normalize_key(ctx, keytok, &keylen);
-	if (!newkey)
-		return 0;
-
-	toml_keyval_t *dest = 0;
-	if (key_kind(tab, newkey)) {
-		xfree(newkey);
-		e_keyexists(ctx, keytok.lineno);
+/* Create a keyval in the table. The key must be interned (see intern_key). */
+static toml_keyval_t *create_keyval_in_table(context_t *ctx, toml_table_t *tab, const char *key, int keylen) {
+	if (key_kind(tab, key)) {
+		e_keyexists(ctx, ctx->tok.lineno);
 		return 0;
 	}
 
 	int n = tab->nkval;
 	toml_keyval_t **base;
-	if ((base = (toml_keyval_t **)expand_ptrarr((void **)tab->kval, n)) == 0) {
-		xfree(newkey);
+	if ((base = (toml_keyval_t **)expand_ptrarr((void **)tab->kval, n, &tab->kvalcap)) == 0) {
 		e_outofmemory(ctx, FLINE);
 		return 0;
 	}
 	tab->kval = base;
 
-	if ((base[n] = (toml_keyval_t *)CALLOC(1, sizeof(*base[n]))) == 0) {
-		xfree(newkey);
+	if ((base[n] = (toml_keyval_t *)arena_calloc(ctx->arena, 1, sizeof(*base[n]))) == 0) {
 		e_outofmemory(ctx, FLINE);
 		return 0;
 	}
+	base[n]->key = key;
 
-	dest = tab->kval[tab->nkval++];
-	dest->key = newkey;
+	toml_keyval_t *dest = tab->kval[tab->nkval++];
 	dest->keylen = keylen;
+	if (index_entry(tab, ENTRY(n, ENTRY_KVAL))) {
+		e_outofmemory(ctx, FLINE);
+		return 0;
+	}
 	return dest;
 }
 
-// Create a table in the table.
-static toml_table_t *create_keytable_in_table(context_t *ctx, toml_table_t *tab, token_t keytok) {
-	int keylen;
-	char *newkey = normalize_key(ctx, keytok, &keylen);
-	if (!newkey)
-		return 0;
-
+// Create a table in the table. The key must be interned (see intern_key).
+static toml_table_t *create_keytable_in_table(context_t *ctx, toml_table_t *tab, const char *key, int keylen) {
 	toml_table_t *dest = 0;
-	if (check_key(tab, newkey, 0, 0, &dest)) {
-		xfree(newkey);
-
+	if (check_key(tab, key, 0, 0, &dest)) {
 		/// Special case: make explicit if table exists and was created
 		/// implicitly.
 		if (dest && dest->implicit) {
 			dest->implicit = false;
 			return dest;
 		}
-		e_keyexists(ctx, keytok.lineno);
+		e_keyexists(ctx, ctx->tok.lineno);
 		return 0;
 	}
 
 	int n = tab->ntab;
 	toml_table_t **base;
-	if ((base = (toml_table_t **)expand_ptrarr((void **)tab->tab, n)) == 0) {
-		xfree(newkey);
+	if ((base = (toml_table_t **)expand_ptrarr((void **)tab->tab, n, &tab->tabcap)) == 0) {
 		e_outofmemory(ctx, FLINE);
 		return 0;
 	}
 	tab->tab = base;
 
-	if ((base[n] = (toml_table_t *)CALLOC(1, sizeof(*base[n]))) == 0) {
-		xfree(newkey);
+	if ((base[n] = (toml_table_t *)arena_calloc(ctx->arena, 1, sizeof(*base[n]))) == 0) {
 		e_outofmemory(ctx, FLINE);
 		return 0;
 	}
+	base[n]->key = key;
 
 	dest = tab->tab[tab->ntab++];
-	dest->key = newkey;
 	dest->keylen = keylen;
+	if (index_entry(tab, ENTRY(n, ENTRY_TAB))) {
+		e_outofmemory(ctx, FLINE);
+		return 0;
+	}
 	return dest;
 }
 
-// Create an array in the table.
-static toml_array_t *create_keyarray_in_table(context_t *ctx, toml_table_t *tab, token_t keytok, char kind) {
-	int keylen;
-	char *newkey = normalize_key(ctx, keytok, &keylen);
-	if (!newkey)
-		return 0;
-
-	if (key_kind(tab, newkey)) {
-		xfree(newkey);
-		e_keyexists(ctx, keytok.lineno);
+// Create an array in the table. The key must be interned (see intern_key).
+static toml_array_t *create_keyarray_in_table(context_t *ctx, toml_table_t *tab, const char *key, int keylen, char kind) {
+	if (key_kind(tab, key)) {
+		e_keyexists(ctx, ctx->tok.lineno);
 		return 0;
 	}
 
 	int n = tab->narr;
 	toml_array_t **base;
-	if ((base = (toml_array_t **)expand_ptrarr((void **)tab->arr, n)) == 0) {
-		xfree(newkey);
+	if ((base = (toml_array_t **)expand_ptrarr((void **)tab->arr, n, &tab->arrcap)) == 0) {
 		e_outofmemory(ctx, FLINE);
 		return 0;
 	}
 	tab->arr = base;
 
-	if ((base[n] = (toml_array_t *)CALLOC(1, sizeof(*base[n]))) == 0) {
-		xfree(newkey);
+	if ((base[n] = (toml_array_t *)arena_calloc(ctx->arena, 1, sizeof(*base[n]))) == 0) {
 		e_outofmemory(ctx, FLINE);
 		return 0;
 	}
+	base[n]->key = key;
 	toml_array_t *dest = tab->arr[tab->narr++];
 
 	dest->keylen = keylen;
-	dest->key = newkey;
 	dest->kind = kind;
+	if (index_entry(tab, ENTRY(n, ENTRY_ARR))) {
+		e_outofmemory(ctx, FLINE);
+		return 0;
+	}
 	return dest;
 }
 
 static toml_arritem_t *create_value_in_array(context_t *ctx, toml_array_t *parent) {
 	const int n = parent->nitem;
-	toml_arritem_t *base = expand_arritem(parent->item, n);
+	toml_arritem_t *base = expand_arritem(parent->item, n, &parent->itemcap);
 	if (!base) {
 		e_outofmemory(ctx, FLINE);
 		return 0;
@@ -645,18 +1128,18 @@ static toml_arritem_t *create_value_in_array(context_t *ctx, toml_array_t *paren
 static toml_array_t *create_array_in_array(context_t *ctx,
 		toml_array_t *parent) {
 	const int n = parent->nitem;
-	toml_arritem_t *base = expand_arritem(parent->item, n);
+	toml_arritem_t *base = expand_arritem(parent->item, n, &parent->itemcap);
 	if (!base) {
 		e_outofmemory(ctx, FLINE);
 		return 0;
 	}
-	toml_array_t *ret = (toml_array_t *)CALLOC(1, sizeof(toml_array_t));
+	parent->item = base;
+	toml_array_t *ret = (toml_array_t *)arena_calloc(ctx->arena, 1, sizeof(toml_array_t));
 	if (!ret) {
 		e_outofmemory(ctx, FLINE);
 		return 0;
 	}
 	base[n].arr = ret;
-	parent->item = base;
 	parent->nitem++;
 	return ret;
 }
@@ -664,18 +1147,18 @@ static toml_array_t *create_array_in_array(context_t *ctx,
 /* Create a table in an array */
 static toml_table_t *create_table_in_array(context_t *ctx, toml_array_t *parent) {
 	int n = parent->nitem;
-	toml_arritem_t *base = expand_arritem(parent->item, n);
+	toml_arritem_t *base = expand_arritem(parent->item, n, &parent->itemcap);
 	if (!base) {
 		e_outofmemory(ctx, FLINE);
 		return 0;
 	}
-	toml_table_t *ret = (toml_table_t *)CALLOC(1, sizeof(toml_table_t));
+	parent->item = base;
+	toml_table_t *ret = (toml_table_t *)arena_calloc(ctx->arena, 1, sizeof(toml_table_t));
 	if (!ret) {
 		e_outofmemory(ctx, FLINE);
 		return 0;
 	}
 	base[n].tab = ret;
-	parent->item = base;
 	parent->nitem++;
 	return ret;
 }
@@ -690,7 +1173,8 @@ static int skip_newlines(context_t *ctx, bool isdotspecial) {
 	return 0;
 }
 
-static int parse_keyval(context_t *ctx, toml_table_t *tab);
+static int parse_keyval(context_t *ctx);
+static int parse_array(context_t *ctx);
 
 static inline int eat_token(context_t *ctx, tokentype_t typ, bool isdotspecial, const char *fline) {
 	if (ctx->tok.tok != typ)
@@ -703,7 +1187,9 @@ static inline int eat_token(context_t *ctx, tokentype_t typ, bool isdotspecial,
 }
 
 /* We are at '{ ... }'; parse the table. */
-static int parse_inline_table(context_t *ctx, toml_table_t *tab) {
+static int parse_inline_table(context_t *ctx) {
+	if (emit_event(ctx, ctx->h->inline_table_begin))
+		return -1;
 	if (eat_token(ctx, LBRACE, 1, FLINE))
 		return -1;
 
@@ -717,7 +1203,7 @@ static int parse_inline_table(context_t *ctx, toml_table_t *tab) {
 		if (ctx->tok.tok != STRING)
 			return e_syntax(ctx, ctx->tok.lineno, "expect a string");
 
-		if (parse_keyval(ctx, tab))
+		if (parse_keyval(ctx))
 			return -1;
 
 		if (ctx->tok.tok == NEWLINE)
@@ -734,32 +1220,147 @@ static int parse_inline_table(context_t *ctx, toml_table_t *tab) {
 
 	if (eat_token(ctx, RBRACE, 1, FLINE))
 		return -1;
-	tab->readonly = 1;
-	return 0;
+	return emit_event(ctx, ctx->h->inline_table_end);
 }
 
-static int valtype(const char *val) {
-	toml_timestamp_t ts;
-	if (*val == '\'' || *val == '"')
+/* Check that the len bytes at src are valid UTF-8 without control
+ * characters other than tab (and CR/LF if multiline), like norm_lit_str()
+ * does, but without making a copy. */
+static bool valid_str(const scan_kernels_t *scan, const char *src, int len, bool multiline) {
+	const char *sp = src;
+	const char *sq = src + len;
+	while ((sp = scan->find_special(sp, sq)) < sq) { /// skip plain ASCII
+		uint8_t l = u8length(sp);
+		if (l == 0 || sq - sp < l)
+			return false;
+		if (l > 1) {
+			for (int i = 0; i < l; i++)
+				if ((*sp++ & 0x80) != 0x80)
+					return false;
+			continue;
+		}
+		char ch = *sp++;
+		if ((0 <= ch && ch <= 0x08) || (0x0a <= ch && ch <= 0x1f) || ch == 0x7f) {
+			if (!(multiline && (ch == '\r' || ch == '\n')))
+				return false;
+		}
+	}
+	return true;
+}
+
+/* Decode the quoted string of len bytes at src. Unless it has escapes to
+ * process, the string is not copied when the text is kept with the document.
+ * Return the value type, or 0 if out of memory. */
+static int decode_string(context_t *ctx, const char *src, int len, toml_scalar_t *u) {
+	int qchar = src[0];
+	bool multiline = false;
+	const char *sp;
+	const char *sq;
+
+	if (len >= 6 && src[1] == qchar && src[2] == qchar) {
+		multiline = true;      /// triple-quote implies multiline
+		sp = src + 3;          /// first char after quote
+		sq = src + len - 3;    /// first char of ending quote
+		if (sp[0] == '\n')     /// skip new line immediate after qchar
+			sp++;
+		else if (sp[0] == '\r' && sp < sq && sp[1] == '\n')
+			sp += 2;
+	} else {
+		sp = src + 1;          /// first char after quote
+		sq = src + len - 1;    /// ending quote
+	}
+	if (sq < sp)
+		return 'u';
+
+	if (qchar == '\'' || !memchr(sp, '\\', sq - sp)) {
+		/// Nothing to unescape.
+		if (!valid_str(ctx->scan, sp, sq - sp, multiline))
+			return 'u';
+		if (ctx->borrow)
+			u->s.ptr = sp;
+		else if (!(u->s.ptr = arena_strndup(ctx->arena, sp, sq - sp)))
+			return 0;
+		u->s.len = sq - sp;
 		return 's';
-	if (toml_value_bool(val, false) == 0)
-		return 'b';
-	if (toml_value_int(val, 0) == 0)
+	}
+
+	int slen;
+	char *str = norm_basic_str(sp, sq - sp, &slen, multiline, false, 0, 0);
+	if (!str)
+		return 'u';
+	u->s.ptr = arena_strndup(ctx->arena, str, slen);
+	u->s.len = slen;
+	xfree(str);
+	return u->s.ptr ? 's' : 0;
+}
+
+/* Decode the raw value of len bytes at val once for all. Store the decoded
+ * value in u and return its type, or 0 if out of memory. */
+static int decode_value(context_t *ctx, const char *val, int len, toml_scalar_t *u) {
+	if (*val == '\'' || *val == '"')
+		return decode_string(ctx, val, len, u);
+
+	if (len == 4 && memcmp(val, "true", 4) == 0)
+		return u->b = true, 'b';
+	if (len == 5 && memcmp(val, "false", 5) == 0)
+		return u->b = false, 'b';
+	if (decode_int(val, val + len, &u->i) == 0)
 		return 'i';
-	if (toml_value_double(val, 0) == 0)
+	if (decode_float(val, val + len, &u->d) == 0)
 		return 'd';
-	if (toml_value_timestamp(val, &ts) == 0) {
-		if (ts.year && ts.hour)
-			return 'T'; /// timestamp
-		if (ts.year)
+
+	/// Timestamps are short, decode them from a NUL-terminated copy.
+	char buf[128];
+	if (len >= (int)sizeof(buf))
+		return 'u';
+	memcpy(buf, val, len);
+	buf[len] = 0;
+	toml_timestamp_t ts;
+	if (toml_value_timestamp(buf, &ts) == 0) {
+		if (!(u->ts = arena_alloc(ctx->arena, sizeof(ts))))
+			return 0;
+		*u->ts = ts;
+		if (ts.kind == 'D')
 			return 'D'; /// date
-		return 't';   /// time
+		if (ts.kind == 't')
+			return 't'; /// time
+		return 'T';     /// timestamp
 	}
 	return 'u'; /// unknown
 }
 
+/* Parse the value at the current token and emit its events. */
+static int parse_value(context_t *ctx, bool dotisspecial) {
+	switch (ctx->tok.tok) {
+		case STRING: {
+			toml_scalar_t u;
+			int type = decode_value(ctx, ctx->tok.ptr, ctx->tok.len, &u);
+			if (!type)
+				return e_outofmemory(ctx, FLINE);
+			int ret = emit_scalar(ctx, type, &u);
+			if (ctx->transient) { /// value only needed by the event
+				if (type == 's') /// no-op for a view in the text
+					arena_release(ctx->arena, u.s.ptr);
+				else if (type == 'D' || type == 't' || type == 'T')
+					arena_release(ctx->arena, u.ts);
+			}
+			if (ret)
+				return -1;
+			return next_token(ctx, dotisspecial);
+		}
+		case LBRACKET: /* [ array ] */
+			return parse_array(ctx);
+		case LBRACE: /* { table } */
+			return parse_inline_table(ctx);
+		default:
+			return e_syntax(ctx, ctx->tok.lineno, "syntax error");
+	}
+}
+
 /* We are at '[...]' */
-static int parse_array(context_t *ctx, toml_array_t *arr) {
+static int parse_array(context_t *ctx) {
+	if (emit_event(ctx, ctx->h->array_begin))
+		return -1;
 	if (eat_token(ctx, LBRACKET, 0, FLINE))
 		return -1;
 
@@ -770,68 +1371,8 @@ static int parse_array(context_t *ctx, toml_array_t *arr) {
 		if (ctx->tok.tok == RBRACKET) /// until ]
 			break;
 
-		switch (ctx->tok.tok) {
-			case STRING: {
-				/// set array kind if this will be the first entry
-				if (arr->kind == 0)
-					arr->kind = 'v';
-				else if (arr->kind != 'v')
-					arr->kind = 'm';
-
-				char *val = ctx->tok.ptr;
-				int vlen = ctx->tok.len;
-
-				/// make a new value in array
-				toml_arritem_t *newval = create_value_in_array(ctx, arr);
-				if (!newval)
-					return e_outofmemory(ctx, FLINE);
-
-				if (!(newval->val = STRNDUP(val, vlen)))
-					return e_outofmemory(ctx, FLINE);
-
-				newval->valtype = valtype(newval->val);
-
-				/// set array type if this is the first entry
-				if (arr->nitem == 1)
-					arr->type = newval->valtype;
-				else if (arr->type != newval->valtype)
-					arr->type = 'm'; /// mixed
-
-				if (eat_token(ctx, ctx->tok.tok, 0, FLINE))
-					return -1;
-				break;
-			}
-			case LBRACKET: { /* [ [array], [array] ... ] */
-				/* set the array kind if this will be the first entry */
-				if (arr->kind == 0)
-					arr->kind = 'a';
-				else if (arr->kind != 'a')
-					arr->kind = 'm';
-
-				toml_array_t *subarr = create_array_in_array(ctx, arr);
-				if (!subarr)
-					return -1;
-				if (parse_array(ctx, subarr))
-					return -1;
-				break;
-			}
-			case LBRACE: { /* [ {table}, {table} ... ] */
-				/* set the array kind if this will be the first entry */
-				if (arr->kind == 0)
-					arr->kind = 't';
-				else if (arr->kind != 't')
-					arr->kind = 'm';
-
-				toml_table_t *subtab = create_table_in_array(ctx, arr);
-				if (!subtab)
-					return -1;
-				if (parse_inline_table(ctx, subtab))
-					return -1;
-				break;
-			}
-			default:
-				return e_syntax(ctx, ctx->tok.lineno, "syntax error");
-		}
+		if (parse_value(ctx, false))
+			return -1;
 
 		if (skip_newlines(ctx, 0))
 			return -1;
@@ -845,6 +1386,8 @@ static int parse_array(context_t *ctx, toml_array_t *arr) {
 		break;
 	}
 
+	if (emit_event(ctx, ctx->h->array_end))
+		return -1;
 	if (eat_token(ctx, RBRACKET, 1, FLINE))
 		return -1;
 	return 0;
@@ -854,107 +1397,55 @@ static int parse_array(context_t *ctx, toml_array_t *arr) {
    key = "value"
    key = [ array ]
    key = { table } */
-static int parse_keyval(context_t *ctx, toml_table_t *tab) {
-	if (tab->readonly) {
-		return e_forbid(ctx, ctx->tok.lineno, "cannot insert new entry into existing table");
-	}
+static int parse_keyval(context_t *ctx) {
+	if (ctx->tok.tok != STRING)
+		return e_internal(ctx, FLINE);
 
-	token_t key = ctx->tok;
-	if (eat_token(ctx, STRING, 1, FLINE))
+	int keylen;
+	char *key = normalize_key(ctx, ctx->tok, &keylen);
+	if (!key)
 		return -1;
 
+	int ret = -1;
+	if (emit_key(ctx, key, keylen))
+		goto done;
+	if (eat_token(ctx, STRING, 1, FLINE))
+		goto done;
+
 	if (ctx->tok.tok == DOT) {
 		/* handle inline dotted key. e.g.
 		   physical.color = "orange"
 		   physical.shape = "round" */
-		toml_table_t *subtab = 0;
-		{
-			int keylen;
-			char *subtabstr = normalize_key(ctx, key, &keylen);
-			if (!subtabstr)
-				return -1;
-
-			subtab = toml_table_table(tab, subtabstr);
-			if (subtab)
-				subtab->keylen = keylen;
-			xfree(subtabstr);
-		}
-		if (!subtab) {
-			subtab = create_keytable_in_table(ctx, tab, key);
-			if (!subtab)
-				return -1;
-		}
 		if (next_token(ctx, true))
-			return -1;
-		if (parse_keyval(ctx, subtab))
-			return -1;
-		return 0;
+			goto done;
+		ret = parse_keyval(ctx);
+		goto done;
 	}
 
-	if (ctx->tok.tok != EQUAL)
-		return e_syntax(ctx, ctx->tok.lineno, "missing =");
+	if (ctx->tok.tok != EQUAL) {
+		e_syntax(ctx, ctx->tok.lineno, "missing =");
+		goto done;
+	}
 
 	if (next_token(ctx, false))
-		return -1;
+		goto done;
 
-	switch (ctx->tok.tok) {
-		case STRING: { // key = "value"
-			toml_keyval_t *keyval = create_keyval_in_table(ctx, tab, key);
-			if (!keyval)
-				return -1;
-			token_t val = ctx->tok;
+	ret = parse_value(ctx, true);
 
-			assert(keyval->val == 0);
-			if (!(keyval->val = STRNDUP(val.ptr, val.len)))
-				return e_outofmemory(ctx, FLINE);
+done:
+	arena_release(ctx->scratch, key);
+	return ret;
+}
 
-			if (next_token(ctx, true))
-				return -1;
-
-			return 0;
-		}
-		case LBRACKET: { /* key = [ array ] */
-			toml_array_t *arr = create_keyarray_in_table(ctx, tab, key, 0);
-			if (!arr)
-				return -1;
-			if (parse_array(ctx, arr))
-				return -1;
-			return 0;
-		}
-		case LBRACE: { /* key = { table } */
-			toml_table_t *nxttab = create_keytable_in_table(ctx, tab, key);
-			if (!nxttab)
-				return -1;
-			if (parse_inline_table(ctx, nxttab))
-				return -1;
-			return 0;
-		}
-		default:
-			return e_syntax(ctx, ctx->tok.lineno, "syntax error");
-	}
-	return 0;
-}
-
-typedef struct tabpath_t tabpath_t;
-struct tabpath_t {
-	int cnt;
-	token_t key[10];
-};
-
-/* at [x.y.z] or [[x.y.z]]
- * Scan forward and fill tabpath until it enters ] or ]]
- * There will be at least one entry on return. */
-static int fill_tabpath(context_t *ctx) {
-	// clear tpath
-	for (int i = 0; i < ctx->tpath.top; i++) {
-		char **p = &ctx->tpath.key[i];
-		xfree(*p);
-		*p = 0;
-	}
-	ctx->tpath.top = 0;
+/* at [x.y.z] or [[x.y.z]]
+ * Scan forward and fill tabpath until it enters ] or ]]
+ * There will be at least one entry on return. */
+static int fill_tabpath(context_t *ctx) {
+	// clear tpath; keys live in the scratch arena
+	ctx->tpath.top = 0;
 
 	for (;;) {
-		if (ctx->tpath.top >= 10)
+		if (ctx->tpath.top >= TABPATH_MAXLEN)
 			return e_syntax(ctx, ctx->tok.lineno, "table path is too deep; max allowed is 10.");
 		if (ctx->tok.tok != STRING)
 			return e_syntax(ctx, ctx->tok.lineno, "invalid or missing key");
@@ -963,7 +1454,6 @@ static int fill_tabpath(context_t *ctx) {
 		char *key = normalize_key(ctx, ctx->tok, &keylen);
 		if (!key)
 			return -1;
-		ctx->tpath.tok[ctx->tpath.top] = ctx->tok;
 		ctx->tpath.key[ctx->tpath.top] = key;
 		ctx->tpath.keylen[ctx->tpath.top] = keylen;
 		ctx->tpath.top++;
@@ -984,58 +1474,9 @@ static int fill_tabpath(context_t *ctx) {
 	return 0;
 }
 
-/* Walk tabpath from the root, and create new tables on the way.
- * Sets ctx->curtab to the final table. */
-static int walk_tabpath(context_t *ctx) {
-	toml_table_t *curtab = ctx->root; /// start from root
-
-	for (int i = 0; i < ctx->tpath.top; i++) {
-		const char *key = ctx->tpath.key[i];
-		int keylen = ctx->tpath.keylen[i];
-
-		toml_keyval_t *nextval = 0;
-		toml_array_t *nextarr = 0;
-		toml_table_t *nexttab = 0;
-		switch (check_key(curtab, key, &nextval, &nextarr, &nexttab)) {
-			case 't': /// found a table. nexttab is where we will go next.
-				break;
-			case 'a': /// found an array. nexttab is the last table in the array.
-				if (nextarr->kind != 't')
-					return e_internal(ctx, FLINE);
-
-				if (nextarr->nitem == 0)
-					return e_internal(ctx, FLINE);
-
-				nexttab = nextarr->item[nextarr->nitem - 1].tab;
-				break;
-			case 'v':
-				return e_keyexists(ctx, ctx->tpath.tok[i].lineno);
-			default: { /// Not found. Let's create an implicit table.
-				int n = curtab->ntab;
-				toml_table_t **base = (toml_table_t **)expand_ptrarr((void **)curtab->tab, n);
-				if (base == 0)
-					return e_outofmemory(ctx, FLINE);
-
-				curtab->tab = base;
-
-				if ((base[n] = (toml_table_t *)CALLOC(1, sizeof(*base[n]))) == 0)
-					return e_outofmemory(ctx, FLINE);
-
-				if ((base[n]->key = STRDUP(key)) == 0)
-					return e_outofmemory(ctx, FLINE);
-				base[n]->keylen = keylen;
-
-				nexttab = curtab->tab[curtab->ntab++];
-
-				/// tabs created by walk_tabpath are considered implicit
-				nexttab->implicit = true;
-			}; break;
-		}
-		curtab = nexttab; /// switch to next tab
-	}
-
-	ctx->curtab = curtab; /// save it
-	return 0;
+static void clear_tabpath(context_t *ctx) {
+	while (ctx->tpath.top > 0)
+		arena_release(ctx->scratch, ctx->tpath.key[--ctx->tpath.top]);
 }
 
 /* handle lines like [x.y.z] or [[x.y.z]] */
@@ -1056,326 +1497,1672 @@ static int parse_select(context_t *ctx) {
 			return -1;
 	}
 
+	int ret = -1;
 	if (fill_tabpath(ctx))
-		return -1;
-
-	/* For [x.y.z] or [[x.y.z]], remove z from tpath. */
-	token_t z = ctx->tpath.tok[ctx->tpath.top - 1];
-	xfree(ctx->tpath.key[ctx->tpath.top - 1]);
-	ctx->tpath.top--;
-
-	/* set up ctx->curtab */
-	if (walk_tabpath(ctx))
-		return -1;
-
-	if (!llb) {
-		/* [x.y.z] -> create z = {} in x.y */
-		toml_table_t *curtab = create_keytable_in_table(ctx, ctx->curtab, z);
-		if (!curtab)
-			return -1;
-		ctx->curtab = curtab;
-	} else {
-		/* [[x.y.z]] -> create z = [] in x.y */
-		toml_array_t *arr = 0;
-		{
-			int keylen;
-			char *zstr = normalize_key(ctx, z, &keylen);
-			if (!zstr)
-				return -1;
-			arr = toml_table_array(ctx->curtab, zstr);
-			if (arr)
-				arr->keylen = keylen;
-			xfree(zstr);
-		}
-		if (!arr) {
-			arr = create_keyarray_in_table(ctx, ctx->curtab, z, 't');
-			if (!arr)
-				return -1;
-		}
-		if (arr->kind != 't')
-			return e_syntax(ctx, z.lineno, "array mismatch");
-
-		/* add to z[] */
-		toml_table_t *dest;
-		{
-			toml_table_t *t = create_table_in_array(ctx, arr);
-			if (!t)
-				return -1;
-
-			if ((t->key = STRDUP("__anon__")) == 0)
-				return e_outofmemory(ctx, FLINE);
+		goto done;
 
-			dest = t;
-		}
-
-		ctx->curtab = dest;
-	}
+	if (ctx->h->table && (ctx->rc = ctx->h->table(ctx->ud, ctx->tpath.top,
+			(const char *const *)ctx->tpath.key, ctx->tpath.keylen, llb)) != 0)
+		goto done;
 
 	if (ctx->tok.tok != RBRACKET) {
-		return e_syntax(ctx, ctx->tok.lineno, "expects ]");
+		e_syntax(ctx, ctx->tok.lineno, "expects ]");
+		goto done;
 	}
 	if (llb) {
 		if (!(ctx->tok.ptr + 1 < ctx->stop && ctx->tok.ptr[1] == ']')) {
-			return e_syntax(ctx, ctx->tok.lineno, "expects ]]");
+			e_syntax(ctx, ctx->tok.lineno, "expects ]]");
+			goto done;
 		}
 		if (eat_token(ctx, RBRACKET, 1, FLINE))
-			return -1;
+			goto done;
 	}
 
 	if (eat_token(ctx, RBRACKET, 1, FLINE))
-		return -1;
-	if (ctx->tok.tok != NEWLINE)
-		return e_syntax(ctx, ctx->tok.lineno, "extra chars after ] or ]]");
-	return 0;
-}
-
-toml_table_t *toml_parse(char *toml, char *errbuf, int errbufsz) {
-	context_t ctx;
-
-	/// clear errbuf
-	if (errbufsz <= 0)
-		errbufsz = 0;
-	if (errbufsz > 0)
-		errbuf[0] = 0;
-
-	// init context
-	memset(&ctx, 0, sizeof(ctx));
-	ctx.start = toml;
-	ctx.stop = ctx.start + strlen(toml);
-	ctx.errbuf = errbuf;
-	ctx.errbufsz = errbufsz;
-
-	// start with an artificial newline of length 0
-	ctx.tok.tok = NEWLINE;
-	ctx.tok.lineno = 1;
-	ctx.tok.ptr = toml;
-	ctx.tok.len = 0;
-
-	// make a root table
-	if ((ctx.root = CALLOC(1, sizeof(*ctx.root))) == 0) {
-		e_outofmemory(&ctx, FLINE);
-		return 0; // Do not goto fail, root table not set up yet
+		goto done;
+	if (ctx->tok.tok != NEWLINE) {
+		e_syntax(ctx, ctx->tok.lineno, "extra chars after ] or ]]");
+		goto done;
 	}
+	ret = 0;
+
+done:
+	clear_tabpath(ctx);
+	return ret;
+}
 
-	// set root as default table
-	ctx.curtab = ctx.root;
+/* Parse the statements in [ctx->start, ctx->stop), the first of them on line
+ * lineno, emitting the events of their contents. */
+static int parse_statements(context_t *ctx, int lineno) {
+	// start with an artificial newline of length 0, which is not counted
+	set_token(ctx, NEWLINE, lineno, ctx->start, 0);
+	ctx->ntoken--;
 
 	// Scan forward until EOF
-	for (token_t tok = ctx.tok; !tok.eof; tok = ctx.tok) {
+	for (token_t tok = ctx->tok; !tok.eof; tok = ctx->tok) {
 		switch (tok.tok) {
 			case NEWLINE:
-				if (next_token(&ctx, true))
-					goto fail;
+				if (next_token(ctx, true))
+					return -1;
 				break;
 
 			case STRING:
-				if (parse_keyval(&ctx, ctx.curtab))
-					goto fail;
+				if (parse_keyval(ctx))
+					return -1;
 
-				if (ctx.tok.tok != NEWLINE) {
-					e_syntax(&ctx, ctx.tok.lineno, "extra chars after value");
-					goto fail;
-				}
+				if (ctx->tok.tok != NEWLINE)
+					return e_syntax(ctx, ctx->tok.lineno, "extra chars after value");
 
-				if (eat_token(&ctx, NEWLINE, 1, FLINE))
-					goto fail;
+				if (eat_token(ctx, NEWLINE, 1, FLINE))
+					return -1;
 				break;
 
 			case LBRACKET: /* [ x.y.z ] or [[ x.y.z ]] */
-				if (parse_select(&ctx))
-					goto fail;
+				if (parse_select(ctx))
+					return -1;
 				break;
 
 			default:
-				e_syntax(&ctx, tok.lineno, "syntax error");
-				goto fail;
+				return e_syntax(ctx, tok.lineno, "syntax error");
 		}
 	}
-
-	/// success
-	for (int i = 0; i < ctx.tpath.top; i++)
-		xfree(ctx.tpath.key[i]);
-	return ctx.root;
-
-fail:
-	// Something bad has happened. Free resources and return error.
-	for (int i = 0; i < ctx.tpath.top; i++)
-		xfree(ctx.tpath.key[i]);
-	toml_free(ctx.root);
 	return 0;
 }
 
-toml_table_t *toml_parse_file(FILE *fp, char *errbuf, int errbufsz) {
-	int bufsz = 0;
-	char *buf = 0;
-	int off = 0;
-	int inc = 1024;
-
-	while (!feof(fp)) {
-		if (bufsz == 1024 * 20) /// Increment buffer by 20k after 20k.
-			inc = 1024 * 20;
-		if (off == bufsz) {
-			int xsz = bufsz + inc;
-			char *x = expand(buf, bufsz, xsz);
-			if (!x) {
-				snprintf(errbuf, errbufsz, "out of memory");
-				xfree(buf);
-				return 0;
-			}
-			buf = x;
-			bufsz = xsz;
-		}
+/* Parse the whole text. */
+static int parse_document(context_t *ctx) {
+	return parse_statements(ctx, 1);
+}
 
-		errno = 0;
-		int n = fread(buf + off, 1, bufsz - off, fp);
-		if (ferror(fp)) {
-			snprintf(errbuf, errbufsz, "%s", (errno ? strerror(errno) : "Error reading file"));
-			xfree(buf);
-			return 0;
-		}
-		off += n;
-	}
+// Tree construction. The builder is the consumer of the parser's events that
+// makes the toml_table_t document. It keeps a stack of the containers being
+// filled: frame[0] is the table of the last [header] (or the root) and the
+// others are the arrays and inline tables being parsed.
+typedef struct frame_t frame_t;
+struct frame_t {
+	toml_table_t *tab; /// table being filled, or
+	toml_array_t *arr; /// array being filled
+	toml_table_t *cur; /// table where the dotted key being parsed leads
+	const char *key;   /// pending key, whose value comes next
+	int keylen;
+};
 
-	/// tag on a NUL to cap the string
-	if (off == bufsz) {
-		int xsz = bufsz + 1;
-		char *x = expand(buf, bufsz, xsz);
-		if (!x) {
-			snprintf(errbuf, errbufsz, "out of memory");
-			xfree(buf);
-			return 0;
-		}
-		buf = x;
-		bufsz = xsz;
-	}
-	buf[off] = 0;
+typedef struct builder_t builder_t;
+struct builder_t {
+	context_t *ctx;
+	toml_table_t *root;
+	frame_t *frame;
+	int top;           /// index of the innermost frame
+	int cap;
+};
 
-	/// parse it, cleanup and finish.
-	toml_table_t *ret = toml_parse(buf, errbuf, errbufsz);
-	xfree(buf);
-	return ret;
+static int push_frame(builder_t *b, toml_table_t *tab, toml_array_t *arr) {
+	frame_t *f = expand_vec(b->frame, b->top + 1, &b->cap, sizeof(*f));
+	if (!f)
+		return e_outofmemory(b->ctx, FLINE);
+	b->frame = f;
+	f = &b->frame[++b->top];
+	memset(f, 0, sizeof(*f));
+	f->tab = f->cur = tab;
+	f->arr = arr;
+	return 0;
 }
 
-static void xfree_kval(toml_keyval_t *p) {
-	if (!p)
-		return;
-	xfree(p->key);
-	xfree(p->val);
-	xfree(p);
+/* Account for a new item in array arr: set the array kind if this is the
+ * first entry, or mark it as mixed. */
+static void set_array_kind(toml_array_t *arr, char kind) {
+	if (arr->kind == 0)
+		arr->kind = kind;
+	else if (arr->kind != kind)
+		arr->kind = 'm';
 }
 
-static void xfree_tab(toml_table_t *p);
+/* Intern the n keys of a table path in the arena of ctx, into ret. */
+static int intern_keys(context_t *ctx, int n, const char *const *keys, const int *keylens, const char **ret) {
+	if (n > TABPATH_MAXLEN)
+		return e_internal(ctx, FLINE);
+	for (int i = 0; i < n; i++)
+		if ((ret[i] = intern_key(ctx->arena, keys[i], keylens[i])) == 0)
+			return e_outofmemory(ctx, FLINE);
+	return 0;
+}
 
-static void xfree_arr(toml_array_t *p) {
-	if (!p)
-		return;
+/* Walk the n first interned keys of the table path from the root, and create
+ * new tables on the way. Return the final table. */
+static toml_table_t *walk_tabpath(builder_t *b, int n, const char *const *keys, const int *keylens) {
+	context_t *ctx = b->ctx;
+	toml_table_t *curtab = b->root; /// start from root
 
-	xfree(p->key);
-	const int n = p->nitem;
 	for (int i = 0; i < n; i++) {
-		toml_arritem_t *a = &p->item[i];
-		if (a->val)
-			xfree(a->val);
-		else if (a->arr)
-			xfree_arr(a->arr);
-		else if (a->tab)
-			xfree_tab(a->tab);
+		toml_keyval_t *nextval = 0;
+		toml_array_t *nextarr = 0;
+		toml_table_t *nexttab = 0;
+		switch (check_key(curtab, keys[i], &nextval, &nextarr, &nexttab)) {
+			case 't': /// found a table. nexttab is where we will go next.
+				break;
+			case 'a': /// found an array. nexttab is the last table in the array.
+				if (nextarr->kind != 't' || nextarr->nitem == 0) {
+					e_internal(ctx, FLINE);
+					return 0;
+				}
+				nexttab = nextarr->item[nextarr->nitem - 1].tab;
+				break;
+			case 'v':
+				e_keyexists(ctx, ctx->tok.lineno);
+				return 0;
+			default: /// Not found. Let's create an implicit table.
+				if (!(nexttab = create_keytable_in_table(ctx, curtab, keys[i], keylens[i])))
+					return 0;
+				/// tabs created by walk_tabpath are considered implicit
+				nexttab->implicit = true;
+				break;
+		}
+		curtab = nexttab; /// switch to next tab
 	}
-	xfree(p->item);
-	xfree(p);
+	return curtab;
 }
 
-static void xfree_tab(toml_table_t *p) {
-	if (!p)
-		return;
-
-	xfree(p->key);
+static int build_table(void *ud, int n, const char *const *path, const int *keylens, bool is_array) {
+	builder_t *b = ud;
+	context_t *ctx = b->ctx;
+	const char *keys[TABPATH_MAXLEN];
+	if (intern_keys(ctx, n, path, keylens, keys))
+		return -1;
 
-	for (int i = 0; i < p->nkval; i++)
-		xfree_kval(p->kval[i]);
-	xfree(p->kval);
+	/* For [x.y.z] or [[x.y.z]], walk x.y from the root */
+	toml_table_t *curtab = walk_tabpath(b, n - 1, keys, keylens);
+	if (!curtab)
+		return -1;
+	const char *z = keys[n - 1];
+	int zlen = keylens[n - 1];
 
-	for (int i = 0; i < p->narr; i++)
-		xfree_arr(p->arr[i]);
-	xfree(p->arr);
+	if (!is_array) {
+		/* [x.y.z] -> create z = {} in x.y */
+		if (!(curtab = create_keytable_in_table(ctx, curtab, z, zlen)))
+			return -1;
+	} else {
+		/* [[x.y.z]] -> create z = [] in x.y */
+		toml_array_t *arr = 0;
+		check_key(curtab, z, 0, &arr, 0);
+		if (!arr && !(arr = create_keyarray_in_table(ctx, curtab, z, zlen, 't')))
+			return -1;
+		if (arr->kind != 't')
+			return e_syntax(ctx, ctx->tok.lineno, "array mismatch");
 
-	for (int i = 0; i < p->ntab; i++)
-		xfree_tab(p->tab[i]);
-	xfree(p->tab);
+		/* add to z[] */
+		if (!(curtab = create_table_in_array(ctx, arr)))
+			return -1;
+		curtab->key = "__anon__"; /// shared literal, never looked up
+	}
 
-	xfree(p);
+	b->top = 0;
+	b->frame[0].tab = b->frame[0].cur = curtab;
+	b->frame[0].key = 0;
+	return 0;
 }
 
-void toml_free(toml_table_t *tab) { xfree_tab(tab); }
+static int build_key(void *ud, const char *key, int keylen) {
+	builder_t *b = ud;
+	context_t *ctx = b->ctx;
+	frame_t *f = &b->frame[b->top];
+	if (!f->tab)
+		return e_internal(ctx, FLINE);
 
-static void set_token(context_t *ctx, tokentype_t tok, int lineno, char *ptr, int len) {
-	token_t t;
-	t.tok    = tok;
-	t.lineno = lineno;
-	t.ptr    = ptr;
-	t.len    = len;
-	t.eof    = 0;
-	ctx->tok = t;
+	if (f->key) { /// dotted key: go to (or create) the table of the pending key
+		toml_table_t *subtab = 0;
+		check_key(f->cur, f->key, 0, 0, &subtab);
+		if (!subtab && !(subtab = create_keytable_in_table(ctx, f->cur, f->key, f->keylen)))
+			return -1;
+		f->cur = subtab;
+	} else {
+		f->cur = f->tab;
+	}
+	if (f->cur->readonly)
+		return e_forbid(ctx, ctx->tok.lineno, "cannot insert new entry into existing table");
+
+	if ((f->key = intern_key(ctx->arena, key, keylen)) == 0)
+		return e_outofmemory(ctx, FLINE);
+	f->keylen = keylen;
+	return 0;
 }
 
-static void set_eof(context_t *ctx, int lineno) {
-	set_token(ctx, NEWLINE, lineno, ctx->stop, 0);
-	ctx->tok.eof = 1;
+static int build_scalar(void *ud, int valtype, const toml_scalar_t *val) {
+	builder_t *b = ud;
+	context_t *ctx = b->ctx;
+	frame_t *f = &b->frame[b->top];
+
+	if (f->arr) {
+		toml_array_t *arr = f->arr;
+		set_array_kind(arr, 'v');
+
+		/// make a new value in array
+		toml_arritem_t *newval = create_value_in_array(ctx, arr);
+		if (!newval)
+			return -1;
+		newval->valtype = valtype;
+		newval->u = *val;
+
+		/// set array type if this is the first entry
+		if (arr->nitem == 1)
+			arr->type = valtype;
+		else if (arr->type != valtype)
+			arr->type = 'm'; /// mixed
+		return 0;
+	}
+
+	if (!f->key)
+		return e_internal(ctx, FLINE);
+	toml_keyval_t *keyval = create_keyval_in_table(ctx, f->cur, f->key, f->keylen);
+	if (!keyval)
+		return -1;
+	keyval->valtype = valtype;
+	keyval->u = *val;
+	f->key = 0;
+	return 0;
 }
 
-/* Scan p for n digits compositing entirely of [0-9] */
-static int scan_digits(const char *p, int n) {
-	int ret = 0;
-	for (; n > 0 && isdigit(*p); n--, p++) {
-		ret = 10 * ret + (*p - '0');
+static int build_array_begin(void *ud) {
+	builder_t *b = ud;
+	context_t *ctx = b->ctx;
+	frame_t *f = &b->frame[b->top];
+	toml_array_t *arr;
+
+	if (f->arr) { /* [ [array], [array] ... ] */
+		set_array_kind(f->arr, 'a');
+		arr = create_array_in_array(ctx, f->arr);
+	} else if (f->key) { /* key = [ array ] */
+		arr = create_keyarray_in_table(ctx, f->cur, f->key, f->keylen, 0);
+		f->key = 0;
+	} else {
+		return e_internal(ctx, FLINE);
 	}
-	return n ? -1 : ret;
+	return arr ? push_frame(b, 0, arr) : -1;
 }
 
-static int scan_date(const char *p, int *YY, int *MM, int *DD) {
-	int year, month, day;
-	year = scan_digits(p, 4);
-	month = (year >= 0 && p[4] == '-') ? scan_digits(p + 5, 2) : -1;
-	day = (month >= 0 && p[7] == '-') ? scan_digits(p + 8, 2) : -1;
-	if (YY)
-		*YY = year;
-	if (MM)
-		*MM = month;
-	if (DD)
-		*DD = day;
-	return (year >= 0 && month >= 0 && day >= 0) ? 0 : -1;
+static int build_inline_table_begin(void *ud) {
+	builder_t *b = ud;
+	context_t *ctx = b->ctx;
+	frame_t *f = &b->frame[b->top];
+	toml_table_t *tab;
+
+	if (f->arr) { /* [ {table}, {table} ... ] */
+		set_array_kind(f->arr, 't');
+		tab = create_table_in_array(ctx, f->arr);
+	} else if (f->key) { /* key = { table } */
+		tab = create_keytable_in_table(ctx, f->cur, f->key, f->keylen);
+		f->key = 0;
+	} else {
+		return e_internal(ctx, FLINE);
+	}
+	return tab ? push_frame(b, tab, 0) : -1;
 }
 
-static int scan_time(const char *p, int *hh, int *mm, int *ss) {
-	int hour = scan_digits(p, 2);
-	int minute = (hour >= 0 && p[2] == ':') ? scan_digits(p + 3, 2) : -1;
-	int second = (minute >= 0 && p[5] == ':') ? scan_digits(p + 6, 2) : -1;
-	if (hh)
-		*hh = hour;
-	if (mm)
-		*mm = minute;
-	if (ss)
-		*ss = second;
-	return (hour >= 0 && minute >= 0 && second >= 0) ? 0 : -1;
+static int build_end(void *ud) {
+	builder_t *b = ud;
+	frame_t *f = &b->frame[b->top];
+	if (b->top <= 0)
+		return e_internal(b->ctx, FLINE);
+	if (f->tab) /// inline tables are complete once closed
+		f->tab->readonly = 1;
+	b->top--;
+	return 0;
 }
 
-static int scan_string(context_t *ctx, char *p, int lineno, bool dotisspecial) {
-	char *orig = p;
+static const toml_handler_t tree_handler = {
+	build_table,
+	build_key,
+	build_scalar,
+	build_array_begin,
+	build_end,
+	build_inline_table_begin,
+	build_end,
+};
 
-	// Literal multiline.
-	if (strncmp(p, "'''", 3) == 0) {
-		char *q = p + 3;
-		while (true) {
-			q = strstr(q, "'''");
-			if (q == 0)
-				return e_syntax(ctx, lineno, "unterminated triple-s-quote");
-			int i = 0;
-			while (q[3] == '\'') {
-				i++;
-				if (i >= 3)
-					return e_syntax(ctx, lineno, "too many ''' in triple-s-quote");
+// Statement splitter. It follows the lexical state of the text (in a comment,
+// in a string of some kind, nesting of brackets and braces) to find the
+// newlines that end top-level statements, without tokenizing. The state is
+// kept between calls so the text can be scanned piecewise.
+#define SPLIT_CODE      0 /// between tokens
+#define SPLIT_COMMENT   1 /// # ...
+#define SPLIT_BASIC     2 /// "..."
+#define SPLIT_LITERAL   3 /// '...'
+#define SPLIT_MLBASIC   4 /// """..."""
+#define SPLIT_MLLITERAL 5 /// '''...'''
+
+typedef struct splitter_t splitter_t;
+struct splitter_t {
+	int state; /// one of SPLIT_*
+	int depth; /// nesting of brackets and braces
+};
+
+/* Scan [q, end) for the newline that ends the current top-level statement.
+ * Returns the pointer past it, or 0 if there is none; in that case *stop is
+ * where the scan stopped: end, or a quote or a backslash that cannot be
+ * classified without more text. */
+static const char *split_next(splitter_t *s, const scan_kernels_t *scan, const char *q, const char *end, const char **stop) {
+	while (q < end) {
+		switch (s->state) {
+			case SPLIT_CODE:
+				/// skip bare keys, literal values and blanks at once
+				while (q < end && CCLASS(*q, CC_LIT | CC_SPACE))
+					q++;
+				if (q == end)
+					break;
+				switch (*q) {
+					case '\n':
+						if (s->depth == 0)
+							return q + 1;
+						break;
+					case '#':
+						s->state = SPLIT_COMMENT;
+						break;
+					case '[': case '{':
+						s->depth++;
+						break;
+					case ']': case '}':
+						if (s->depth > 0)
+							s->depth--;
+						break;
+					case '"': case '\'':
+						if (end - q < 3)
+							goto pause;
+						if (q[1] == q[0] && q[2] == q[0]) {
+							s->state = (*q == '"' ? SPLIT_MLBASIC : SPLIT_MLLITERAL);
+							q += 2;
+						} else if (q[1] == q[0]) {
+							q++; /// empty string
+						} else {
+							s->state = (*q == '"' ? SPLIT_BASIC : SPLIT_LITERAL);
+						}
+						break;
+				}
 				q++;
-			}
+				break;
+
+			case SPLIT_COMMENT: /// up to, not including, the \n
+				if ((q = memchr(q, '\n', end - q)) == 0)
+					q = end;
+				else
+					s->state = SPLIT_CODE;
+				break;
+
+			case SPLIT_BASIC:
+			case SPLIT_LITERAL:
+				if (s->state == SPLIT_BASIC)
+					q = scan->find3(q, end, '"', '\\', '\n');
+				else
+					q = scan->find3(q, end, '\'', '\n', '\n');
+				if (q == end)
+					break;
+				if (*q == '\\') {
+					if (end - q < 2)
+						goto pause;
+					q += 2;
+					break;
+				}
+				if (*q != '\n') /// leave an unterminated string at its \n
+					q++;
+				s->state = SPLIT_CODE;
+				break;
+
+			case SPLIT_MLBASIC:
+			case SPLIT_MLLITERAL: {
+				int qchar = (s->state == SPLIT_MLBASIC ? '"' : '\'');
+				q = scan->find3(q, end, qchar, qchar == '"' ? '\\' : qchar, qchar);
+				if (q == end)
+					break;
+				if (*q == '\\') {
+					if (end - q < 2)
+						goto pause;
+					q += 2;
+					break;
+				}
+				/// a run of 3 or more quotes ends the string
+				const char *r = q;
+				while (r < end && *r == qchar)
+					r++;
+				if (r == end)
+					goto pause;
+				if (r - q >= 3)
+					s->state = SPLIT_CODE;
+				q = r;
+				break;
+			}
+		}
+	}
+pause:
+	*stop = q;
+	return 0;
+}
+
+// Statistics. When enabled, every document gets a toml_stats_t in its arena,
+// which is filled as it is parsed; otherwise the parser only counts the
+// tokens of its context and never reads the clock.
+static bool stats_enabled = false;
+
+static double stats_clock(void) {
+#ifndef _WIN32
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1e-9 * ts.tv_nsec;
+#else
+	return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+bool toml_enable_stats(bool on) {
+	bool old = stats_enabled;
+	stats_enabled = on;
+	return old;
+}
+
+/* Set up ctx to parse the len bytes at toml. */
+static int init_context(context_t *ctx, const char *toml, size_t len, char *errbuf, int errbufsz) {
+	/// clear errbuf
+	if (errbufsz <= 0)
+		errbufsz = 0;
+	if (errbufsz > 0)
+		errbuf[0] = 0;
+
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->start = (char *)toml;
+	ctx->stop = ctx->start + len;
+	ctx->errbuf = errbuf;
+	ctx->errbufsz = errbufsz;
+	ctx->scan = scan_kernels();
+	if (len > INT_MAX) { /// token lengths and offsets are int
+		snprintf(errbuf, errbufsz, "document too large");
+		return -1;
+	}
+	if ((ctx->scratch = arena_new()) == 0)
+		return e_outofmemory(ctx, FLINE);
+	return 0;
+}
+
+/* Make the root table, owning the memory arena, and set up b to build the
+ * tree from the events of ctx. */
+static int init_builder(builder_t *b, context_t *ctx) {
+	memset(b, 0, sizeof(*b));
+	b->ctx = ctx;
+	b->top = -1;
+	if ((ctx->arena = arena_new()) == 0)
+		return e_outofmemory(ctx, FLINE);
+	if ((b->root = arena_calloc(ctx->arena, 1, sizeof(*b->root))) == 0) {
+		arena_free(ctx->arena);
+		return e_outofmemory(ctx, FLINE);
+	}
+	b->root->arena = ctx->arena;
+	if (stats_enabled && (ctx->stats = ctx->arena->stats =
+			arena_calloc(ctx->arena, 1, sizeof(*ctx->stats))) == 0) {
+		arena_free(ctx->arena);
+		return e_outofmemory(ctx, FLINE);
+	}
+
+	// root as default table
+	if (push_frame(b, b->root, 0)) {
+		toml_free(b->root);
+		return -1;
+	}
+	ctx->h = &tree_handler;
+	ctx->ud = b;
+	return 0;
+}
+
+/* Release the builder and the context. Returns the root table on success, or
+ * frees the partially built tree and returns 0. */
+static toml_table_t *done_builder(builder_t *b, context_t *ctx, bool ok) {
+	toml_stats_t *stats = ctx->stats;
+	double t0 = (stats ? stats_clock() : 0);
+	if (ok && shrink_to_fit(ctx, b->root))
+		ok = false;
+	if (stats) {
+		stats->finish_time += stats_clock() - t0;
+		stats->tokens += ctx->ntoken;
+		ctx->ntoken = 0;
+	}
+	xfree(b->frame);
+	arena_free(ctx->scratch);
+	drop_keyslots(ctx->arena);
+	if (ok)
+		return b->root;
+	// Something bad has happened. Free resources and return error.
+	xfree_tab(b->root);
+	toml_free(b->root);
+	return 0;
+}
+
+// Lazy parsing. The pre-scan splits the text in sections, each starting at a
+// [header], and groups them by the first key of their header. The text before
+// the first header is parsed at once, with the groups of the keys that it
+// defines. For every other group, an implicit table, or an array of tables
+// for [[key]], is made in the root table with the list of its sections; they
+// are parsed the first time the entry is accessed (see load_lazy).
+typedef struct section_t section_t;
+struct section_t {
+	const char *ptr; /// text of the section, from its header
+	int len;
+	int lineno;      /// line of the header
+	bool item;       /// header is [[key]]: a new item of the array of tables
+	section_t *next;
+};
+
+struct toml_lazy_t {
+	toml_table_t *root;
+	section_t *first;   /// sections in the order of the text
+	section_t *last;
+	const char *error;  /// message of the failure to parse them, if any
+};
+
+typedef struct prescan_t prescan_t;
+struct prescan_t {
+	builder_t *b;
+	toml_lazy_t *lazy; /// group of the current section, 0 to parse it at once
+	bool item;         /// the current section starts an item of its group
+};
+
+/* Handler of the header of a section: find or make its group. */
+static int prescan_header(void *ud, int n, const char *const *keys, const int *keylens, bool is_array) {
+	prescan_t *ps = ud;
+	context_t *ctx = ps->b->ctx;
+	toml_table_t *root = ps->b->root;
+	toml_table_t *tab = 0;
+	toml_array_t *arr = 0;
+	const char *key = intern_key(ctx->arena, keys[0], keylens[0]);
+	if (!key)
+		return e_outofmemory(ctx, FLINE);
+
+	ps->item = (n == 1 && is_array);
+	switch (check_key(root, key, 0, &arr, &tab)) {
+		case 't':
+			ps->lazy = tab->lazy;
+			return 0;
+		case 'a':
+			ps->lazy = arr->lazy;
+			return 0;
+		case 'v': /// let the parser report the error
+			ps->lazy = 0;
+			return 0;
+	}
+
+	if (n == 1 && is_array) {
+		if (!(arr = create_keyarray_in_table(ctx, root, key, keylens[0], 't')))
+			return -1;
+	} else {
+		if (!(tab = create_keytable_in_table(ctx, root, key, keylens[0])))
+			return -1;
+		tab->implicit = true; /// until its own [header] is parsed
+	}
+	if (!(ps->lazy = arena_calloc(ctx->arena, 1, sizeof(*ps->lazy))))
+		return e_outofmemory(ctx, FLINE);
+	ps->lazy->root = root;
+	if (arr)
+		arr->lazy = ps->lazy;
+	else
+		tab->lazy = ps->lazy;
+	return 0;
+}
+
+static const toml_handler_t prescan_handler = {
+	prescan_header, 0, 0, 0, 0, 0, 0,
+};
+
+/* The section [ptr, end) is complete: parse it, or add it to its group. */
+static int close_section(context_t *ctx, prescan_t *ps, const char *ptr, const char *end, int lineno) {
+	if (!ps->lazy) {
+		ctx->start = (char *)ptr;
+		ctx->stop = (char *)end;
+		return parse_statements(ctx, lineno);
+	}
+	section_t *s = arena_calloc(ctx->arena, 1, sizeof(*s));
+	if (!s)
+		return e_outofmemory(ctx, FLINE);
+	s->ptr = ptr;
+	s->len = end - ptr;
+	s->lineno = lineno;
+	s->item = ps->item;
+	if (ps->lazy->last)
+		ps->lazy->last->next = s;
+	else
+		ps->lazy->first = s;
+	ps->lazy->last = s;
+	return 0;
+}
+
+/* Pre-scan the whole text of ctx, building the tree with b. */
+static int prescan(context_t *ctx, builder_t *b) {
+	const scan_kernels_t *scan = ctx->scan;
+	const char *end = ctx->stop;
+	const char *sec = ctx->start; /// start of the current section
+	int seclineno = 1;            /// its line number
+	splitter_t split = {SPLIT_CODE, 0};
+	prescan_t ps = {b, 0, false};
+
+	for (const char *p = sec, *next; p < end; p = next) {
+		const char *stop;
+		if ((next = split_next(&split, scan, p, end, &stop)) == 0)
+			next = end; /// last statement
+		const char *q = scan->skip_blanks(p, next);
+		if (q == next || *q != '[')
+			continue;
+
+		/// a [header]: close the current section and start a new one
+		int lineno = seclineno + scan->count(sec, p, '\n');
+		if (close_section(ctx, &ps, sec, p, seclineno))
+			return -1;
+		sec = p;
+		seclineno = lineno;
+
+		/// find the group of the new section from its header
+		ctx->start = (char *)p;
+		ctx->stop = (char *)next;
+		ctx->h = &prescan_handler;
+		ctx->ud = &ps;
+		size_t ntoken = ctx->ntoken; /// counted when the section is parsed
+		int ret = parse_statements(ctx, lineno);
+		ctx->ntoken = ntoken;
+		ctx->h = &tree_handler;
+		ctx->ud = b;
+		if (ret)
+			return -1;
+	}
+	return close_section(ctx, &ps, sec, end, seclineno);
+}
+
+/* Parse the sections from first up to, not including, stop with the events
+ * handler of ctx. */
+static int parse_sections(context_t *ctx, const section_t *first, const section_t *stop) {
+	int ret = 0;
+	for (const section_t *s = first; ret == 0 && s != stop; s = s->next) {
+		ctx->start = (char *)s->ptr;
+		ctx->stop = ctx->start + s->len;
+		ret = parse_statements(ctx, s->lineno);
+	}
+	return ret;
+}
+
+// Parallel parsing. The text is pre-scanned as for lazy parsing, then the
+// groups of sections are parsed concurrently as tasks: a table of the root
+// table is a single task, while an array of tables is split in runs of items
+// which are parsed into private arrays and then moved to the array in the
+// order of the text. A task only modifies its own entry of the root table,
+// which is otherwise only read. Each thread allocates in its own arena, whose
+// blocks are then given to the document.
+#define TASK_MINLEN (64 * 1024) /// runs of items are not split below this size
+
+typedef struct task_t task_t;
+struct task_t {
+	toml_table_t *tab;      /// table to parse, or
+	toml_array_t *arr;      /// array of tables to which the items go
+	const section_t *first; /// sections of the task
+	const section_t *stop;  /// section following them, 0 if none
+	toml_array_t *part;     /// items parsed by the task
+	size_t ntoken;          /// number of tokens of the task
+};
+
+typedef struct pool_t pool_t;
+struct pool_t {
+	toml_table_t *root;
+	task_t *task;
+	int ntask;
+	int next;    /// next task to run
+	bool borrow; /// values may point into the text
+	bool failed;
+#ifndef _WIN32
+	pthread_mutex_t mutex;
+#endif
+};
+
+typedef struct worker_t worker_t;
+struct worker_t {
+	pool_t *pool;
+	toml_arena_t *arena; /// memory of the tasks run by the worker
+	bool started;
+#ifndef _WIN32
+	pthread_t thread;
+#endif
+};
+
+#ifndef _WIN32
+#define POOL_LOCK(pool)   pthread_mutex_lock(&(pool)->mutex)
+#define POOL_UNLOCK(pool) pthread_mutex_unlock(&(pool)->mutex)
+#else
+#define POOL_LOCK(pool)   ((void)0)
+#define POOL_UNLOCK(pool) ((void)0)
+#endif
+
+/* Number of threads to use when nthreads <= 0: one per online processor. */
+static int default_threads(int nthreads) {
+#ifdef _SC_NPROCESSORS_ONLN
+	if (nthreads <= 0)
+		nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	return nthreads > 0 ? nthreads : 1;
+}
+
+/* Give the blocks of arena from to arena a, behind the block being filled,
+ * and free from. */
+static void arena_merge(toml_arena_t *a, toml_arena_t *from) {
+	arena_block_t *last = from->head;
+	if (last) {
+		while (last->next)
+			last = last->next;
+		if (a->head) {
+			last->next = a->head->next;
+			a->head->next = from->head;
+		} else {
+			a->head = from->head;
+		}
+		from->head = 0;
+	}
+	arena_free(from);
+}
+
+static int add_task(task_t **task, int *ntask, int *cap, toml_table_t *tab, toml_array_t *arr, const section_t *first, const section_t *stop) {
+	task_t *t = expand_vec(*task, *ntask, cap, sizeof(*t));
+	if (!t)
+		return -1;
+	*task = t;
+	t = &t[(*ntask)++];
+	memset(t, 0, sizeof(*t));
+	t->tab = tab;
+	t->arr = arr;
+	t->first = first;
+	t->stop = stop;
+	return 0;
+}
+
+/* Make the tasks of the pending entries of root, and detach their sections.
+ * Runs of items of an array are split once longer than minlen bytes. */
+static int make_tasks(pool_t *pool, size_t minlen) {
+	toml_table_t *root = pool->root;
+	int cap = 0;
+
+	for (int i = 0; i < root->ntab; i++) {
+		toml_table_t *tab = root->tab[i];
+		if (!tab->lazy)
+			continue;
+		if (add_task(&pool->task, &pool->ntask, &cap, tab, 0, tab->lazy->first, 0))
+			return -1;
+		tab->lazy = 0;
+	}
+	for (int i = 0; i < root->narr; i++) {
+		toml_array_t *arr = root->arr[i];
+		if (!arr->lazy)
+			continue;
+		const section_t *first = arr->lazy->first;
+		size_t len = 0;
+		for (const section_t *s = first; s; s = s->next) {
+			if (s->item && len >= minlen) {
+				if (add_task(&pool->task, &pool->ntask, &cap, 0, arr, first, s))
+					return -1;
+				first = s;
+				len = 0;
+			}
+			len += s->len;
+		}
+		if (add_task(&pool->task, &pool->ntask, &cap, 0, arr, first, 0))
+			return -1;
+		arr->lazy = 0;
+	}
+	return 0;
+}
+
+/* Run task t, allocating in arena a. */
+static int run_task(pool_t *pool, task_t *t, toml_arena_t *a) {
+	toml_arena_t *doc = pool->root->arena;
+	context_t ctx;
+	builder_t b;
+
+	if (init_context(&ctx, doc->text, doc->textlen, 0, 0))
+		return -1;
+	ctx.arena = a;
+	ctx.borrow = pool->borrow;
+	memset(&b, 0, sizeof(b));
+	b.ctx = &ctx;
+	b.root = pool->root;
+	b.top = -1;
+	ctx.h = &tree_handler;
+	ctx.ud = &b;
+
+	/// the items of an array go to a private root table, in an array with
+	/// the same key
+	toml_table_t *top = t->tab;
+	int ret = 0;
+	if (t->arr) {
+		if ((top = b.root = arena_calloc(a, 1, sizeof(*b.root))) == 0 ||
+				(t->part = create_keyarray_in_table(&ctx, top, t->arr->key, t->arr->keylen, 't')) == 0)
+			ret = -1;
+	}
+	if (ret == 0)
+		ret = push_frame(&b, b.root, 0);
+	if (ret == 0)
+		ret = parse_sections(&ctx, t->first, t->stop);
+	if (ret == 0)
+		ret = shrink_to_fit(&ctx, top);
+	if (ret && top)
+		xfree_tab(top);
+	t->ntoken = ctx.ntoken;
+	xfree(b.frame);
+	arena_free(ctx.scratch);
+	return ret;
+}
+
+static void *run_worker(void *arg) {
+	worker_t *w = arg;
+	pool_t *pool = w->pool;
+	for (;;) {
+		POOL_LOCK(pool);
+		int i = pool->failed ? pool->ntask : pool->next;
+		if (i < pool->ntask)
+			pool->next++;
+		POOL_UNLOCK(pool);
+		if (i >= pool->ntask)
+			break;
+		if (run_task(pool, &pool->task[i], w->arena)) {
+			POOL_LOCK(pool);
+			pool->failed = true;
+			POOL_UNLOCK(pool);
+		}
+	}
+	return 0;
+}
+
+/* Move the items parsed by the tasks to their arrays. */
+static int merge_parts(pool_t *pool) {
+	toml_arena_t *a = pool->root->arena;
+	for (int i = 0, j; i < pool->ntask; i = j) {
+		toml_array_t *arr = pool->task[i].arr;
+		if (!arr) {
+			j = i + 1;
+			continue;
+		}
+		size_t n = 0;
+		for (j = i; j < pool->ntask && pool->task[j].arr == arr; j++)
+			n += pool->task[j].part->nitem;
+		if (n > INT_MAX)
+			return -1;
+		toml_arritem_t *item = arena_alloc(a, n * sizeof(*item));
+		if (n > 0 && !item)
+			return -1;
+		arr->item = item;
+		arr->nitem = 0;
+		for (int k = i; k < j; k++) {
+			const toml_array_t *part = pool->task[k].part;
+			memcpy(item + arr->nitem, part->item, part->nitem * sizeof(*item));
+			arr->nitem += part->nitem;
+		}
+	}
+	return 0;
+}
+
+/* Parse the pending entries of the root table with nthreads threads. Returns
+ * 0 on success, or -1 if anything failed; the document must then be freed. */
+static int load_parallel(toml_table_t *root, int nthreads, bool borrow) {
+	pool_t pool;
+	memset(&pool, 0, sizeof(pool));
+	pool.root = root;
+	pool.borrow = borrow;
+	size_t minlen = root->arena->textlen / (8 * (size_t)nthreads);
+	if (minlen < TASK_MINLEN)
+		minlen = TASK_MINLEN;
+	if (make_tasks(&pool, minlen) || pool.ntask == 0) {
+		xfree(pool.task);
+		return pool.ntask == 0 ? 0 : -1;
+	}
+#ifdef _WIN32
+	nthreads = 1;
+#endif
+	if (nthreads > pool.ntask)
+		nthreads = pool.ntask;
+	worker_t *w = malloc(nthreads * sizeof(*w));
+	if (!w) {
+		xfree(pool.task);
+		return -1;
+	}
+	for (int i = 0; i < nthreads; i++) {
+		w[i].pool = &pool;
+		w[i].started = false;
+		if ((w[i].arena = arena_new()) == 0)
+			pool.failed = true;
+	}
+
+	/// the calling thread is one of the workers
+#ifndef _WIN32
+	pthread_mutex_init(&pool.mutex, 0);
+	for (int i = 1; i < nthreads && w[0].arena && w[i].arena; i++)
+		w[i].started = (pthread_create(&w[i].thread, 0, run_worker, &w[i]) == 0);
+#endif
+	run_worker(&w[0]);
+#ifndef _WIN32
+	for (int i = 1; i < nthreads; i++) {
+		if (w[i].started)
+			pthread_join(w[i].thread, 0);
+	}
+	pthread_mutex_destroy(&pool.mutex);
+#endif
+
+	if (!pool.failed && merge_parts(&pool))
+		pool.failed = true;
+	if (root->arena->stats) {
+		for (int i = 0; i < pool.ntask; i++)
+			root->arena->stats->tokens += pool.task[i].ntoken;
+	}
+	for (int i = 0; i < nthreads; i++) {
+		if (w[i].arena)
+			arena_merge(root->arena, w[i].arena);
+	}
+	xfree(w);
+	xfree(pool.task);
+	return pool.failed ? -1 : 0;
+}
+
+/* Parse the len bytes of TOML text at toml, which need not be NUL-terminated.
+ * Unless owner is TEXT_CALLER, the document takes ownership of the text (even
+ * on failure) and parsed values may point into it. The text is never written
+ * to. If lazy, the text must be owned by the document and the sections of
+ * the root tables are only parsed on demand. Otherwise, if nthreads > 1, the
+ * sections are parsed by that many threads. */
+static toml_table_t *parse_text(const char *toml, size_t len, int owner, bool lazy, int nthreads, char *errbuf, int errbufsz) {
+	context_t ctx;
+	builder_t b;
+
+	// init context and builder
+	if (init_context(&ctx, toml, len, errbuf, errbufsz)) {
+		release_text((char *)toml, len, owner);
+		return 0;
+	}
+	if (init_builder(&b, &ctx)) {
+		release_text(ctx.start, len, owner);
+		arena_free(ctx.scratch);
+		return 0;
+	}
+	ctx.borrow = (owner != TEXT_CALLER);
+	ctx.arena->text = ctx.start;
+	ctx.arena->textlen = len;
+	ctx.arena->textowner = owner;
+	toml_stats_t *stats = ctx.stats;
+	double t0 = (stats ? stats_clock() : 0);
+	if (stats)
+		stats->bytes = len;
+
+	if (nthreads > 1 && !lazy) {
+		/// keep the text if this fails, to parse it again serially so
+		/// that the error is the same
+		ctx.arena->textowner = TEXT_CALLER;
+		toml_table_t *root = done_builder(&b, &ctx, prescan(&ctx, &b) == 0);
+		if (root && load_parallel(root, nthreads, ctx.borrow) == 0) {
+			root->arena->textowner = owner;
+			if (stats)
+				stats->parse_time += stats_clock() - t0 - stats->finish_time;
+			return root;
+		}
+		toml_free(root);
+		return parse_text(toml, len, owner, false, 1, errbuf, errbufsz);
+	}
+	int ret = (lazy ? prescan(&ctx, &b) : parse_document(&ctx));
+	if (stats)
+		stats->parse_time += stats_clock() - t0;
+	return done_builder(&b, &ctx, ret == 0);
+}
+
+int toml_parse_events(const char *toml, size_t len, const toml_handler_t *handler, void *ud, char *errbuf, int errbufsz) {
+	context_t ctx;
+	if (init_context(&ctx, toml, len, errbuf, errbufsz))
+		return -1;
+
+	/// values are decoded into the scratch arena and released after their
+	/// event, strings without escapes are views into the text
+	ctx.arena = ctx.scratch;
+	ctx.borrow = true;
+	ctx.transient = true;
+	ctx.h = handler;
+	ctx.ud = ud;
+
+	int ret = parse_document(&ctx);
+	if (ret && ctx.rc) {
+		snprintf(errbuf, errbufsz, "line %d: stopped by event handler", ctx.tok.lineno);
+		ret = ctx.rc;
+	}
+	arena_free(ctx.scratch);
+	return ret;
+}
+
+// Push parsing. The text is fed in chunks of any size. The splitter finds the
+// last newline that ends a top-level statement, and the text up to there is
+// parsed right away; only the statement in progress is kept in the buffer.
+#define PARSE_CHUNK (64 * 1024) /// minimal growth of the buffer
+
+struct toml_parser_t {
+	context_t ctx;
+	builder_t b;
+	char *buf;      /// text not parsed yet
+	size_t len;     /// its length
+	size_t cap;     /// size of buf
+	size_t scanned; /// length of the prefix of buf seen by the splitter
+	splitter_t split; /// splitter state at buf + scanned
+	int lineno;     /// line number of buf[0]
+	bool failed;
+};
+
+/* Advance the splitter over the text not scanned yet. Returns the length of
+ * the prefix of the buffer made of complete statements. */
+static size_t split_statements(toml_parser_t *p) {
+	const char *buf = p->buf;
+	const char *end = buf + p->len;
+	const char *q = buf + p->scanned;
+	const char *next;
+	size_t split = 0;
+	while ((next = split_next(&p->split, p->ctx.scan, q, end, &q)) != 0)
+		split = (q = next) - buf;
+	p->scanned = q - buf;
+	return split;
+}
+
+/* Parse the n first bytes of the buffer, which end a statement, and drop
+ * them. */
+static int parse_pending(toml_parser_t *p, size_t n) {
+	context_t *ctx = &p->ctx;
+	if (n > INT_MAX) /// token lengths and offsets are int
+		return e_syntax(ctx, p->lineno, "statement too large");
+	ctx->start = p->buf;
+	ctx->stop = p->buf + n;
+	double t0 = (ctx->stats ? stats_clock() : 0);
+	if (parse_statements(ctx, p->lineno))
+		return -1;
+	if (ctx->stats) {
+		ctx->stats->bytes += n;
+		ctx->stats->parse_time += stats_clock() - t0;
+	}
+	p->lineno = ctx->tok.lineno;
+	if (n < p->len)
+		memmove(p->buf, p->buf + n, p->len - n);
+	p->len -= n;
+	p->scanned -= n;
+	return 0;
+}
+
+/* Get room for at least n more bytes at the end of the buffer. */
+static char *reserve_pending(toml_parser_t *p, size_t n) {
+	if (n > p->cap - p->len) {
+		size_t xsz = p->cap + (p->cap > n ? p->cap : n);
+		if (xsz < PARSE_CHUNK)
+			xsz = PARSE_CHUNK;
+		char *x = realloc(p->buf, xsz);
+		if (!x) {
+			e_outofmemory(&p->ctx, FLINE);
+			return 0;
+		}
+		p->buf = x;
+		p->cap = xsz;
+	}
+	return p->buf + p->len;
+}
+
+/* Account for the n bytes stored after the end of the buffer, and parse the
+ * statements they complete. */
+static int append_pending(toml_parser_t *p, size_t n) {
+	p->len += n;
+	size_t split = split_statements(p);
+	if (split > 0 && parse_pending(p, split))
+		return -1;
+	return 0;
+}
+
+toml_parser_t *toml_parser_new(char *errbuf, int errbufsz) {
+	toml_parser_t *p = malloc(sizeof(*p));
+	if (!p) {
+		snprintf(errbuf, errbufsz, "out of memory");
+		return 0;
+	}
+	memset(p, 0, sizeof(*p));
+	if (init_context(&p->ctx, "", 0, errbuf, errbufsz)) {
+		xfree(p);
+		return 0;
+	}
+	if (init_builder(&p->b, &p->ctx)) {
+		arena_free(p->ctx.scratch);
+		xfree(p);
+		return 0;
+	}
+	p->lineno = 1;
+	return p;
+}
+
+int toml_parser_feed(toml_parser_t *p, const char *text, size_t len) {
+	if (p->failed)
+		return -1;
+	char *dst = reserve_pending(p, len);
+	if (!dst) {
+		p->failed = true;
+		return -1;
+	}
+	memcpy(dst, text, len);
+	if (append_pending(p, len)) {
+		p->failed = true;
+		return -1;
+	}
+	return 0;
+}
+
+toml_table_t *toml_parser_end(toml_parser_t *p) {
+	if (!p)
+		return 0;
+	/// the rest of the text, if any, is the last statement
+	bool ok = !p->failed && parse_pending(p, p->len) == 0;
+	toml_table_t *ret = done_builder(&p->b, &p->ctx, ok);
+	xfree(p->buf);
+	xfree(p);
+	return ret;
+}
+
+toml_table_t *toml_parse_fd(int fd, char *errbuf, int errbufsz) {
+	toml_parser_t *p = toml_parser_new(errbuf, errbufsz);
+	if (!p)
+		return 0;
+
+	/// read straight into the buffer of the parser, and parse the
+	/// statements of each chunk as soon as they are complete
+	while (!p->failed) {
+		char *dst = reserve_pending(p, PARSE_CHUNK);
+		if (!dst) {
+			p->failed = true;
+			break;
+		}
+		size_t room = p->cap - p->len;
+		if (room > INT_MAX)
+			room = INT_MAX;
+		double t0 = (p->ctx.stats ? stats_clock() : 0);
+#ifdef _WIN32
+		int n = _read(fd, dst, (unsigned)room);
+#else
+		ssize_t n = read(fd, dst, room);
+#endif
+		if (p->ctx.stats)
+			p->ctx.stats->read_time += stats_clock() - t0;
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			snprintf(errbuf, errbufsz, "%s", strerror(errno));
+			p->failed = true;
+			break;
+		}
+		if (n == 0)
+			break; /// end of file
+		if (append_pending(p, n))
+			p->failed = true;
+	}
+	return toml_parser_end(p);
+}
+
+toml_table_t *toml_parse(char *toml, char *errbuf, int errbufsz) {
+	return parse_text(toml, strlen(toml), TEXT_CALLER, false, 1, errbuf, errbufsz);
+}
+
+toml_table_t *toml_parse_n(const char *toml, size_t len, char *errbuf, int errbufsz) {
+	return parse_text(toml, len, TEXT_CALLER, false, 1, errbuf, errbufsz);
+}
+
+toml_table_t *toml_parse_parallel(const char *toml, size_t len, int nthreads, char *errbuf, int errbufsz) {
+	return parse_text(toml, len, TEXT_CALLER, false, default_threads(nthreads), errbuf, errbufsz);
+}
+
+toml_table_t *toml_parse_file(FILE *fp, char *errbuf, int errbufsz) {
+	size_t bufsz = 0;
+	char *buf = 0;
+	size_t off = 0;
+	double t0 = (stats_enabled ? stats_clock() : 0);
+
+	while (!feof(fp)) {
+		if (off == bufsz) { /// Double the buffer when full.
+			size_t xsz = bufsz ? 2 * bufsz : 64 * 1024;
+			char *x = realloc(buf, xsz);
+			if (!x) {
+				snprintf(errbuf, errbufsz, "out of memory");
+				xfree(buf);
+				return 0;
+			}
+			buf = x;
+			bufsz = xsz;
+		}
+
+		errno = 0;
+		size_t n = fread(buf + off, 1, bufsz - off, fp);
+		if (ferror(fp)) {
+			snprintf(errbuf, errbufsz, "%s", (errno ? strerror(errno) : "Error reading file"));
+			xfree(buf);
+			return 0;
+		}
+		off += n;
+	}
+
+	/// trim the buffer
+	if (off < bufsz) {
+		char *x = realloc(buf, off > 0 ? off : 1);
+		if (x)
+			buf = x;
+	}
+
+	/// parse it, the document keeps the buffer.
+	double t1 = (stats_enabled ? stats_clock() : 0);
+	toml_table_t *ret = parse_text(buf, off, TEXT_MALLOC, false, 1, errbuf, errbufsz);
+	if (ret && ret->arena->stats)
+		ret->arena->stats->read_time = t1 - t0;
+	return ret;
+}
+
+/* Map the named file and parse it in place, or read it if it cannot be
+ * mapped (then lazy and nthreads are ignored). */
+static toml_table_t *parse_mapped(const char *filename, bool lazy, int nthreads, char *errbuf, int errbufsz) {
+#ifndef _WIN32
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		snprintf(errbuf, errbufsz, "%s", strerror(errno));
+		return 0;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		snprintf(errbuf, errbufsz, "%s", strerror(errno));
+		close(fd);
+		return 0;
+	}
+
+	/// Map regular files, read anything else.
+	size_t len = st.st_size;
+	if (S_ISREG(st.st_mode) && len > 0) {
+		char *map = mmap(0, len, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (map == MAP_FAILED) {
+			snprintf(errbuf, errbufsz, "%s", strerror(errno));
+			return 0;
+		}
+		posix_madvise(map, len, POSIX_MADV_SEQUENTIAL);
+		return parse_text(map, len, TEXT_MMAP, lazy, nthreads, errbuf, errbufsz);
+	}
+	toml_table_t *ret = toml_parse_fd(fd, errbuf, errbufsz);
+	close(fd);
+	return ret;
+#else
+	FILE *fp = fopen(filename, "rb");
+	if (!fp) {
+		snprintf(errbuf, errbufsz, "%s", strerror(errno));
+		return 0;
+	}
+	toml_table_t *ret = toml_parse_file(fp, errbuf, errbufsz);
+	fclose(fp);
+	return ret;
+#endif
+}
+
+toml_table_t *toml_parse_mmap(const char *filename, char *errbuf, int errbufsz) {
+	return parse_mapped(filename, false, 1, errbuf, errbufsz);
+}
+
+toml_table_t *toml_parse_mmap_parallel(const char *filename, int nthreads, char *errbuf, int errbufsz) {
+	return parse_mapped(filename, false, default_threads(nthreads), errbuf, errbufsz);
+}
+
+toml_table_t *toml_parse_lazy(const char *filename, char *errbuf, int errbufsz) {
+	return parse_mapped(filename, true, 1, errbuf, errbufsz);
+}
+
+// Nodes, keys and values live in the arena; only the vectors of children
+// still owned by the heap (those with a non-zero capacity) have to be
+// released individually. This is only needed for a partially built tree.
+static void xfree_tab(toml_table_t *p);
+
+static void xfree_arr(toml_array_t *p) {
+	const int n = p->nitem;
+	for (int i = 0; i < n; i++) {
+		toml_arritem_t *a = &p->item[i];
+		if (a->arr)
+			xfree_arr(a->arr);
+		else if (a->tab)
+			xfree_tab(a->tab);
+	}
+	if (p->itemcap)
+		xfree(p->item);
+}
+
+static void xfree_tab(toml_table_t *p) {
+	if (p->kvalcap)
+		xfree(p->kval);
+
+	for (int i = 0; i < p->narr; i++)
+		xfree_arr(p->arr[i]);
+	if (p->arrcap)
+		xfree(p->arr);
+
+	for (int i = 0; i < p->ntab; i++)
+		xfree_tab(p->tab[i]);
+	if (p->tabcap)
+		xfree(p->tab);
+
+	if (p->slotcap)
+		xfree(p->slot);
+}
+
+// Shrink-to-fit pass. Once a document has been parsed, the vectors of
+// children grown on the heap are moved at their exact sizes into a single
+// chunk of the arena. This leaves no slack in the tree and makes toml_free()
+// a matter of releasing the arena blocks.
+static size_t sizeof_tab_vectors(const toml_table_t *p);
+
+static size_t sizeof_arr_vectors(const toml_array_t *p) {
+	size_t sz = p->itemcap ? ALIGN8(p->nitem * sizeof(*p->item)) : 0;
+	for (int i = 0; i < p->nitem; i++) {
+		if (p->item[i].arr)
+			sz += sizeof_arr_vectors(p->item[i].arr);
+		else if (p->item[i].tab)
+			sz += sizeof_tab_vectors(p->item[i].tab);
+	}
+	return sz;
+}
+
+static size_t sizeof_tab_vectors(const toml_table_t *p) {
+	size_t sz = 0;
+	if (p->kvalcap)
+		sz += ALIGN8(p->nkval * sizeof(*p->kval));
+	if (p->arrcap)
+		sz += ALIGN8(p->narr * sizeof(*p->arr));
+	if (p->tabcap)
+		sz += ALIGN8(p->ntab * sizeof(*p->tab));
+	if (p->slotcap)
+		sz += ALIGN8(p->nslot * sizeof(*p->slot));
+	for (int i = 0; i < p->narr; i++)
+		sz += sizeof_arr_vectors(p->arr[i]);
+	for (int i = 0; i < p->ntab; i++)
+		sz += sizeof_tab_vectors(p->tab[i]);
+	return sz;
+}
+
+static void *move_vector(char **dst, void *p, int n, int *cap, size_t sz) {
+	if (*cap == 0)
+		return p;
+	void *q = 0;
+	if (n > 0) {
+		q = memcpy(*dst, p, n * sz);
+		*dst += ALIGN8(n * sz);
+	}
+	xfree(p);
+	*cap = 0;
+	return q;
+}
+
+static void move_tab_vectors(char **dst, toml_table_t *p);
+
+static void move_arr_vectors(char **dst, toml_array_t *p) {
+	p->item = move_vector(dst, p->item, p->nitem, &p->itemcap, sizeof(*p->item));
+	for (int i = 0; i < p->nitem; i++) {
+		if (p->item[i].arr)
+			move_arr_vectors(dst, p->item[i].arr);
+		else if (p->item[i].tab)
+			move_tab_vectors(dst, p->item[i].tab);
+	}
+}
+
+static void move_tab_vectors(char **dst, toml_table_t *p) {
+	p->kval = move_vector(dst, p->kval, p->nkval, &p->kvalcap, sizeof(*p->kval));
+	p->arr = move_vector(dst, p->arr, p->narr, &p->arrcap, sizeof(*p->arr));
+	p->tab = move_vector(dst, p->tab, p->ntab, &p->tabcap, sizeof(*p->tab));
+	p->slot = move_vector(dst, p->slot, p->nslot, &p->slotcap, sizeof(*p->slot));
+	for (int i = 0; i < p->narr; i++)
+		move_arr_vectors(dst, p->arr[i]);
+	for (int i = 0; i < p->ntab; i++)
+		move_tab_vectors(dst, p->tab[i]);
+}
+
+static int shrink_to_fit(context_t *ctx, toml_table_t *tab) {
+	size_t sz = sizeof_tab_vectors(tab);
+	char *dst = 0;
+	if (sz > 0 && (dst = arena_alloc(ctx->arena, sz)) == 0)
+		return e_outofmemory(ctx, FLINE);
+	move_tab_vectors(&dst, tab);
+	return 0;
+}
+
+static int shrink_array_to_fit(context_t *ctx, toml_array_t *arr) {
+	size_t sz = sizeof_arr_vectors(arr);
+	char *dst = 0;
+	if (sz > 0 && (dst = arena_alloc(ctx->arena, sz)) == 0)
+		return e_outofmemory(ctx, FLINE);
+	move_arr_vectors(&dst, arr);
+	return 0;
+}
+
+/* Forget the children of tab, or arr, once freed by xfree_tab() or
+ * xfree_arr(). */
+static void clear_vectors(toml_table_t *tab, toml_array_t *arr) {
+	if (tab) {
+		tab->nkval = tab->narr = tab->ntab = tab->nslot = 0;
+		tab->kvalcap = tab->arrcap = tab->tabcap = tab->slotcap = 0;
+		tab->kval = 0;
+		tab->arr = 0;
+		tab->tab = 0;
+		tab->slot = 0;
+	} else {
+		arr->nitem = arr->itemcap = 0;
+		arr->item = 0;
+	}
+}
+
+void toml_free(toml_table_t *tab) {
+	if (tab)
+		arena_free(tab->arena); /// the root table lives in its own arena
+}
+
+size_t toml_footprint(const toml_table_t *tab) {
+	const toml_arena_t *a = tab ? tab->arena : 0;
+	if (!a)
+		return 0;
+	size_t sz = sizeof(*a) + (a->textowner != TEXT_CALLER ? a->textlen : 0);
+	for (const arena_block_t *b = a->head; b; b = b->next)
+		sz += sizeof(*b) + b->size;
+	return sz;
+}
+
+static void count_tab(const toml_table_t *tab, toml_stats_t *stats);
+
+static void count_arr(const toml_array_t *arr, toml_stats_t *stats) {
+	stats->arrays++;
+	for (int i = 0; i < arr->nitem; i++) {
+		if (arr->item[i].arr)
+			count_arr(arr->item[i].arr, stats);
+		else if (arr->item[i].tab)
+			count_tab(arr->item[i].tab, stats);
+		else
+			stats->values++;
+	}
+}
+
+static void count_tab(const toml_table_t *tab, toml_stats_t *stats) {
+	stats->tables++;
+	stats->keyvals += tab->nkval;
+	for (int i = 0; i < tab->narr; i++)
+		count_arr(tab->arr[i], stats);
+	for (int i = 0; i < tab->ntab; i++)
+		count_tab(tab->tab[i], stats);
+}
+
+bool toml_stats(const toml_table_t *tab, toml_stats_t *stats) {
+	const toml_arena_t *a = tab->arena;
+	memset(stats, 0, sizeof(*stats));
+	if (a && a->stats)
+		*stats = *a->stats;
+	else
+		stats->bytes = a ? a->textlen : 0;
+	stats->tables = stats->arrays = stats->keyvals = stats->values = 0;
+	count_tab(tab, stats);
+	stats->allocs = 0;
+	if (a) {
+		stats->allocs = 1 + (a->textowner == TEXT_MALLOC);
+		for (const arena_block_t *b = a->head; b; b = b->next)
+			stats->allocs++;
+	}
+	stats->allocated = toml_footprint(tab);
+	return a && a->stats;
+}
+
+/* Parse the sections of the lazy entry tab, or arr, of the root table. A
+ * failure is final: the entry is then never returned by the accessors and
+ * the error is reported again by toml_table_load(). */
+static int load_lazy(toml_table_t *tab, toml_array_t *arr, char *errbuf, int errbufsz) {
+	toml_lazy_t *lazy = tab ? tab->lazy : arr->lazy;
+	toml_arena_t *a = lazy->root->arena;
+	char msg[200];
+	context_t ctx;
+	builder_t b;
+
+	if (lazy->error) {
+		snprintf(errbuf, errbufsz, "%s", lazy->error);
+		return -1;
+	}
+	if (init_context(&ctx, a->text, a->textlen, msg, sizeof(msg))) {
+		snprintf(errbuf, errbufsz, "%s", msg);
+		return -1;
+	}
+	ctx.arena = a;
+	ctx.borrow = true; /// the document owns the text
+	double t0 = (a->stats ? stats_clock() : 0);
+	memset(&b, 0, sizeof(b));
+	b.ctx = &ctx;
+	b.root = lazy->root;
+	b.top = -1;
+	ctx.h = &tree_handler;
+	ctx.ud = &b;
+
+	/// detach the sections so that parsing them does not load them again
+	if (tab)
+		tab->lazy = 0;
+	else
+		arr->lazy = 0;
+	int ret = push_frame(&b, b.root, 0);
+	if (ret == 0)
+		ret = parse_sections(&ctx, lazy->first, 0);
+
+	/// move the new vectors into the arena, even on failure
+	if (tab ? shrink_to_fit(&ctx, tab) : shrink_array_to_fit(&ctx, arr)) {
+		if (tab)
+			xfree_tab(tab);
+		else
+			xfree_arr(arr);
+		clear_vectors(tab, arr);
+		ret = -1;
+	}
+	xfree(b.frame);
+	arena_free(ctx.scratch);
+	drop_keyslots(a);
+	if (a->stats) {
+		a->stats->tokens += ctx.ntoken;
+		a->stats->parse_time += stats_clock() - t0;
+	}
+
+	if (ret) {
+		if ((lazy->error = arena_strndup(a, msg, strlen(msg))) == 0)
+			lazy->error = "out of memory";
+		if (tab)
+			tab->lazy = lazy;
+		else
+			arr->lazy = lazy;
+		snprintf(errbuf, errbufsz, "%s", msg);
+	}
+	return ret;
+}
+
+int toml_table_load(const toml_table_t *tab, const char *key, char *errbuf, int errbufsz) {
+	int entry = find_key(tab, key, hash_key(key));
+	if ((entry & 3) == ENTRY_TAB && tab->tab[entry >> 2]->lazy)
+		return load_lazy(tab->tab[entry >> 2], 0, errbuf, errbufsz);
+	if ((entry & 3) == ENTRY_ARR && tab->arr[entry >> 2]->lazy)
+		return load_lazy(0, tab->arr[entry >> 2], errbuf, errbufsz);
+	return 0;
+}
+
+static void set_token(context_t *ctx, tokentype_t tok, int lineno, char *ptr, int len) {
+	token_t t;
+	t.tok    = tok;
+	t.lineno = lineno;
+	t.ptr    = ptr;
+	t.len    = len;
+	t.eof    = 0;
+	ctx->tok = t;
+	ctx->ntoken++;
+}
+
+static void set_eof(context_t *ctx, int lineno) {
+	set_token(ctx, NEWLINE, lineno, ctx->stop, 0);
+	ctx->tok.eof = 1;
+	ctx->ntoken--; /// the end of a text, or of a section, is not counted either
+}
+
+/* Scan p for n digits compositing entirely of [0-9] */
+static int scan_digits(const char *p, int n) {
+	int ret = 0;
+	for (; n > 0 && isdigit(*p); n--, p++) {
+		ret = 10 * ret + (*p - '0');
+	}
+	return n ? -1 : ret;
+}
+
+static int scan_date(const char *p, int *YY, int *MM, int *DD) {
+	int year, month, day;
+	year = scan_digits(p, 4);
+	month = (year >= 0 && p[4] == '-') ? scan_digits(p + 5, 2) : -1;
+	day = (month >= 0 && p[7] == '-') ? scan_digits(p + 8, 2) : -1;
+	if (YY)
+		*YY = year;
+	if (MM)
+		*MM = month;
+	if (DD)
+		*DD = day;
+	return (year >= 0 && month >= 0 && day >= 0) ? 0 : -1;
+}
+
+static int scan_time(const char *p, int *hh, int *mm, int *ss) {
+	int hour = scan_digits(p, 2);
+	int minute = (hour >= 0 && p[2] == ':') ? scan_digits(p + 3, 2) : -1;
+	int second = (minute >= 0 && p[5] == ':') ? scan_digits(p + 6, 2) : -1;
+	if (hh)
+		*hh = hour;
+	if (mm)
+		*mm = minute;
+	if (ss)
+		*ss = second;
+	return (hour >= 0 && minute >= 0 && second >= 0) ? 0 : -1;
+}
+
+/* Find the first occurrence of 3 consecutive qchar in [p, end). */
+static char *find_triple(char *p, const char *end, int qchar) {
+	while (end - p >= 3) {
+		char *q = memchr(p, qchar, end - p - 2);
+		if (!q)
+			break;
+		if (q[1] == qchar && q[2] == qchar)
+			return q;
+		p = q + 1;
+	}
+	return 0;
+}
+
+/* Scan the string, literal or timestamp token at p. Never reads at or
+ * beyond ctx->stop. */
+static int scan_string(context_t *ctx, char *p, int lineno, bool dotisspecial) {
+	char *orig = p;
+	const char *end = ctx->stop;
+
+	// Literal multiline.
+	if (end - p >= 3 && memcmp(p, "'''", 3) == 0) {
+		char *q = p + 3;
+		while (true) {
+			q = find_triple(q, end, '\'');
+			if (q == 0)
+				return e_syntax(ctx, lineno, "unterminated triple-s-quote");
+			int i = 0;
+			while (q + 3 < end && q[3] == '\'') {
+				i++;
+				if (i >= 3)
+					return e_syntax(ctx, lineno, "too many ''' in triple-s-quote");
+				q++;
+			}
 			break;
 		}
 		set_token(ctx, STRING, lineno, orig, q + 3 - orig);
@@ -1383,10 +3170,10 @@ static int scan_string(context_t *ctx, char *p, int lineno, bool dotisspecial) {
 	}
 
 	// Multiline.
-	if (strncmp(p, "\"\"\"", 3) == 0) {
+	if (end - p >= 3 && memcmp(p, "\"\"\"", 3) == 0) {
 		char *q = p + 3;
 		while (true) {
-			q = strstr(q, "\"\"\"");
+			q = find_triple(q, end, '"');
 			if (q == 0)
 				return e_syntax(ctx, lineno, "unterminated triple-d-quote");
 			if (q[-1] == '\\') {
@@ -1394,7 +3181,7 @@ static int scan_string(context_t *ctx, char *p, int lineno, bool dotisspecial) {
 				continue;
 			}
 			int i = 0;
-			while (q[3] == '\"') {
+			while (q + 3 < end && q[3] == '\"') {
 				i++;
 				if (i >= 3)
 					return e_syntax(ctx, lineno, "too many \"\"\" in triple-d-quote");
@@ -1403,41 +3190,23 @@ static int scan_string(context_t *ctx, char *p, int lineno, bool dotisspecial) {
 			break;
 		}
 
-		/// the string is [p+3, q-1]
-		int hexreq = 0; /// #hex required
-		bool escape = false;
-		for (p += 3; p < q; p++) {
-			if (escape) {
-				escape = false;
-				if (strchr("btnfr\"\\", *p))
-					continue;
-				if (*p == 'u') {
-					hexreq = 4;
-					continue;
-				}
-				if (*p == 'U') {
-					hexreq = 8;
-					continue;
-				}
-				if (p[strspn(p, " \t\r")] == '\n')
-					continue; /* allow for line ending backslash */
-				return e_syntax(ctx, lineno, "bad escape char");
-			}
-			if (hexreq) {
-				hexreq--;
-				if (strchr("0123456789ABCDEFabcdef", *p))
-					continue;
-				return e_syntax(ctx, lineno, "expect hex char");
-			}
-			if (*p == '\\') {
-				escape = true;
+		/// the string is [p+3, q-1], check its escape sequences
+		for (p += 3; (p = (char *)ctx->scan->find3(p, q, '\\', '\\', '\\')) < q;) {
+			if (++p >= q)
+				return e_syntax(ctx, lineno, "expect an escape char");
+			if (*p == 'u' || *p == 'U') {
+				int hexreq = (*p == 'u' ? 4 : 8); /// #hex required
+				for (p++; hexreq > 0 && p < q; hexreq--, p++)
+					if (!CCLASS(*p, CC_HEX))
+						return e_syntax(ctx, lineno, "expect hex char");
+				if (hexreq)
+					return e_syntax(ctx, lineno, "expected more hex char");
 				continue;
 			}
+			if (!CCLASS(*p, CC_ESC) && p[strspn(p, " \t\r")] != '\n') /* allow for line ending backslash */
+				return e_syntax(ctx, lineno, "bad escape char");
+			p++;
 		}
-		if (escape)
-			return e_syntax(ctx, lineno, "expect an escape char");
-		if (hexreq)
-			return e_syntax(ctx, lineno, "expected more hex char");
 
 		set_token(ctx, STRING, lineno, orig, q + 3 - orig);
 		return 0;
@@ -1445,9 +3214,8 @@ static int scan_string(context_t *ctx, char *p, int lineno, bool dotisspecial) {
 
 	// Literal string.
 	if (*p == '\'') {
-		for (p++; *p && *p != '\n' && *p != '\''; p++)
-			;
-		if (*p != '\'')
+		p = (char *)ctx->scan->find3(p + 1, end, '\'', '\n', '\n');
+		if (p >= end || *p != '\'')
 			return e_syntax(ctx, lineno, "unterminated s-quote");
 
 		set_token(ctx, STRING, lineno, orig, p + 1 - orig);
@@ -1456,39 +3224,22 @@ static int scan_string(context_t *ctx, char *p, int lineno, bool dotisspecial) {
 
 	// Basic String.
 	if (*p == '\"') {
-		int hexreq = 0; /// #hex required
-		bool escape = false;
-		for (p++; *p; p++) {
-			if (escape) {
-				escape = false;
-				if (strchr("btnfr\"\\", *p))
-					continue;
-				if (*p == 'u') {
-					hexreq = 4;
-					continue;
-				}
-				if (*p == 'U') {
-					hexreq = 8;
-					continue;
-				}
-				return e_syntax(ctx, lineno, "bad escape char");
-			}
-			if (hexreq) {
-				hexreq--;
-				if (strchr("0123456789ABCDEFabcdef", *p))
-					continue;
-				return e_syntax(ctx, lineno, "expect hex char");
-			}
-			if (*p == '\\') {
-				escape = true;
+		/// jump from escape sequence to escape sequence up to the ending quote
+		for (p++; (p = (char *)ctx->scan->find3(p, end, '"', '\\', '\n')) < end && *p == '\\';) {
+			if (++p >= end)
+				break;
+			if (*p == 'u' || *p == 'U') {
+				int hexreq = (*p == 'u' ? 4 : 8); /// #hex required
+				for (p++; hexreq > 0 && p < end; hexreq--, p++)
+					if (!CCLASS(*p, CC_HEX))
+						return e_syntax(ctx, lineno, "expect hex char");
 				continue;
 			}
-			if (*p == '\n')
-				break;
-			if (*p == '"')
-				break;
+			if (!CCLASS(*p, CC_ESC))
+				return e_syntax(ctx, lineno, "bad escape char");
+			p++;
 		}
-		if (*p != '"')
+		if (p >= end || *p != '"')
 			return e_syntax(ctx, lineno, "unterminated quote");
 
 		set_token(ctx, STRING, lineno, orig, p + 1 - orig);
@@ -1496,8 +3247,9 @@ static int scan_string(context_t *ctx, char *p, int lineno, bool dotisspecial) {
 	}
 
 	// Datetime.
-	if (scan_date(p, 0, 0, 0) == 0 || scan_time(p, 0, 0, 0) == 0) {
-		p += strspn(p, "0123456789.:+-Tt Zz"); /// forward thru the timestamp
+	if ((end - p >= 10 && scan_date(p, 0, 0, 0) == 0) || (end - p >= 8 && scan_time(p, 0, 0, 0) == 0)) {
+		while (p < end && CCLASS(*p, CC_STAMP)) /// forward thru the timestamp
+			p++;
 		for (; p[-1] == ' '; p--) /// squeeze out any spaces at end of string
 			;
 		set_token(ctx, STRING, lineno, orig, p - orig); /// tokenize
@@ -1505,17 +3257,12 @@ static int scan_string(context_t *ctx, char *p, int lineno, bool dotisspecial) {
 	}
 
 	// literals
-	for (; *p && *p != '\n'; p++) {
+	for (; p < end && *p != '\n'; p++) {
 		int ch = *p;
 		if (ch == '.' && dotisspecial)
 			break;
-		if ('A' <= ch && ch <= 'Z')
-			continue;
-		if ('a' <= ch && ch <= 'z')
-			continue;
-		if (strchr("0123456789+-_.", ch))
-			continue;
-		break;
+		if (!CCLASS(ch, CC_LIT))
+			break;
 	}
 
 	set_token(ctx, STRING, lineno, orig, p - orig);
@@ -1526,15 +3273,17 @@ static int next_token(context_t *ctx, bool dotisspecial) {
 	// Eat this tok.
 	char *p = ctx->tok.ptr;
 	int lineno = ctx->tok.lineno;
-	for (int i = 0; i < ctx->tok.len; i++)
-		if (*p++ == '\n')
-			lineno++;
+	if (ctx->tok.len == 1)
+		lineno += (*p == '\n');
+	else if (ctx->tok.len > 1)
+		lineno += ctx->scan->count(p, p + ctx->tok.len, '\n');
+	p += ctx->tok.len;
 
 	/// Make next tok
 	while (p < ctx->stop) {
 		if (*p == '#') { /// Skip comment. stop just before the \n.
-			for (p++; p < ctx->stop && *p != '\n'; p++)
-				;
+			char *q = memchr(p, '\n', ctx->stop - p);
+			p = q ? q : ctx->stop;
 			continue;
 		}
 
@@ -1566,7 +3315,7 @@ static int next_token(context_t *ctx, bool dotisspecial) {
 				set_token(ctx, NEWLINE, lineno, p, 1);
 				return 0;
 			case '\r': case ' ': case '\t': /// ignore white spaces
-				p++;
+				p = (char *)ctx->scan->skip_blanks(p + 1, ctx->stop);
 				continue;
 		}
 
@@ -1594,45 +3343,360 @@ const char *toml_table_key(const toml_table_t *tab, int keyidx, int *keylen) {
 	return 0;
 }
 
-toml_unparsed_t toml_table_unparsed(const toml_table_t *tab, const char *key) {
-	for (int i = 0; i < tab->nkval; i++)
-		if (strcmp(key, tab->kval[i]->key) == 0)
-			return tab->kval[i]->val;
-	return 0;
+toml_array_t *toml_table_array(const toml_table_t *tab, const char *key) {
+	int entry = find_key(tab, key, hash_key(key));
+	toml_array_t *arr = (entry & 3) == ENTRY_ARR ? tab->arr[entry >> 2] : 0;
+	return (arr && arr->lazy && load_lazy(0, arr, 0, 0)) ? 0 : arr;
 }
 
-toml_array_t *toml_table_array(const toml_table_t *tab, const char *key) {
-	for (int i = 0; i < tab->narr; i++)
-		if (strcmp(key, tab->arr[i]->key) == 0)
-			return tab->arr[i];
+toml_table_t *toml_table_table(const toml_table_t *tab, const char *key) {
+	int entry = find_key(tab, key, hash_key(key));
+	toml_table_t *ret = (entry & 3) == ENTRY_TAB ? tab->tab[entry >> 2] : 0;
+	return (ret && ret->lazy && load_lazy(ret, 0, 0, 0)) ? 0 : ret;
+}
+
+int toml_table_len(const toml_table_t *tbl) {
+	return tbl->nkval + tbl->narr + tbl->ntab;
+}
+
+int toml_array_len(const toml_array_t *arr) {
+	return arr->nitem;
+}
+
+toml_array_t *toml_array_array(const toml_array_t *arr, int idx) {
+	return (0 <= idx && idx < arr->nitem) ? arr->item[idx].arr : 0;
+}
+
+toml_table_t *toml_array_table(const toml_array_t *arr, int idx) {
+	return (0 <= idx && idx < arr->nitem) ? arr->item[idx].tab : 0;
+}
+
+// Queries. A path is compiled into a vector of steps, which are evaluated by
+// walking the tree depth first from a table or an array, without copying
+// anything: the matches point into the document.
+#define STEP_KEY   1 /// .key
+#define STEP_INDEX 2 /// [i]
+#define STEP_SLICE 3 /// [i:j] or [i:j:k]
+#define STEP_ALL   4 /// [*] or .*
+
+typedef struct step_t step_t;
+struct step_t {
+	int kind;
+	char *key;          /// for STEP_KEY
+	uint32_t hash;      /// of key
+	long lo, hi, inc;   /// for STEP_INDEX (lo) and STEP_SLICE
+	bool has_lo, has_hi;
+};
+
+struct toml_path_t {
+	char *src;   /// source of the path
+	bool single; /// no wildcard nor slice: at most one match
+	int nstep;
+	step_t step[];
+};
+
+static const char *skip_path_blanks(const char *p) {
+	while (*p == ' ' || *p == '\t')
+		p++;
+	return p;
+}
+
+/* Parse the integer at *pp, if any. Returns 1 if there is one, 0 if there
+ * is none, and -1 if its magnitude exceeds INT_MAX, the largest number of
+ * items of an array, so that indices counted from the end and steps can be
+ * evaluated without overflow. */
+static int parse_path_long(const char **pp, long *ret, char *errbuf, int errbufsz) {
+	const char *p = *pp;
+	if (!(isdigit((uint8_t)*p) || ((*p == '-' || *p == '+') && isdigit((uint8_t)p[1]))))
+		return 0;
+	char *end;
+	errno = 0;
+	*ret = strtol(p, &end, 10);
+	if (errno || *ret > INT_MAX || *ret < -INT_MAX) {
+		snprintf(errbuf, errbufsz, "index or step out of range in path");
+		return -1;
+	}
+	*pp = skip_path_blanks(end);
+	return 1;
+}
+
+/* Parse the key at *pp, bare or quoted, into st. */
+static int parse_path_key(const char **pp, step_t *st, char *errbuf, int errbufsz) {
+	const char *p = *pp;
+	const char *q = p;
+	int len;
+	if (*p == '*') {
+		st->kind = STEP_ALL;
+		*pp = p + 1;
+		return 0;
+	}
+	st->kind = STEP_KEY;
+	if (*p == '"' || *p == '\'') {
+		for (q++; *q && *q != *p; q++)
+			if (*p == '"' && *q == '\\' && q[1])
+				q++;
+		if (*q != *p) {
+			snprintf(errbuf, errbufsz, "unterminated quoted key");
+			return -1;
+		}
+		if (*p == '"')
+			st->key = norm_basic_str(p + 1, q - p - 1, &len, false, true, errbuf, errbufsz);
+		else
+			st->key = norm_lit_str(p + 1, q - p - 1, &len, false, true, errbuf, errbufsz);
+		if (!st->key)
+			return -1;
+		st->hash = hash_key(st->key);
+		*pp = q + 1;
+		return 0;
+	}
+	while (CCLASS(*q, CC_BARE))
+		q++;
+	if (q == p) {
+		snprintf(errbuf, errbufsz, "expect a key in path");
+		return -1;
+	}
+	if (!(st->key = malloc(q - p + 1))) {
+		snprintf(errbuf, errbufsz, "out of memory");
+		return -1;
+	}
+	memcpy(st->key, p, q - p);
+	st->key[q - p] = 0;
+	st->hash = hash_key(st->key);
+	*pp = q;
 	return 0;
 }
 
-toml_table_t *toml_table_table(const toml_table_t *tab, const char *key) {
-	for (int i  = 0; i < tab->ntab; i++)
-		if (strcmp(key, tab->tab[i]->key) == 0)
-			return tab->tab[i];
+/* Parse the selector after the [ at *pp, up to the ], into st. */
+static int parse_path_selector(const char **pp, step_t *st, char *errbuf, int errbufsz) {
+	const char *p = skip_path_blanks(*pp + 1);
+	if (*p == '*') {
+		st->kind = STEP_ALL;
+		p = skip_path_blanks(p + 1);
+	} else {
+		int r = parse_path_long(&p, &st->lo, errbuf, errbufsz);
+		if (r < 0)
+			return -1;
+		st->has_lo = r;
+		if (*p != ':') {
+			if (!st->has_lo) {
+				snprintf(errbuf, errbufsz, "expect an index, a slice or * in []");
+				return -1;
+			}
+			st->kind = STEP_INDEX;
+		} else {
+			st->kind = STEP_SLICE;
+			p = skip_path_blanks(p + 1);
+			if ((r = parse_path_long(&p, &st->hi, errbuf, errbufsz)) < 0)
+				return -1;
+			st->has_hi = r;
+			st->inc = 1;
+			if (*p == ':') {
+				p = skip_path_blanks(p + 1);
+				if ((r = parse_path_long(&p, &st->inc, errbuf, errbufsz)) < 0)
+					return -1;
+				if (r == 0 || st->inc == 0) {
+					snprintf(errbuf, errbufsz, "expect a nonzero step in slice");
+					return -1;
+				}
+			}
+		}
+	}
+	if (*p != ']') {
+		snprintf(errbuf, errbufsz, "expect ] in path");
+		return -1;
+	}
+	*pp = p + 1;
 	return 0;
 }
 
-toml_unparsed_t toml_array_unparsed(const toml_array_t *arr, int idx) {
-	return (0 <= idx && idx < arr->nitem) ? arr->item[idx].val : 0;
+toml_path_t *toml_path_compile(const char *src, char *errbuf, int errbufsz) {
+	size_t len = strlen(src);
+	toml_path_t *path = malloc(sizeof(*path) + (len + 1) * sizeof(step_t)); /// no more steps than bytes
+	if (!path || !(path->src = malloc(len + 1))) {
+		xfree(path);
+		snprintf(errbuf, errbufsz, "out of memory");
+		return 0;
+	}
+	memcpy(path->src, src, len + 1);
+	path->single = true;
+	path->nstep = 0;
+
+	for (const char *p = skip_path_blanks(src); *p; p = skip_path_blanks(p)) {
+		step_t *st = &path->step[path->nstep++];
+		memset(st, 0, sizeof(*st));
+		int ret;
+		if (*p == '[') {
+			ret = parse_path_selector(&p, st, errbuf, errbufsz);
+		} else if (*p == '.' || path->nstep == 1) {
+			if (*p == '.')
+				p = skip_path_blanks(p + 1);
+			ret = parse_path_key(&p, st, errbuf, errbufsz);
+		} else {
+			snprintf(errbuf, errbufsz, "expect . or [ at position %d in path", (int)(p - src));
+			ret = -1;
+		}
+		if (ret) {
+			toml_path_free(path);
+			return 0;
+		}
+		if (st->kind == STEP_ALL || st->kind == STEP_SLICE)
+			path->single = false;
+	}
+	return path;
+}
+
+void toml_path_free(toml_path_t *path) {
+	if (!path)
+		return;
+	for (int i = 0; i < path->nstep; i++)
+		xfree(path->step[i].key);
+	xfree(path->src);
+	xfree(path);
+}
+
+const char *toml_path_source(const toml_path_t *path) {
+	return path->src;
+}
+
+bool toml_path_single(const toml_path_t *path) {
+	return path->single;
+}
+
+typedef struct query_t query_t;
+struct query_t {
+	const toml_path_t *path;
+	toml_match_t *match; /// where to store the matches
+	int maxmatch;        /// size of match[]
+	int nmatch;          /// number of matches
+};
+
+/* Make m the entry of tab, as returned by find_key(). */
+static bool table_match(const toml_table_t *tab, int entry, toml_match_t *m) {
+	memset(m, 0, sizeof(*m));
+	switch (entry & 3) {
+		case ENTRY_KVAL: {
+			toml_keyval_t *kv = tab->kval[entry >> 2];
+			m->kind = 'v';
+			m->valtype = kv->valtype;
+			m->u = &kv->u;
+			return true;
+		}
+		case ENTRY_ARR:
+			m->arr = tab->arr[entry >> 2];
+			if (m->arr->lazy && load_lazy(0, m->arr, 0, 0))
+				return false;
+			m->kind = 'a';
+			return true;
+		case ENTRY_TAB:
+			m->tab = tab->tab[entry >> 2];
+			if (m->tab->lazy && load_lazy(m->tab, 0, 0, 0))
+				return false;
+			m->kind = 't';
+			return true;
+	}
+	return false;
+}
+
+static void array_match(const toml_array_t *arr, int idx, toml_match_t *m) {
+	const toml_arritem_t *item = &arr->item[idx];
+	memset(m, 0, sizeof(*m));
+	if (item->arr) {
+		m->kind = 'a';
+		m->arr = item->arr;
+	} else if (item->tab) {
+		m->kind = 't';
+		m->tab = item->tab;
+	} else {
+		m->kind = 'v';
+		m->valtype = item->valtype;
+		m->u = &item->u;
+	}
 }
 
-int toml_table_len(const toml_table_t *tbl) {
-	return tbl->nkval + tbl->narr + tbl->ntab;
-}
+/* Evaluate the steps from i on at node. */
+static void query_node(query_t *q, int i, const toml_match_t *node) {
+	if (i == q->path->nstep) {
+		if (q->nmatch < q->maxmatch)
+			q->match[q->nmatch] = *node;
+		q->nmatch++;
+		return;
+	}
+	const step_t *st = &q->path->step[i];
+	toml_match_t m;
+
+	if (node->kind == 't') {
+		const toml_table_t *tab = node->tab;
+		if (st->kind == STEP_KEY) {
+			if (table_match(tab, find_key(tab, st->key, st->hash), &m))
+				query_node(q, i + 1, &m);
+		} else if (st->kind == STEP_ALL) {
+			/// in the order of toml_table_key()
+			for (int k = 0; k < tab->nkval; k++)
+				if (table_match(tab, ENTRY(k, ENTRY_KVAL), &m))
+					query_node(q, i + 1, &m);
+			for (int k = 0; k < tab->narr; k++)
+				if (table_match(tab, ENTRY(k, ENTRY_ARR), &m))
+					query_node(q, i + 1, &m);
+			for (int k = 0; k < tab->ntab; k++)
+				if (table_match(tab, ENTRY(k, ENTRY_TAB), &m))
+					query_node(q, i + 1, &m);
+		}
+		return;
+	}
 
-int toml_array_len(const toml_array_t *arr) {
-	return arr->nitem;
+	if (node->kind == 'a') {
+		/// Yorick's rules: 1-based indices, 0 and below count from the end
+		/// |lo|, |hi|, |inc| and n are at most INT_MAX (see parse_path_long),
+		/// so the arithmetic below cannot overflow a long long
+		const toml_array_t *arr = node->arr;
+		long long n = arr->nitem, lo, hi, inc = 1;
+		switch (st->kind) {
+			case STEP_INDEX:
+				lo = hi = (st->lo <= 0 ? st->lo + n : st->lo);
+				break;
+			case STEP_ALL:
+				lo = 1;
+				hi = n;
+				break;
+			case STEP_SLICE:
+				inc = st->inc;
+				lo = !st->has_lo ? (inc > 0 ? 1 : n) : (st->lo <= 0 ? st->lo + n : st->lo);
+				hi = !st->has_hi ? (inc > 0 ? n : 1) : (st->hi <= 0 ? st->hi + n : st->hi);
+				break;
+			default:
+				return;
+		}
+		/// out of range items do not match
+		long long step = (inc > 0 ? inc : -inc);
+		if (inc > 0 && lo < 1)
+			lo += (1 - lo + step - 1) / step * step;
+		if (inc < 0 && lo > n)
+			lo -= (lo - n + step - 1) / step * step;
+		for (long long k = lo; inc > 0 ? (k <= hi && k <= n) : (k >= hi && k >= 1); k += inc) {
+			array_match(arr, k - 1, &m);
+			query_node(q, i + 1, &m);
+		}
+	}
 }
 
-toml_array_t *toml_array_array(const toml_array_t *arr, int idx) {
-	return (0 <= idx && idx < arr->nitem) ? arr->item[idx].arr : 0;
+int toml_table_query(const toml_table_t *tab, const toml_path_t *path, toml_match_t *match, int maxmatch) {
+	query_t q = {path, match, maxmatch, 0};
+	toml_match_t node;
+	memset(&node, 0, sizeof(node));
+	node.kind = 't';
+	node.tab = (toml_table_t *)tab;
+	query_node(&q, 0, &node);
+	return q.nmatch;
 }
 
-toml_table_t *toml_array_table(const toml_array_t *arr, int idx) {
-	return (0 <= idx && idx < arr->nitem) ? arr->item[idx].tab : 0;
+int toml_array_query(const toml_array_t *arr, const toml_path_t *path, toml_match_t *match, int maxmatch) {
+	query_t q = {path, match, maxmatch, 0};
+	toml_match_t node;
+	memset(&node, 0, sizeof(node));
+	node.kind = 'a';
+	node.arr = (toml_array_t *)arr;
+	query_node(&q, 0, &node);
+	return q.nmatch;
 }
 
 static int parse_millisec(const char *p, const char **endp);
@@ -1706,300 +3770,1254 @@ int toml_value_timestamp(toml_unparsed_t src_, toml_timestamp_t *ret) {
 			}
 		}
 	}
-	if (*p != 0)
-		return -1;
-	if (must_parse_time && ret->kind == 'D')
-		return -1;
-	return 0;
-}
-
-/* Raw to boolean */
-int toml_value_bool(toml_unparsed_t src, bool *ret_) {
-	if (!src)
-		return -1;
-	bool dummy;
-	bool *ret = ret_ ? ret_ : &dummy;
+	if (*p != 0)
+		return -1;
+	if (must_parse_time && ret->kind == 'D')
+		return -1;
+	return 0;
+}
+
+/* Raw to boolean */
+int toml_value_bool(toml_unparsed_t src, bool *ret_) {
+	if (!src)
+		return -1;
+	bool dummy;
+	bool *ret = ret_ ? ret_ : &dummy;
+
+	if (strcmp(src, "true") == 0) {
+		*ret = true;
+		return 0;
+	}
+	if (strcmp(src, "false") == 0) {
+		*ret = false;
+		return 0;
+	}
+	return -1;
+}
+
+/* Decode the integer in [p, end): decimal with an optional sign, or
+ * hexadecimal, octal or binary with a 0x, 0o or 0b prefix and no sign.
+ * Underscores are allowed between digits. Return 0 on success, -1 if the
+ * syntax is invalid or the value does not fit in 64 bits. */
+static int decode_int(const char *p, const char *end, int64_t *ret) {
+	bool neg = false;
+	bool have_sign = false;
+	int base = 10;
+
+	if (p < end && (*p == '+' || *p == '-')) { /// allow +/-
+		neg = (*p++ == '-');
+		have_sign = true;
+	}
+	if (p >= end)
+		return -1;
+	if (*p == '0') { /// if 0* ...
+		if (end - p == 1)
+			return *ret = 0, 0;
+		switch (p[1]) {
+			case 'x': base = 16; break;
+			case 'o': base = 8;  break;
+			case 'b': base = 2;  break;
+			default:  return -1; /// no other digits after a leading zero
+		}
+		if (have_sign) /// disallow +0xff, -0xff
+			return -1;
+		p += 2;
+		if (p >= end)
+			return -1;
+	}
+
+	/// Accumulate the magnitude, at most 2^63 for a negative number.
+	uint64_t limit = (uint64_t)INT64_MAX + neg;
+	uint64_t val = 0;
+	bool digit = false; /// previous char was a digit
+	for (; p < end; p++) {
+		int ch = *p;
+		if (ch == '_') { /// only between digits
+			if (!digit || p + 1 >= end)
+				return -1;
+			digit = false;
+			continue;
+		}
+		int d;
+		if ('0' <= ch && ch <= '9')
+			d = ch - '0';
+		else if ('a' <= (ch | 0x20) && (ch | 0x20) <= 'f')
+			d = (ch | 0x20) - 'a' + 10;
+		else
+			return -1;
+		if (d >= base)
+			return -1;
+		if (val > (limit - d) / base) /// overflow
+			return -1;
+		val = val * base + d;
+		digit = true;
+	}
+	if (!digit)
+		return -1;
+	*ret = neg ? -(int64_t)(val - 1) - 1 : (int64_t)val;
+	return 0;
+}
+
+// Decimal to binary floating-point conversion. Numbers with at most 19
+// significant digits and a small exponent are converted exactly with
+// Clinger's fast path, the others with the Eisel-Lemire algorithm, which
+// gives the correctly rounded result (or fails for an ambiguous truncated
+// mantissa) with one or two 64x128-bit multiplications. strtod() is only
+// the last resort.
+#include "toml-pow5.h"
+
+typedef struct { uint64_t lo, hi; } u128_t;
+
+static inline u128_t mul_64x64(uint64_t a, uint64_t b) {
+	u128_t r;
+#ifdef __SIZEOF_INT128__
+	unsigned __int128 p = (unsigned __int128)a * b;
+	r.lo = (uint64_t)p;
+	r.hi = (uint64_t)(p >> 64);
+#else
+	uint64_t a0 = (uint32_t)a, a1 = a >> 32;
+	uint64_t b0 = (uint32_t)b, b1 = b >> 32;
+	uint64_t p00 = a0 * b0, p01 = a0 * b1, p10 = a1 * b0, p11 = a1 * b1;
+	uint64_t mid = (p00 >> 32) + (uint32_t)p01 + (uint32_t)p10;
+	r.lo = (mid << 32) | (uint32_t)p00;
+	r.hi = p11 + (p01 >> 32) + (p10 >> 32) + (mid >> 32);
+#endif
+	return r;
+}
+
+static inline int clz64(uint64_t x) {
+#ifdef __GNUC__
+	return __builtin_clzll(x);
+#else
+	int n = 0;
+	for (; !(x & ((uint64_t)1 << 63)); x <<= 1)
+		n++;
+	return n;
+#endif
+}
+
+/* Return the bits of the IEEE 754 double nearest to w*10^q, w != 0, or
+ * UINT64_MAX if the result is infinite. */
+static uint64_t eisel_lemire(uint64_t w, int64_t q) {
+	if (q < POW5_MINEXP)
+		return 0;
+	if (q > POW5_MAXEXP)
+		return UINT64_MAX;
+
+	int lz = clz64(w);
+	w <<= lz;
+
+	/// 128 most significant bits of w*5^q, refined by the low half of the
+	/// power when the 55 bits needed for rounding are all ones.
+	const uint64_t *pow5 = &pow5_128[2 * (q - POW5_MINEXP)];
+	u128_t prod = mul_64x64(w, pow5[0]);
+	if ((prod.hi & 0x1ff) == 0x1ff) {
+		u128_t low = mul_64x64(w, pow5[1]);
+		prod.lo += low.hi;
+		if (low.hi > prod.lo)
+			prod.hi++;
+	}
+
+	int upperbit = (int)(prod.hi >> 63);
+	int shift = upperbit + 64 - 52 - 3;
+	uint64_t mantissa = prod.hi >> shift;
+	/// biased binary exponent, floor(q*log2(10)) + 63 ...
+	int64_t power2 = (((152170 + 65536) * q) >> 16) + 63 + upperbit - lz + 1023;
+
+	if (power2 <= 0) { /// subnormal
+		if (-power2 + 1 >= 64)
+			return 0;
+		mantissa >>= -power2 + 1;
+		mantissa += (mantissa & 1); /// round up
+		mantissa >>= 1;
+		/// rounding may have made it normal
+		power2 = (mantissa < ((uint64_t)1 << 52)) ? 0 : 1;
+		return (mantissa & (((uint64_t)1 << 52) - 1)) | ((uint64_t)power2 << 52);
+	}
+
+	/// exactly halfway between two doubles: round to even
+	if (prod.lo <= 1 && -4 <= q && q <= 23 && (mantissa & 3) == 1 &&
+			(mantissa << shift) == prod.hi)
+		mantissa &= ~(uint64_t)1;
+	mantissa += (mantissa & 1);
+	mantissa >>= 1;
+	if (mantissa >= ((uint64_t)2 << 52)) { /// carry out of the mantissa
+		mantissa = (uint64_t)1 << 52;
+		power2++;
+	}
+	if (power2 >= 0x7ff)
+		return UINT64_MAX;
+	return (mantissa & (((uint64_t)1 << 52) - 1)) | ((uint64_t)power2 << 52);
+}
+
+/* Convert a sequence of decimal digits, with underscores, a dot and an
+ * exponent marker kept from the TOML syntax, with strtod(). The number is
+ * rewritten as an integer mantissa and an exponent, so it does not depend on
+ * the decimal point of the locale. */
+static int strtod_fallback(const char *p, const char *end, bool neg, int64_t exp10, double *ret) {
+	char sbuf[128];
+	size_t sz = (end - p) + 32;
+	char *buf = sz <= sizeof(sbuf) ? sbuf : malloc(sz);
+	if (!buf)
+		return -1;
+	char *b = buf;
+	if (neg)
+		*b++ = '-';
+	for (int nfrac = -1; p < end && (*p | 0x20) != 'e'; p++) {
+		if (*p == '.')
+			nfrac = 0;
+		else if ('0' <= *p && *p <= '9') {
+			*b++ = *p;
+			if (nfrac >= 0)
+				exp10--;
+		}
+	}
+	b += sprintf(b, "e%" PRId64, exp10);
+
+	errno = 0;
+	char *endp;
+	*ret = strtod(buf, &endp);
+	/// like decode_float(), accept subnormal results
+	int err = (endp != b || (errno == ERANGE && (*ret == 0 || isinf(*ret)))) ? -1 : 0;
+	if (buf != sbuf)
+		free(buf);
+	return err;
+}
+
+static const double exact_pow10[] = {
+	1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/* Decode the float in [p, end): inf or nan with an optional sign, or a
+ * decimal number with an optional sign, fractional part and exponent, and
+ * underscores between digits. Return 0 on success, -1 if the syntax is
+ * invalid or the value overflows or underflows. */
+static int decode_float(const char *p, const char *end, double *ret) {
+	const char *start;
+	bool neg = false;
+
+	if (p < end && (*p == '+' || *p == '-')) /// allow +/-
+		neg = (*p++ == '-');
+	if (end - p == 3 && memcmp(p, "inf", 3) == 0)
+		return *ret = neg ? -HUGE_VAL : HUGE_VAL, 0;
+	if (end - p == 3 && memcmp(p, "nan", 3) == 0)
+		return *ret = neg ? -NAN : NAN, 0;
+	start = p;
+
+	/// First 19 significant digits into w, the value is w*10^q.
+	uint64_t w = 0;
+	int64_t q = 0;
+	int nd = 0;          /// significant digits in w
+	bool trunc = false;  /// nonzero digits were dropped
+	bool frac = false;   /// in the fractional part
+	bool digit = false;  /// previous char was a digit
+
+	if (p >= end || *p < '0' || *p > '9')
+		return -1;
+	if (*p == '0' && p + 1 < end && p[1] != '.' && (p[1] | 0x20) != 'e')
+		return -1; /// zero must be followed by . or e, or nothing
+	for (; p < end; p++) {
+		int ch = *p;
+		if ('0' <= ch && ch <= '9') {
+			int d = ch - '0';
+			if (w == 0 && d == 0) {
+				q -= frac; /// leading zero
+			} else if (nd < 19) {
+				w = 10 * w + d;
+				nd++;
+				q -= frac;
+			} else {
+				q += !frac;
+				trunc |= (d != 0);
+			}
+			digit = true;
+		} else if (ch == '_') { /// only between digits
+			if (!digit || p + 1 >= end || p[1] < '0' || p[1] > '9')
+				return -1;
+			digit = false;
+		} else if (ch == '.') { /// digits on both sides
+			if (frac || !digit || p + 1 >= end || p[1] < '0' || p[1] > '9')
+				return -1;
+			frac = true;
+			digit = false;
+		} else {
+			break;
+		}
+	}
+
+	const char *mend = p; /// end of the mantissa
+	int64_t exp10 = 0;
+	if (p < end) {
+		if ((*p | 0x20) != 'e')
+			return -1;
+		bool eneg = false;
+		if (++p < end && (*p == '+' || *p == '-'))
+			eneg = (*p++ == '-');
+		digit = false;
+		if (p >= end)
+			return -1;
+		for (; p < end; p++) {
+			int ch = *p;
+			if ('0' <= ch && ch <= '9') {
+				if (exp10 < 100000) /// large enough to over/underflow anyway
+					exp10 = 10 * exp10 + (ch - '0');
+				digit = true;
+			} else if (ch == '_' && digit && p + 1 < end && '0' <= p[1] && p[1] <= '9') {
+				digit = false;
+			} else {
+				return -1;
+			}
+		}
+		if (eneg)
+			exp10 = -exp10;
+	}
+	q += exp10;
+
+	if (w == 0)
+		return *ret = neg ? -0.0 : 0.0, 0;
+
+#if FLT_EVAL_METHOD == 0
+	if (!trunc && w <= ((uint64_t)1 << 53) && -22 <= q && q <= 22) {
+		/// w and 10^|q| are exact doubles and the operation rounds once.
+		double d = (double)w;
+		d = q < 0 ? d / exact_pow10[-q] : d * exact_pow10[q];
+		return *ret = neg ? -d : d, 0;
+	}
+#endif
+
+	uint64_t bits = eisel_lemire(w, q);
+	if (trunc && bits != eisel_lemire(w + 1, q))
+		return strtod_fallback(start, mend, neg, exp10, ret);
+	if (bits == 0 || bits == UINT64_MAX)
+		return -1; /// underflow or overflow
+	double d;
+	memcpy(&d, &bits, sizeof(d));
+	return *ret = neg ? -d : d, 0;
+}
+
+/* Raw to integer */
+int toml_value_int(toml_unparsed_t src, int64_t *ret_) {
+	if (!src)
+		return -1;
+	int64_t dummy;
+	return decode_int(src, src + strlen(src), ret_ ? ret_ : &dummy);
+}
+
+int toml_value_double(toml_unparsed_t src, double *ret_) {
+	if (!src)
+		return -1;
+	double dummy;
+	return decode_float(src, src + strlen(src), ret_ ? ret_ : &dummy);
+}
+
+int toml_value_string(toml_unparsed_t src, char **ret, int *len) {
+	bool multiline = false;
+	const char *sp;
+	const char *sq;
+
+	*ret = 0;
+	if (!src)
+		return -1;
+
+	/// First char must be a s-quote or d-quote
+	int qchar = src[0];
+	int srclen = strlen(src);
+	if (!(qchar == '\'' || qchar == '"')) {
+		return -1;
+	}
+
+	/// triple quotes?
+	if (qchar == src[1] && qchar == src[2]) {
+		multiline = true;      /// triple-quote implies multiline
+		sp = src + 3;          /// first char after quote
+		sq = src + srclen - 3; /// first char of ending quote
+
+		if (!(sp <= sq && sq[0] == qchar && sq[1] == qchar && sq[2] == qchar))
+			return -1; /// last 3 chars in src must be qchar
+
+		if (sp[0] == '\n') /// skip new line immediate after qchar
+			sp++;
+		else if (sp[0] == '\r' && sp[1] == '\n')
+			sp += 2;
+	} else {
+		sp = src + 1;          /// first char after quote
+		sq = src + srclen - 1; /// ending quote
+		if (!(sp <= sq && *sq == qchar)) /// last char in src must be qchar
+			return -1;
+	}
+
+	/// at this point:
+	///     sp points to first valid char after quote.
+	///     sq points to one char beyond last valid char.
+	///     string len is (sq - sp).
+	if (qchar == '\'')
+		*ret = norm_lit_str(sp, sq - sp, len, multiline, false, 0, 0);
+	else
+		*ret = norm_basic_str(sp, sq - sp, len, multiline, false, 0, 0);
+	return *ret ? 0 : -1;
+}
+
+// Typed accessors. Values have been decoded by the parser, so these only have
+// to check the value type. Strings and timestamps are returned as copies the
+// caller must free.
+static const toml_keyval_t *table_keyval(const toml_table_t *tbl, const char *key) {
+	int entry = find_key(tbl, key, hash_key(key));
+	return (entry & 3) == ENTRY_KVAL ? tbl->kval[entry >> 2] : 0;
+}
+
+static const toml_arritem_t *array_value(const toml_array_t *arr, int idx) {
+	return (0 <= idx && idx < arr->nitem && arr->item[idx].valtype) ? &arr->item[idx] : 0;
+}
+
+static toml_value_t scalar_value(int valtype, const toml_scalar_t *u, int want) {
+	toml_value_t ret;
+	memset(&ret, 0, sizeof(ret));
+	switch (want) {
+		case 's':
+			if (valtype == 's') {
+				ret.ok = !!(ret.u.s = malloc(u->s.len + 1));
+				if (ret.ok) {
+					memcpy(ret.u.s, u->s.ptr, u->s.len);
+					ret.u.s[u->s.len] = 0;
+				}
+			}
+			break;
+		case 'b':
+			if ((ret.ok = (valtype == 'b')))
+				ret.u.b = u->b;
+			break;
+		case 'i':
+			if ((ret.ok = (valtype == 'i')))
+				ret.u.i = u->i;
+			break;
+		case 'd':
+			/// integers are also valid floating-point values
+			if (valtype == 'd') {
+				ret.ok = true;
+				ret.u.d = u->d;
+			} else if (valtype == 'i') {
+				ret.ok = true;
+				ret.u.d = (double)u->i;
+			}
+			break;
+		case 'T':
+			if (valtype == 'T' || valtype == 'D' || valtype == 't') {
+				ret.ok = !!(ret.u.ts = malloc(sizeof(*ret.u.ts)));
+				if (ret.ok)
+					*ret.u.ts = *u->ts;
+			}
+			break;
+	}
+	return ret;
+}
+
+static toml_value_t array_scalar(const toml_array_t *arr, int idx, int want) {
+	const toml_arritem_t *item = array_value(arr, idx);
+	return item ? scalar_value(item->valtype, &item->u, want) : scalar_value(0, 0, 0);
+}
+
+static toml_value_t table_scalar(const toml_table_t *tbl, const char *key, int want) {
+	const toml_keyval_t *kv = table_keyval(tbl, key);
+	return kv ? scalar_value(kv->valtype, &kv->u, want) : scalar_value(0, 0, 0);
+}
+
+toml_value_t toml_array_string(const toml_array_t *arr, int idx) {
+	return array_scalar(arr, idx, 's');
+}
+
+toml_value_t toml_array_bool(const toml_array_t *arr, int idx) {
+	return array_scalar(arr, idx, 'b');
+}
+
+toml_value_t toml_array_int(const toml_array_t *arr, int idx) {
+	return array_scalar(arr, idx, 'i');
+}
+
+toml_value_t toml_array_double(const toml_array_t *arr, int idx) {
+	return array_scalar(arr, idx, 'd');
+}
+
+toml_value_t toml_array_timestamp(const toml_array_t *arr, int idx) {
+	return array_scalar(arr, idx, 'T');
+}
+
+toml_value_t toml_table_string(const toml_table_t *tbl, const char *key) {
+	return table_scalar(tbl, key, 's');
+}
+
+toml_value_t toml_table_bool(const toml_table_t *tbl, const char *key) {
+	return table_scalar(tbl, key, 'b');
+}
+
+toml_value_t toml_table_int(const toml_table_t *tbl, const char *key) {
+	return table_scalar(tbl, key, 'i');
+}
+
+toml_value_t toml_table_double(const toml_table_t *tbl, const char *key) {
+	return table_scalar(tbl, key, 'd');
+}
+
+toml_value_t toml_table_timestamp(const toml_table_t *tbl, const char *key) {
+	return table_scalar(tbl, key, 'T');
+}
+
+// Untyped accessors. The entry is found once and described by a match, as
+// for queries, whatever its kind.
+int toml_table_entry(const toml_table_t *tbl, int idx, const char **key, int *keylen, toml_match_t *m) {
+	int entry;
+	*key = 0;
+	*keylen = 0;
+	if (idx < 0)
+		return 0;
+	*key = toml_table_key(tbl, idx, keylen);
+	if (idx < tbl->nkval)
+		entry = ENTRY(idx, ENTRY_KVAL);
+	else if ((idx -= tbl->nkval) < tbl->narr)
+		entry = ENTRY(idx, ENTRY_ARR);
+	else if ((idx -= tbl->narr) < tbl->ntab)
+		entry = ENTRY(idx, ENTRY_TAB);
+	else
+		return 0;
+	return table_match(tbl, entry, m) ? m->kind : 0;
+}
+
+int toml_table_lookup(const toml_table_t *tbl, const char *key, toml_match_t *m) {
+	return table_match(tbl, find_key(tbl, key, hash_key(key)), m) ? m->kind : 0;
+}
+
+int toml_array_item(const toml_array_t *arr, int idx, toml_match_t *m) {
+	if (idx < 0 || idx >= arr->nitem)
+		return 0;
+	array_match(arr, idx, m);
+	return m->kind;
+}
+
+static int parse_millisec(const char *p, const char **endp) {
+	int ret = 0;
+	int unit = 100; /// unit in millisec
+	for (; '0' <= *p && *p <= '9'; p++, unit /= 10)
+		ret += (*p - '0') * unit;
+	*endp = p;
+	return ret;
+}
+
+// Flat representation. A tape is made in two walks of the tree: the first
+// one counts the nodes, the timestamps and the bytes of the strings, and
+// gives every distinct key its offset in the blob; the second one fills the
+// single allocation of the tape, made of the toml_tape_t, the nodes, the
+// timestamps and the blob. The keys of the tree being interned, a key is
+// found again by its hash, and stored once.
+typedef struct tapekey_t tapekey_t;
+struct tapekey_t {
+	const char *key; /// 0 for an empty slot
+	size_t off;      /// offset in the blob
+};
+
+typedef struct tape_maker_t tape_maker_t;
+struct tape_maker_t {
+	size_t nnode;    /// number of nodes
+	size_t nts;      /// number of timestamps
+	size_t nkeybyte; /// bytes of the keys, at the start of the blob
+	size_t nbyte;    /// bytes of the keys and of the strings
+	tapekey_t *slot; /// index of the distinct keys
+	int nslot;
+	int nkey;
+	toml_node_t *node;    /// second walk: nodes, timestamps and blob of the
+	toml_timestamp_t *ts; /// tape, and next free one of each
+	char *blob;
+	size_t nextnode;
+	size_t nextts;
+	size_t nextbyte;
+	char *errbuf;
+	int errbufsz;
+};
+
+/* Find key in the index of m, or add it if add is true. Returns its slot, or
+ * 0 if out of memory. */
+static tapekey_t *tape_key(tape_maker_t *m, const char *key, int keylen, bool add) {
+	uint32_t hash = KEYHASH(key);
+	if (add && 2 * (m->nkey + 1) > m->nslot) {
+		int nslot = m->nslot ? 2 * m->nslot : KEYSLOT_MINLEN;
+		tapekey_t *slot = (nslot > 0 ? malloc(nslot * sizeof(*slot)) : 0);
+		if (!slot)
+			return 0;
+		memset(slot, 0, nslot * sizeof(*slot));
+		for (int i = 0; i < m->nslot; i++) {
+			if (m->slot[i].key) {
+				uint32_t j = KEYHASH(m->slot[i].key) & (nslot - 1);
+				while (slot[j].key)
+					j = (j + 1) & (nslot - 1);
+				slot[j] = m->slot[i];
+			}
+		}
+		xfree(m->slot);
+		m->slot = slot;
+		m->nslot = nslot;
+	}
 
-	if (strcmp(src, "true") == 0) {
-		*ret = true;
-		return 0;
+	uint32_t mask = m->nslot - 1;
+	uint32_t i = hash & mask;
+	for (; m->slot[i].key; i = (i + 1) & mask) {
+		const char *k = m->slot[i].key;
+		if (k == key || (KEYHASH(k) == hash && KEYLEN(k) == (uint32_t)keylen && memcmp(k, key, keylen) == 0))
+			return &m->slot[i];
 	}
-	if (strcmp(src, "false") == 0) {
-		*ret = false;
+	if (!add)
 		return 0;
-	}
-	return -1;
+	m->slot[i].key = key;
+	m->slot[i].off = m->nkeybyte;
+	m->nkeybyte += keylen + 1;
+	m->nkey++;
+	return &m->slot[i];
 }
 
-/* Raw to integer */
-int toml_value_int(toml_unparsed_t src, int64_t *ret_) {
-	if (!src)
-		return -1;
+static void tape_count(tape_maker_t *m, int valtype, const toml_scalar_t *u) {
+	m->nnode++;
+	if (valtype == 's')
+		m->nbyte += u->s.len + 1;
+	else if (valtype == 't' || valtype == 'D' || valtype == 'T')
+		m->nts++;
+}
 
-	char buf[100];
-	char *p = buf;
-	char *q = p + sizeof(buf);
-	const char *s = src;
-	int base = 0;
-	int64_t dummy;
-	int64_t *ret = ret_ ? ret_ : &dummy;
-	bool have_sign = false;
+static int tape_count_tab(tape_maker_t *m, toml_table_t *tab);
 
-	if (s[0] == '+' || s[0] == '-') { /// allow +/-
-		have_sign = true;
-		*p++ = *s++;
+static int tape_count_arr(tape_maker_t *m, toml_array_t *arr) {
+	if (arr->lazy && load_lazy(0, arr, m->errbuf, m->errbufsz))
+		return -1;
+	for (int i = 0; i < arr->nitem; i++) {
+		toml_arritem_t *item = &arr->item[i];
+		if (item->arr) {
+			m->nnode++;
+			if (tape_count_arr(m, item->arr))
+				return -1;
+		} else if (item->tab) {
+			m->nnode++;
+			if (tape_count_tab(m, item->tab))
+				return -1;
+		} else {
+			tape_count(m, item->valtype, &item->u);
+		}
 	}
+	return 0;
+}
 
-	if (s[0] == '_') /// disallow +_100
+static int tape_count_tab(tape_maker_t *m, toml_table_t *tab) {
+	if (tab->lazy && load_lazy(tab, 0, m->errbuf, m->errbufsz))
 		return -1;
-
-	if (s[0] == '0') { /// if 0* ...
-		switch (s[1]) {
-			case 'x': base = 16; s += 2; break;
-			case 'o': base = 8;  s += 2; break;
-			case 'b': base = 2;  s += 2; break;
-			case '\0':
-				return *ret = 0, 0;
-			default:
-				if (s[1]) /// ensure no other digits after it
-					return -1;
-		}
-		if (!*s)
+	for (int i = 0, n = toml_table_len(tab); i < n; i++) {
+		int keylen;
+		const char *key = toml_table_key(tab, i, &keylen);
+		if (!tape_key(m, key, keylen, true)) {
+			snprintf(m->errbuf, m->errbufsz, "out of memory");
 			return -1;
-		if (have_sign)   /// disallow +0xff, -0xff
+		}
+	}
+	for (int i = 0; i < tab->nkval; i++)
+		tape_count(m, tab->kval[i]->valtype, &tab->kval[i]->u);
+	for (int i = 0; i < tab->narr; i++) {
+		m->nnode++;
+		if (tape_count_arr(m, tab->arr[i]))
 			return -1;
-		if (s[0] == '_') /// disallow 0x_, 0o_, 0b_
+	}
+	for (int i = 0; i < tab->ntab; i++) {
+		m->nnode++;
+		if (tape_count_tab(m, tab->tab[i]))
 			return -1;
 	}
+	if (m->nnode > INT_MAX) {
+		snprintf(m->errbuf, m->errbufsz, "document too large");
+		return -1;
+	}
+	return 0;
+}
 
-	while (*s && p < q) { /// just strip underscores and pass to strtoll
-		int ch = *s++;
-		if (ch == '_') {
-			if (s[0] == '_')  /// disallow '__'
-				return -1;
-			if (s[0] == '\0') /// numbers cannot end with '_'
-				return -1;
-			continue; /// skip _
-		}
-		*p++ = ch;
+/* Set the node of a value. */
+static void tape_value(tape_maker_t *m, toml_node_t *node, int valtype, const toml_scalar_t *u) {
+	node->kind = 'v';
+	node->type = valtype;
+	node->u = *u;
+	if (valtype == 's') {
+		char *p = m->blob + m->nextbyte;
+		memcpy(p, u->s.ptr, u->s.len);
+		p[u->s.len] = 0;
+		node->u.s.ptr = p;
+		m->nextbyte += u->s.len + 1;
+	} else if (valtype == 't' || valtype == 'D' || valtype == 'T') {
+		node->u.ts = &m->ts[m->nextts++];
+		*node->u.ts = *u->ts;
 	}
+}
 
-	if (*s || p == q) /// if not at end-of-string or we ran out of buffer ...
-		return -1;
+/* Set the key of the node of a table entry. */
+static void tape_node_key(tape_maker_t *m, toml_node_t *node, const char *key, int keylen) {
+	node->key = m->blob + tape_key(m, key, keylen, false)->off;
+	node->keylen = keylen;
+}
 
-	*p = 0; /// cap with NUL
+static void tape_fill_tab(tape_maker_t *m, const toml_table_t *tab, toml_node_t *node);
+
+/* Fill the node of array arr and, after the nodes already reserved, the
+ * nodes of its items. */
+static void tape_fill_arr(tape_maker_t *m, const toml_array_t *arr, toml_node_t *node) {
+	node->kind = 'a';
+	node->type = arr->kind;
+	node->u.sub.first = m->nextnode;
+	node->u.sub.n = arr->nitem;
+	toml_node_t *sub = m->node + m->nextnode;
+	m->nextnode += arr->nitem;
+	for (int i = 0; i < arr->nitem; i++) {
+		const toml_arritem_t *item = &arr->item[i];
+		if (item->arr)
+			tape_fill_arr(m, item->arr, &sub[i]);
+		else if (item->tab)
+			tape_fill_tab(m, item->tab, &sub[i]);
+		else
+			tape_value(m, &sub[i], item->valtype, &item->u);
+	}
+}
 
-	/// Run strtoll on buf to get the integer
-	char *endp;
-	errno = 0;
-	*ret = strtoll(buf, &endp, base);
-	return (errno || *endp) ? -1 : 0;
+static void tape_fill_tab(tape_maker_t *m, const toml_table_t *tab, toml_node_t *node) {
+	int n = toml_table_len(tab);
+	node->kind = 't';
+	node->u.sub.first = m->nextnode;
+	node->u.sub.n = n;
+	toml_node_t *sub = m->node + m->nextnode;
+	m->nextnode += n;
+	for (int i = 0; i < tab->nkval; i++, sub++) {
+		tape_node_key(m, sub, tab->kval[i]->key, tab->kval[i]->keylen);
+		tape_value(m, sub, tab->kval[i]->valtype, &tab->kval[i]->u);
+	}
+	for (int i = 0; i < tab->narr; i++, sub++) {
+		tape_node_key(m, sub, tab->arr[i]->key, tab->arr[i]->keylen);
+		tape_fill_arr(m, tab->arr[i], sub);
+	}
+	for (int i = 0; i < tab->ntab; i++, sub++) {
+		tape_node_key(m, sub, tab->tab[i]->key, tab->tab[i]->keylen);
+		tape_fill_tab(m, tab->tab[i], sub);
+	}
 }
 
-int toml_value_double(toml_unparsed_t src, double *ret_) {
-	if (!src)
-		return -1;
+toml_tape_t *toml_tape_new(const toml_table_t *tab, const toml_array_t *arr, char *errbuf, int errbufsz) {
+	tape_maker_t m;
+	memset(&m, 0, sizeof(m));
+	m.errbuf = errbuf;
+	m.errbufsz = errbufsz;
+	m.nnode = 1;
+	if (tab ? tape_count_tab(&m, (toml_table_t *)tab) : tape_count_arr(&m, (toml_array_t *)arr)) {
+		xfree(m.slot);
+		return 0;
+	}
 
-	char buf[100];
-	char *p = buf;
-	char *q = p + sizeof(buf);
-	const char *s = src;
-	double dummy;
-	double *ret = ret_ ? ret_ : &dummy;
-	bool have_us = false;
+	size_t nodesz = ALIGN8(sizeof(toml_tape_t)) + m.nnode * sizeof(toml_node_t);
+	size_t tssz = ALIGN8(m.nts * sizeof(toml_timestamp_t));
+	char *p = malloc(nodesz + tssz + m.nkeybyte + m.nbyte);
+	if (!p) {
+		xfree(m.slot);
+		snprintf(errbuf, errbufsz, "out of memory");
+		return 0;
+	}
+	toml_tape_t *tape = (toml_tape_t *)p;
+	tape->node = m.node = (toml_node_t *)(p + ALIGN8(sizeof(toml_tape_t)));
+	tape->nnode = m.nnode;
+	m.ts = (toml_timestamp_t *)(p + nodesz);
+	m.blob = p + nodesz + tssz;
+	for (int i = 0; i < m.nslot; i++) {
+		if (m.slot[i].key) {
+			const char *k = m.slot[i].key;
+			memcpy(m.blob + m.slot[i].off, k, KEYLEN(k) + 1);
+		}
+	}
+	m.nextbyte = m.nkeybyte;
+	m.nextnode = 1;
+	memset(m.node, 0, m.nnode * sizeof(*m.node));
+	if (tab)
+		tape_fill_tab(&m, tab, m.node);
+	else
+		tape_fill_arr(&m, arr, m.node);
+	xfree(m.slot);
+	return tape;
+}
 
-	if (s[0] == '+' || s[0] == '-') /// allow +/-
-		*p++ = *s++;
+void toml_tape_free(toml_tape_t *tape) {
+	xfree(tape);
+}
 
-	if (s[0] == '_') /// disallow +_1.00
+int toml_tape_find(const toml_tape_t *tape, int idx, const char *key) {
+	if (idx < 0 || idx >= tape->nnode || tape->node[idx].kind != 't')
 		return -1;
+	const toml_node_t *node = &tape->node[idx];
+	for (int i = node->u.sub.first, end = i + node->u.sub.n; i < end; i++)
+		if (strcmp(tape->node[i].key, key) == 0)
+			return i;
+	return -1;
+}
 
-	{ /// decimal point, if used, must be surrounded by at least one digit on each side
-		char *dot = strchr(s, '.');
-		if (dot) {
-			if (dot == s || !isdigit(dot[-1]) || !isdigit(dot[1]))
-				return -1;
-		}
+/* Serialization. The text is formatted in a buffer which is flushed to the
+ * stream when full, or which grows in memory if there is no stream. Errors
+ * are sticky and reported by toml_writer_close(). */
+
+#define WRITE_BUFSIZE (1024 * 1024)
+
+struct toml_writer_t {
+	FILE *fp;      /// output stream or NULL
+	char *buf;     /// formatted text not flushed yet
+	size_t len;    /// bytes in buf
+	size_t cap;    /// capacity of buf
+	size_t total;  /// bytes written so far, flushed or not
+	int err;       /// errno of the first error, 0 if none
+	char *path;    /// dotted path of the current table
+	size_t pathlen;
+	size_t pathcap;
+	int depth;     /// number of keys in path
+};
+
+toml_writer_t *toml_writer_new(FILE *fp) {
+	toml_writer_t *w = malloc(sizeof(toml_writer_t));
+	if (!w)
+		return 0;
+	memset(w, 0, sizeof(*w));
+	w->fp = fp;
+	w->cap = fp ? WRITE_BUFSIZE : 4096;
+	w->buf = malloc(w->cap);
+	if (!w->buf) {
+		free(w);
+		return 0;
 	}
+	return w;
+}
 
-	/// zero must be followed by . or 'e', or NUL
-	if (s[0] == '0' && s[1] && !strchr("eE.", s[1]))
-		return -1;
+static void writer_flush(toml_writer_t *w) {
+	if (w->fp && w->len > 0) {
+		errno = 0;
+		if (!w->err && fwrite(w->buf, 1, w->len, w->fp) != w->len)
+			w->err = errno ? errno : EIO;
+		w->len = 0;
+	}
+}
 
-	/// just strip underscores and pass to strtod
-	while (*s && p < q) {
-		int ch = *s++;
-		if (ch == '_') {
-			have_us = true;
-			if (s[0] == '_') /// disallow '__'
-				return -1;
-			if (s[0] == 'e') /// disallow _e
-				return -1;
-			if (s[0] == 0)   /// disallow last char '_'
-				return -1;
-			continue; /// skip _
+/* Get room for n more bytes in the buffer. Returns 0 on failure. */
+static char *writer_reserve(toml_writer_t *w, size_t n) {
+	if (w->err)
+		return 0;
+	if (w->cap - w->len >= n)
+		return w->buf + w->len;
+	writer_flush(w);
+	if (w->cap - w->len < n) {
+		size_t cap = w->cap;
+		while (cap - w->len < n)
+			cap *= 2;
+		char *buf = realloc(w->buf, cap);
+		if (!buf) {
+			w->err = ENOMEM;
+			return 0;
 		}
-		if (ch == 'I' || ch == 'N' || ch == 'F' || ch == 'A') /// inf and nan are case-sensitive.
-			return -1;
-		if (ch == 'e' && s[0] == '_') /// disallow e_
-			return -1;
-		*p++ = ch;
+		w->buf = buf;
+		w->cap = cap;
 	}
-	if (*s || p == q)
-		return -1; /// reached end of string or buffer is full?
+	return w->err ? 0 : w->buf + w->len;
+}
 
-	*p = 0; /// cap with NUL
+static void writer_commit(toml_writer_t *w, size_t n) {
+	w->len += n;
+	w->total += n;
+}
 
-	/// Run strtod on buf to get the value
-	char *endp;
-	errno = 0;
-	*ret = strtod(buf, &endp);
-	if (errno || *endp)
-		return -1;
-	if (have_us && (isnan(*ret) || isinf(*ret)))
-		return -1;
-	return 0;
+void toml_write_raw(toml_writer_t *w, const char *text, size_t len) {
+	char *dst = writer_reserve(w, len);
+	if (dst) {
+		memcpy(dst, text, len);
+		writer_commit(w, len);
+	}
 }
 
-int toml_value_string(toml_unparsed_t src, char **ret, int *len) {
-	bool multiline = false;
-	const char *sp;
-	const char *sq;
+/* Escape the len bytes at s in a basic string at dst, which has room for at
+ * least 6*len+2 bytes. Returns the number of bytes stored. */
+static size_t escape_string(char *dst, const char *s, size_t len) {
+	static const char hex[] = "0123456789abcdef";
+	char *q = dst;
+	const char *p = s, *end = s + len;
+	*q++ = '"';
+	while (p < end) {
+		/// copy the run of bytes which need no escape at once
+		const char *run = p;
+		while (p < end && !CCLASS(*p, CC_CTRL) && *p != '"' && *p != '\\' && *p != '\t')
+			p++;
+		memcpy(q, run, p - run);
+		q += p - run;
+		if (p == end)
+			break;
+		int ch = (uint8_t)*p++;
+		*q++ = '\\';
+		switch (ch) {
+			case '"':  *q++ = '"';  break;
+			case '\\': *q++ = '\\'; break;
+			case '\b': *q++ = 'b';  break;
+			case '\t': *q++ = 't';  break;
+			case '\n': *q++ = 'n';  break;
+			case '\f': *q++ = 'f';  break;
+			case '\r': *q++ = 'r';  break;
+			default:
+				*q++ = 'u';
+				*q++ = '0';
+				*q++ = '0';
+				*q++ = hex[ch >> 4];
+				*q++ = hex[ch & 15];
+		}
+	}
+	*q++ = '"';
+	return q - dst;
+}
 
-	*ret = 0;
-	if (!src)
-		return -1;
+void toml_write_string(toml_writer_t *w, const char *s, size_t len) {
+	char *dst = writer_reserve(w, 6 * len + 2);
+	if (dst)
+		writer_commit(w, escape_string(dst, s, len));
+}
 
-	/// First char must be a s-quote or d-quote
-	int qchar = src[0];
-	int srclen = strlen(src);
-	if (!(qchar == '\'' || qchar == '"')) {
-		return -1;
-	}
+static bool is_bare_key(const char *key, size_t len) {
+	if (len == 0)
+		return false;
+	for (size_t i = 0; i < len; i++)
+		if (!CCLASS(key[i], CC_BARE))
+			return false;
+	return true;
+}
 
-	/// triple quotes?
-	if (qchar == src[1] && qchar == src[2]) {
-		multiline = true;      /// triple-quote implies multiline
-		sp = src + 3;          /// first char after quote
-		sq = src + srclen - 3; /// first char of ending quote
+void toml_write_key(toml_writer_t *w, const char *key, size_t len) {
+	if (is_bare_key(key, len))
+		toml_write_raw(w, key, len);
+	else
+		toml_write_string(w, key, len);
+}
 
-		if (!(sp <= sq && sq[0] == qchar && sq[1] == qchar && sq[2] == qchar))
-			return -1; /// last 3 chars in src must be qchar
+void toml_write_bool(toml_writer_t *w, bool b) {
+	if (b)
+		toml_write_raw(w, "true", 4);
+	else
+		toml_write_raw(w, "false", 5);
+}
 
-		if (sp[0] == '\n') /// skip new line immediate after qchar
-			sp++;
-		else if (sp[0] == '\r' && sp[1] == '\n')
-			sp += 2;
+void toml_write_int(toml_writer_t *w, int64_t i) {
+	char *dst = writer_reserve(w, 24);
+	if (dst)
+		writer_commit(w, sprintf(dst, "%" PRId64, i));
+}
+
+/* Print the nd significant digits at dig, the first of them for 10^e, like
+ * %g with precision prec and a decimal point or an exponent. */
+static int print_decimal(char *buf, bool neg, const char *dig, int nd, int e, int prec) {
+	char *q = buf;
+	while (nd > 1 && dig[nd - 1] == '0')
+		nd--;
+	if (neg)
+		*q++ = '-';
+	if (e < -4 || e >= prec) {
+		*q++ = dig[0];
+		if (nd > 1) {
+			*q++ = '.';
+			memcpy(q, dig + 1, nd - 1);
+			q += nd - 1;
+		}
+		q += sprintf(q, "e%c%02d", e < 0 ? '-' : '+', e < 0 ? -e : e);
+	} else if (e >= 0) {
+		for (int i = 0; i <= e; i++)
+			*q++ = (i < nd ? dig[i] : '0');
+		*q++ = '.';
+		if (nd > e + 1) {
+			memcpy(q, dig + e + 1, nd - e - 1);
+			q += nd - e - 1;
+		} else {
+			*q++ = '0';
+		}
 	} else {
-		sp = src + 1;          /// first char after quote
-		sq = src + srclen - 1; /// ending quote
-		if (!(sp <= sq && *sq == qchar)) /// last char in src must be qchar
-			return -1;
+		*q++ = '0';
+		*q++ = '.';
+		for (int i = -1; i > e; i--)
+			*q++ = '0';
+		memcpy(q, dig, nd);
+		q += nd;
 	}
+	*q = '\0';
+	return q - buf;
+}
 
-	/// at this point:
-	///     sp points to first valid char after quote.
-	///     sq points to one char beyond last valid char.
-	///     string len is (sq - sp).
-	if (qchar == '\'')
-		*ret = norm_lit_str(sp, sq - sp, len, multiline, false, 0, 0);
-	else
-		*ret = norm_basic_str(sp, sq - sp, len, multiline, false, 0, 0);
-	return *ret ? 0 : -1;
+/* Format x at buf as the shortest decimal string which reads back as x. At
+ * each precision, x is correctly rounded by printf(); rounding the 17 digits
+ * of x again would round twice and sometimes miss the shortest string. A
+ * normal double whose shortest form has at most 15 digits reads back from
+ * its first 15 digits, subnormals may have fewer. */
+static int format_double(double x, char buf[32]) {
+	if (isnan(x))
+		return sprintf(buf, signbit(x) ? "-nan" : "nan");
+	if (isinf(x))
+		return sprintf(buf, x > 0 ? "+inf" : "-inf");
+	char tmp[32], dig[17];
+	int n = 0;
+	for (int prec = (fabs(x) < DBL_MIN ? 1 : DBL_DIG); prec <= 17; prec++) {
+		snprintf(tmp, sizeof(tmp), "%.*e", prec - 1, x);
+		bool neg = (tmp[0] == '-');
+		const char *p = tmp + neg;
+		dig[0] = p[0];
+		if (prec > 1) {
+			memcpy(dig + 1, p + 2, prec - 1); /// skip the decimal point, whatever the locale
+			p += prec + 1;
+		} else {
+			p += 1;
+		}
+		n = print_decimal(buf, neg, dig, prec, atoi(p + 1), prec);
+		double y;
+		if (prec == 17 || (decode_float(buf, buf + n, &y) == 0 && y == x))
+			break;
+	}
+	return n;
 }
 
-toml_value_t toml_array_string(const toml_array_t *arr, int idx) {
-	toml_value_t ret;
-	memset(&ret, 0, sizeof(ret));
-	int sl;
-	ret.ok = (toml_value_string(toml_array_unparsed(arr, idx), &ret.u.s, &sl) == 0);
-	return ret;
+void toml_write_double(toml_writer_t *w, double d) {
+	char *dst = writer_reserve(w, 32);
+	if (dst)
+		writer_commit(w, format_double(d, dst));
 }
 
-toml_value_t toml_array_bool(const toml_array_t *arr, int idx) {
-	toml_value_t ret;
-	memset(&ret, 0, sizeof(ret));
-	ret.ok = (toml_value_bool(toml_array_unparsed(arr, idx), &ret.u.b) == 0);
-	return ret;
+void toml_write_timestamp(toml_writer_t *w, const toml_timestamp_t *ts) {
+	char *dst = writer_reserve(w, 64);
+	if (!dst)
+		return;
+	int n = 0;
+	switch (ts->kind) {
+		case 'd':
+		case 'l':
+			n = snprintf(dst, 64, "%04d-%02d-%02dT%02d:%02d:%02d.%03d%s", ts->year, ts->month, ts->day,
+			             ts->hour, ts->minute, ts->second, ts->millisec, ts->kind == 'd' ? ts->z : "");
+			break;
+		case 'D':
+			n = snprintf(dst, 64, "%04d-%02d-%02d", ts->year, ts->month, ts->day);
+			break;
+		case 't':
+			n = snprintf(dst, 64, "%02d:%02d:%02d.%03d", ts->hour, ts->minute, ts->second, ts->millisec);
+			break;
+		default:
+			w->err = EINVAL;
+			return;
+	}
+	writer_commit(w, n);
 }
 
-toml_value_t toml_array_int(const toml_array_t *arr, int idx) {
-	toml_value_t ret;
-	memset(&ret, 0, sizeof(ret));
-	ret.ok = (toml_value_int(toml_array_unparsed(arr, idx), &ret.u.i) == 0);
-	return ret;
+void toml_write_header(toml_writer_t *w, int n, const char *const *keys, const int *keylens, bool is_array) {
+	if (w->total > 0)
+		toml_write_raw(w, "\n", 1);
+	toml_write_raw(w, is_array ? "[[" : "[", is_array ? 2 : 1);
+	for (int i = 0; i < n; i++) {
+		if (i > 0)
+			toml_write_raw(w, ".", 1);
+		toml_write_key(w, keys[i], keylens[i]);
+	}
+	toml_write_raw(w, is_array ? "]]\n" : "]\n", is_array ? 3 : 2);
 }
 
-toml_value_t toml_array_double(const toml_array_t *arr, int idx) {
-	toml_value_t ret;
-	memset(&ret, 0, sizeof(ret));
-	ret.ok = (toml_value_double(toml_array_unparsed(arr, idx), &ret.u.d) == 0);
-	return ret;
+/* Write the scalar value u of type valtype. */
+static void write_scalar(toml_writer_t *w, int valtype, const toml_scalar_t *u) {
+	switch (valtype) {
+		case 'b':
+			toml_write_bool(w, u->b);
+			break;
+		case 'i':
+			toml_write_int(w, u->i);
+			break;
+		case 'd':
+			toml_write_double(w, u->d);
+			break;
+		case 's':
+			toml_write_string(w, u->s.ptr, u->s.len);
+			break;
+		case 't':
+		case 'D':
+		case 'T':
+			toml_write_timestamp(w, u->ts);
+			break;
+		default:
+			w->err = EINVAL;
+	}
 }
 
-toml_value_t toml_array_timestamp(const toml_array_t *arr, int idx) {
-	toml_timestamp_t ts;
-	toml_value_t ret;
-	memset(&ret, 0, sizeof(ret));
-	ret.ok = (toml_value_timestamp(toml_array_unparsed(arr, idx), &ts) == 0);
-	if (ret.ok) {
-		ret.ok = !!(ret.u.ts = malloc(sizeof(*ret.u.ts)));
-		if (ret.ok)
-			*ret.u.ts = ts;
+static void write_inline_table(toml_writer_t *w, const toml_table_t *tab);
+
+static void write_inline_array(toml_writer_t *w, const toml_array_t *arr) {
+	toml_write_raw(w, "[", 1);
+	for (int i = 0; i < arr->nitem; i++) {
+		const toml_arritem_t *item = &arr->item[i];
+		if (i > 0)
+			toml_write_raw(w, ", ", 2);
+		if (item->arr)
+			write_inline_array(w, item->arr);
+		else if (item->tab)
+			write_inline_table(w, item->tab);
+		else
+			write_scalar(w, item->valtype, &item->u);
 	}
-	return ret;
+	toml_write_raw(w, "]", 1);
 }
 
-toml_value_t toml_table_string(const toml_table_t *tbl, const char *key) {
-	toml_value_t ret;
-	memset(&ret, 0, sizeof(ret));
-	toml_unparsed_t raw = toml_table_unparsed(tbl, key);
-	if (raw) {
-		int sl;
-		ret.ok = (toml_value_string(raw, &ret.u.s, &sl) == 0);
+static void write_inline_table(toml_writer_t *w, const toml_table_t *tab) {
+	int n = 0;
+	toml_write_raw(w, "{", 1);
+	for (int i = 0; i < tab->nkval; i++, n++) {
+		toml_write_raw(w, n > 0 ? ", " : " ", n > 0 ? 2 : 1);
+		toml_write_key(w, tab->kval[i]->key, tab->kval[i]->keylen);
+		toml_write_raw(w, " = ", 3);
+		write_scalar(w, tab->kval[i]->valtype, &tab->kval[i]->u);
 	}
-	return ret;
+	for (int i = 0; i < tab->narr; i++, n++) {
+		toml_write_raw(w, n > 0 ? ", " : " ", n > 0 ? 2 : 1);
+		toml_write_key(w, tab->arr[i]->key, tab->arr[i]->keylen);
+		toml_write_raw(w, " = ", 3);
+		write_inline_array(w, tab->arr[i]);
+	}
+	for (int i = 0; i < tab->ntab; i++, n++) {
+		toml_write_raw(w, n > 0 ? ", " : " ", n > 0 ? 2 : 1);
+		toml_write_key(w, tab->tab[i]->key, tab->tab[i]->keylen);
+		toml_write_raw(w, " = ", 3);
+		write_inline_table(w, tab->tab[i]);
+	}
+	toml_write_raw(w, n > 0 ? " }" : "}", n > 0 ? 2 : 1);
 }
 
-toml_value_t toml_table_bool(const toml_table_t *tbl, const char *key) {
-	toml_value_t ret;
-	memset(&ret, 0, sizeof(ret));
-	ret.ok = (toml_value_bool(toml_table_unparsed(tbl, key), &ret.u.b) == 0);
-	return ret;
+/* Append key to the dotted path of the current table. Returns the previous
+ * length of the path. */
+static size_t push_path(toml_writer_t *w, const char *key, int keylen) {
+	size_t oldlen = w->pathlen;
+	size_t need = oldlen + 6 * (size_t)keylen + 3;
+	if (need > w->pathcap) {
+		size_t cap = w->pathcap ? w->pathcap : 64;
+		while (cap < need)
+			cap *= 2;
+		char *path = realloc(w->path, cap);
+		if (!path) {
+			w->err = ENOMEM;
+			return oldlen;
+		}
+		w->path = path;
+		w->pathcap = cap;
+	}
+	if (oldlen > 0)
+		w->path[w->pathlen++] = '.';
+	if (is_bare_key(key, keylen)) {
+		memcpy(w->path + w->pathlen, key, keylen);
+		w->pathlen += keylen;
+	} else {
+		w->pathlen += escape_string(w->path + w->pathlen, key, keylen);
+	}
+	return oldlen;
 }
 
-toml_value_t toml_table_int(const toml_table_t *tbl, const char *key) {
-	toml_value_t ret;
-	memset(&ret, 0, sizeof(ret));
-	ret.ok = (toml_value_int(toml_table_unparsed(tbl, key), &ret.u.i) == 0);
-	return ret;
+static void write_path_header(toml_writer_t *w, bool is_array) {
+	if (w->total > 0)
+		toml_write_raw(w, "\n", 1);
+	toml_write_raw(w, is_array ? "[[" : "[", is_array ? 2 : 1);
+	toml_write_raw(w, w->path, w->pathlen);
+	toml_write_raw(w, is_array ? "]]\n" : "]\n", is_array ? 3 : 2);
 }
 
-toml_value_t toml_table_double(const toml_table_t *tbl, const char *key) {
-	toml_value_t ret;
-	memset(&ret, 0, sizeof(ret));
-	ret.ok = (toml_value_double(toml_table_unparsed(tbl, key), &ret.u.d) == 0);
-	return ret;
+/* Write the entries of tab: its values and inline arrays, then its
+ * sub-tables and arrays of tables under their own headers. Past
+ * TABPATH_MAXLEN keys, the parser would not read the headers back, so the
+ * sub-tables and arrays of tables of a table that deep are written inline. */
+static void write_table(toml_writer_t *w, const toml_table_t *tab) {
+	bool deep = (w->depth >= TABPATH_MAXLEN);
+	for (int i = 0; i < tab->nkval; i++) {
+		const toml_keyval_t *kv = tab->kval[i];
+		toml_write_key(w, kv->key, kv->keylen);
+		toml_write_raw(w, " = ", 3);
+		write_scalar(w, kv->valtype, &kv->u);
+		toml_write_raw(w, "\n", 1);
+	}
+	for (int i = 0; i < tab->narr; i++) {
+		const toml_array_t *arr = tab->arr[i];
+		if (arr->kind == 't' && arr->nitem > 0 && !deep)
+			continue;
+		toml_write_key(w, arr->key, arr->keylen);
+		toml_write_raw(w, " = ", 3);
+		write_inline_array(w, arr);
+		toml_write_raw(w, "\n", 1);
+	}
+	if (deep) {
+		for (int i = 0; i < tab->ntab; i++) {
+			const toml_table_t *sub = tab->tab[i];
+			toml_write_key(w, sub->key, sub->keylen);
+			toml_write_raw(w, " = ", 3);
+			write_inline_table(w, sub);
+			toml_write_raw(w, "\n", 1);
+		}
+		return;
+	}
+	for (int i = 0; i < tab->ntab && !w->err; i++) {
+		const toml_table_t *sub = tab->tab[i];
+		size_t oldlen = push_path(w, sub->key, sub->keylen);
+		w->depth++;
+		/// tables with nothing but sub-tables under their own headers need
+		/// no header
+		if (sub->nkval > 0 || sub->narr > 0 || sub->ntab == 0 || w->depth >= TABPATH_MAXLEN)
+			write_path_header(w, false);
+		write_table(w, sub);
+		w->depth--;
+		w->pathlen = oldlen;
+	}
+	for (int i = 0; i < tab->narr && !w->err; i++) {
+		const toml_array_t *arr = tab->arr[i];
+		if (arr->kind != 't' || arr->nitem == 0)
+			continue;
+		size_t oldlen = push_path(w, arr->key, arr->keylen);
+		w->depth++;
+		for (int j = 0; j < arr->nitem; j++) {
+			write_path_header(w, true);
+			write_table(w, arr->item[j].tab);
+		}
+		w->depth--;
+		w->pathlen = oldlen;
+	}
 }
 
-toml_value_t toml_table_timestamp(const toml_table_t *tbl, const char *key) {
-	toml_timestamp_t ts;
-	toml_value_t ret;
-	memset(&ret, 0, sizeof(ret));
-	ret.ok = (toml_value_timestamp(toml_table_unparsed(tbl, key), &ts) == 0);
-	if (ret.ok) {
-		ret.ok = !!(ret.u.ts = malloc(sizeof(*ret.u.ts)));
-		if (ret.ok)
-			*ret.u.ts = ts;
+int toml_write_table(toml_writer_t *w, const toml_table_t *tab, char *errbuf, int errbufsz) {
+	/// sections of a root table parsed lazily must be parsed first
+	if (tab->lazy) {
+		int n = toml_table_len(tab);
+		for (int i = 0; i < n; i++) {
+			int keylen;
+			const char *key = toml_table_key(tab, i, &keylen);
+			if (toml_table_load(tab, key, errbuf, errbufsz))
+				return -1;
+		}
 	}
-	return ret;
+	write_table(w, tab);
+	if (w->err) {
+		snprintf(errbuf, errbufsz, "%s", (w->err == EINVAL ? "value of unknown type" : strerror(w->err)));
+		return -1;
+	}
+	return 0;
 }
 
-static int parse_millisec(const char *p, const char **endp) {
-	int ret = 0;
-	int unit = 100; /// unit in millisec
-	for (; '0' <= *p && *p <= '9'; p++, unit /= 10)
-		ret += (*p - '0') * unit;
-	*endp = p;
-	return ret;
+const char *toml_writer_text(toml_writer_t *w, size_t *len) {
+	char *dst = writer_reserve(w, 1);
+	if (!dst)
+		return 0;
+	*dst = '\0';
+	if (len)
+		*len = w->len;
+	return w->buf;
+}
+
+int toml_writer_close(toml_writer_t *w) {
+	writer_flush(w);
+	errno = 0;
+	if (w->fp && !w->err && fflush(w->fp) != 0)
+		w->err = errno ? errno : EIO;
+	int err = w->err;
+	xfree(w->path);
+	xfree(w->buf);
+	free(w);
+	if (err) {
+		errno = err;
+		return -1;
+	}
+	return 0;
 }
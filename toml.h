@@ -19,6 +19,18 @@ typedef struct toml_value_t     toml_value_t;
 typedef struct toml_timestamp_t toml_timestamp_t;
 typedef struct toml_keyval_t    toml_keyval_t;
 typedef struct toml_arritem_t   toml_arritem_t;
+typedef struct toml_arena_t     toml_arena_t;
+typedef struct toml_keyslot_t   toml_keyslot_t;
+typedef union  toml_scalar_t    toml_scalar_t;
+typedef struct toml_handler_t   toml_handler_t;
+typedef struct toml_parser_t    toml_parser_t;
+typedef struct toml_lazy_t      toml_lazy_t;
+typedef struct toml_path_t      toml_path_t;
+typedef struct toml_match_t     toml_match_t;
+typedef struct toml_writer_t    toml_writer_t;
+typedef struct toml_stats_t     toml_stats_t;
+typedef struct toml_tape_t      toml_tape_t;
+typedef struct toml_node_t      toml_node_t;
 
 // TOML table.
 struct toml_table_t {
@@ -33,6 +45,16 @@ struct toml_table_t {
 	toml_array_t **arr;
 	int ntab;              // tables in the table
 	toml_table_t **tab;
+	int nslot;             // size of the hash index of the keys (0 if none)
+	toml_keyslot_t *slot;
+
+	int kvalcap;           // capacities of kval, arr, tab and slot while
+	int arrcap;            // parsing (0 once the vectors have been shrunk
+	int tabcap;            // to fit)
+	int slotcap;
+
+	toml_arena_t *arena;   // memory of the document (root table only)
+	toml_lazy_t *lazy;     // sections not parsed yet (see toml_parse_lazy)
 };
 
 // TOML array.
@@ -42,11 +64,33 @@ struct toml_array_t {
 	int kind;        // element kind: 'v'alue, 'a'rray, or 't'able, 'm'ixed
 	int type;        // for value kind: 'i'nt, 'd'ouble, 'b'ool, 's'tring, 't'ime, 'D'ate, 'T'imestamp, 'm'ixed
 	int nitem;       // number of elements
+	int itemcap;     // capacity of item while parsing (0 once shrunk to fit)
 	toml_arritem_t *item;
+	toml_lazy_t *lazy; // sections not parsed yet (see toml_parse_lazy)
 };
+
+// Scalar value decoded at parse time. The valid member depends on the value
+// type: 'b'ool, 'i'nt, 'd'ouble, 's'tring, or 't'ime, 'D'ate and
+// 'T'imestamp for the timestamp. Nothing is valid for an 'u'nknown value.
+union toml_scalar_t {
+	bool             b;
+	int64_t          i;
+	double           d;
+	struct {
+		const char *ptr; // decoded UTF-8 string, may contain NULL bytes and may
+		                 // not be NULL-terminated (see toml_parse_mmap)
+		int        len;  // length of the string in bytes
+	} s;
+	toml_timestamp_t *ts;
+	struct {
+		int first;   // index of the first node of the entries or items
+		int n;       // number of entries or items
+	} sub;           // for a table or an array of a tape (see toml_tape_new)
+};
+
 struct toml_arritem_t {
-	int valtype; // for value kind: 'i'nt, 'd'ouble, 'b'ool, 's'tring, 't'ime, 'D'ate, 'T'imestamp
-	char *val;
+	int valtype; // for value kind: 'i'nt, 'd'ouble, 'b'ool, 's'tring, 't'ime, 'D'ate, 'T'imestamp, 'u'nknown
+	toml_scalar_t u; // the decoded value
 	toml_array_t *arr;
 	toml_table_t *tab;
 };
@@ -55,7 +99,8 @@ struct toml_arritem_t {
 struct toml_keyval_t {
 	const char *key; // key to this value
 	int keylen;      // length of key.
-	const char *val; // the raw value
+	int valtype;     // 'i'nt, 'd'ouble, 'b'ool, 's'tring, 't'ime, 'D'ate, 'T'imestamp, 'u'nknown
+	toml_scalar_t u; // the decoded value
 };
 
 // Parsed TOML value.
@@ -89,18 +134,139 @@ struct toml_timestamp_t {
 // toml_parse() parses a TOML document from a string. Returns 0 on error, with
 // the error message stored in errbuf.
 //
+// toml_parse_n() parses the len bytes at toml, which need not be
+// NUL-terminated; the parser never reads outside of [toml, toml+len).
+//
 // toml_parse_file() is identical, but reads from a file descriptor.
 //
+// toml_parse_mmap() maps the named file in memory and parses it in place: the
+// mapping is kept alive by the root table, and string values without escape
+// sequences point into it instead of being copied. Falls back to reading the
+// file if it cannot be mapped.
+//
+// toml_parse_lazy() is like toml_parse_mmap(), but only parses the text before
+// the first [header]. The other tables and arrays of tables of the root table
+// are parsed the first time they are returned by toml_table_table() or
+// toml_table_array(), which return 0 if they cannot be; their headers are
+// checked at once. toml_table_load() parses the entry at key of a table if
+// it is pending, and returns 0 on success or -1 with the error message in
+// errbuf. Accessing a document in lazy mode modifies it, so this must not be
+// done by concurrent threads.
+//
+// toml_parse_parallel() is like toml_parse_n(), and toml_parse_mmap_parallel()
+// like toml_parse_mmap(), but with up to nthreads threads, one per online
+// processor if nthreads <= 0. The text is split in sections at the [headers]
+// as for toml_parse_lazy(): the tables of the root table, and runs of items
+// of its arrays of tables, are parsed concurrently, each thread allocating
+// from its own arena, and merged in the order of the text. The result, or
+// the error message, is the same as for a serial parse.
+//
+// toml_parse_fd() reads from a file descriptor in chunks and parses each
+// complete statement as soon as it has been read, so parsing overlaps the
+// reading and only the statement in progress is buffered. Suitable for pipes
+// and standard input.
+//
 // Use toml_free() to free the return value; this will invalidate all handles
-// for this table.
+// for this table. All nodes, keys and values of a document are allocated in a
+// memory arena owned by the root table, so toml_free() must only be called on
+// a root table. toml_footprint() gives the number of bytes of memory used by
+// the document of a root table, including its text if kept.
 	TOML_EXTERN toml_table_t *toml_parse      (char *toml, char *errbuf, int errbufsz);
+	TOML_EXTERN toml_table_t *toml_parse_n    (const char *toml, size_t len, char *errbuf, int errbufsz);
 	TOML_EXTERN toml_table_t *toml_parse_file (FILE *fp, char *errbuf, int errbufsz);
+	TOML_EXTERN toml_table_t *toml_parse_mmap (const char *filename, char *errbuf, int errbufsz);
+	TOML_EXTERN toml_table_t *toml_parse_fd   (int fd, char *errbuf, int errbufsz);
+	TOML_EXTERN toml_table_t *toml_parse_lazy (const char *filename, char *errbuf, int errbufsz);
+	TOML_EXTERN toml_table_t *toml_parse_parallel      (const char *toml, size_t len, int nthreads, char *errbuf, int errbufsz);
+	TOML_EXTERN toml_table_t *toml_parse_mmap_parallel (const char *filename, int nthreads, char *errbuf, int errbufsz);
+	TOML_EXTERN int           toml_table_load (const toml_table_t *table, const char *key, char *errbuf, int errbufsz);
 	TOML_EXTERN void          toml_free       (toml_table_t *table);
+	TOML_EXTERN size_t        toml_footprint  (const toml_table_t *table);
+
+// Statistics.
+//
+// toml_enable_stats() sets whether the documents parsed from now on collect
+// statistics, and returns the previous setting; this is off by default and,
+// when off, the parser never reads the clock. toml_stats() fills stats for
+// the document of a root table and returns whether its statistics were
+// collected; if not, only the counts of nodes and the memory are given. The
+// parser makes a single pass over the text, so the time to tokenize, decode
+// the values and build the tree is all in parse_time; sections of a lazy
+// document are accounted for as they are parsed. Each token of the text is
+// counted once, so the count is the same whether the document is parsed
+// serially, by threads, or lazily once all its entries are loaded.
+struct toml_stats_t {
+	size_t bytes;       // length of the text
+	size_t tokens;      // number of tokens
+	size_t tables;      // number of tables, the root and inline ones included
+	size_t arrays;      // number of arrays
+	size_t keyvals;     // number of key/value pairs
+	size_t values;      // number of values in arrays
+	size_t allocs;      // number of memory blocks owned by the document
+	size_t allocated;   // their size in bytes (see toml_footprint())
+	double read_time;   // seconds spent reading the file, if read
+	double parse_time;  // seconds spent parsing the text
+	double finish_time; // seconds spent moving the vectors into the arena
+};
+
+	TOML_EXTERN bool toml_enable_stats (bool on);
+	TOML_EXTERN bool toml_stats        (const toml_table_t *table, toml_stats_t *stats);
+
+// Push parsing.
+//
+// toml_parser_new() makes a parser to which the text of a document is given
+// in chunks of any size, split anywhere, by toml_parser_feed(); statements
+// are parsed as soon as they are complete. toml_parser_end() parses what is
+// left, frees the parser, and returns the document, or 0 on error. Errors are
+// reported in errbuf, which must stay valid until toml_parser_end();
+// toml_parser_feed() returns -1 once an error has occurred, 0 otherwise.
+	TOML_EXTERN toml_parser_t *toml_parser_new  (char *errbuf, int errbufsz);
+	TOML_EXTERN int            toml_parser_feed (toml_parser_t *parser, const char *text, size_t len);
+	TOML_EXTERN toml_table_t  *toml_parser_end  (toml_parser_t *parser);
+
+// Event-driven parsing.
+//
+// toml_parse_events() parses the len bytes at toml without building a tree:
+// the contents of the document are reported in order to the callbacks of
+// handler, which all get ud as first argument and may be NULL:
+//
+// - table() for a [x.y.z] header, or [[x.y.z]] if is_array, with the n keys
+//   of the path from the root;
+// - key() for each key of a (dotted) key/value pair, relative to the current
+//   table or inline table; the events of the value follow the last key;
+// - scalar() for a value, with its type as in toml_keyval_t;
+// - array_begin() and array_end() around the items of an array;
+// - inline_table_begin() and inline_table_end() around the key/value pairs
+//   of an inline table.
+//
+// Keys and values, including strings, are only valid during the callback;
+// strings are not NULL-terminated. Only the syntax is checked: duplicate keys
+// and redefined tables are for the consumer to detect; toml_parse() is such a
+// consumer. A callback returning nonzero stops the parse and that value is
+// returned. Otherwise returns 0 on success, or -1 on error with the error
+// message stored in errbuf.
+struct toml_handler_t {
+	int (*table)             (void *ud, int n, const char *const *keys, const int *keylens, bool is_array);
+	int (*key)               (void *ud, const char *key, int keylen);
+	int (*scalar)            (void *ud, int valtype, const toml_scalar_t *val);
+	int (*array_begin)       (void *ud);
+	int (*array_end)         (void *ud);
+	int (*inline_table_begin)(void *ud);
+	int (*inline_table_end)  (void *ud);
+};
+
+	TOML_EXTERN int toml_parse_events (const char *toml, size_t len, const toml_handler_t *handler, void *ud, char *errbuf, int errbufsz);
 
 // Table functions.
 //
 // toml_table_len() gets the number of direct keys for this table;
 // toml_table_key() gets the nth direct key in this table.
+//
+// toml_table_entry() gets the nth direct key in this table with its entry,
+// and toml_table_lookup() the entry of a key, in a single lookup, whatever
+// their kind. They return the kind of the entry, stored in the match as for
+// queries, or 0 if there is none. Likewise, toml_array_item() gets the
+// item at idx of an array.
 	TOML_EXTERN int           toml_table_len       (const toml_table_t *table);
 	TOML_EXTERN const char   *toml_table_key       (const toml_table_t *table, int keyidx, int *keylen);
 	TOML_EXTERN toml_value_t  toml_table_string    (const toml_table_t *table, const char *key);
@@ -110,6 +276,8 @@ struct toml_timestamp_t {
 	TOML_EXTERN toml_value_t  toml_table_timestamp (const toml_table_t *table, const char *key);
 	TOML_EXTERN toml_array_t *toml_table_array     (const toml_table_t *table, const char *key);
 	TOML_EXTERN toml_table_t *toml_table_table     (const toml_table_t *table, const char *key);
+	TOML_EXTERN int           toml_table_entry     (const toml_table_t *table, int keyidx, const char **key, int *keylen, toml_match_t *match);
+	TOML_EXTERN int           toml_table_lookup    (const toml_table_t *table, const char *key, toml_match_t *match);
 
 // Array functions.
 	TOML_EXTERN int           toml_array_len       (const toml_array_t *array);
@@ -120,5 +288,99 @@ struct toml_timestamp_t {
 	TOML_EXTERN toml_value_t  toml_array_timestamp (const toml_array_t *array, int idx);
 	TOML_EXTERN toml_array_t *toml_array_array     (const toml_array_t *array, int idx);
 	TOML_EXTERN toml_table_t *toml_array_table     (const toml_array_t *array, int idx);
+	TOML_EXTERN int           toml_array_item      (const toml_array_t *array, int idx, toml_match_t *match);
+
+// Queries.
+//
+// toml_path_compile() compiles a path made of keys separated by dots, bare
+// or quoted, and of selectors between brackets: an index [i], a slice [i:j]
+// or [i:j:k], or [*] for all the items of an array; .* selects all the
+// entries of a table. Indices follow Yorick's rules: they start at 1, and 0
+// and below count from the end; slices include both bounds. Indices and
+// steps must not exceed INT_MAX in magnitude. For instance:
+// "servers[*].port", "a.\"b.c\"[2:0].d". A compiled path is independent of
+// any document and must be freed by toml_path_free().
+//
+// toml_table_query() and toml_array_query() evaluate a path from a table or
+// an array. They store up to maxmatch matches, in the order of the keys (as
+// given by toml_table_key()) and of the items, and return the number of
+// matches, which may be larger. Matches point into the document.
+//
+// toml_path_single() tells whether a path is single, that is whether it has
+// neither wildcard nor slice. A single path matches at most once.
+struct toml_match_t {
+	int kind;               // 'v'alue, 'a'rray or 't'able
+	int valtype;            // for a value, as in toml_keyval_t
+	const toml_scalar_t *u; // for a value, its decoded value
+	toml_array_t *arr;      // for an array
+	toml_table_t *tab;      // for a table
+};
+
+	TOML_EXTERN toml_path_t *toml_path_compile (const char *path, char *errbuf, int errbufsz);
+	TOML_EXTERN void         toml_path_free    (toml_path_t *path);
+	TOML_EXTERN const char  *toml_path_source  (const toml_path_t *path);
+	TOML_EXTERN bool         toml_path_single  (const toml_path_t *path);
+	TOML_EXTERN int          toml_table_query  (const toml_table_t *table, const toml_path_t *path, toml_match_t *match, int maxmatch);
+	TOML_EXTERN int          toml_array_query  (const toml_array_t *array, const toml_path_t *path, toml_match_t *match, int maxmatch);
+
+// Flat representation.
+//
+// toml_tape_new() lays out a table, or the array arr if table is NULL, as a
+// tape: a vector of fixed-size nodes where node 0 is the table or the array,
+// and where the entries of a table, in the order of toml_table_key(), and the
+// items of an array are contiguous nodes referred to by the index of the
+// first one and their number. Keys, strings and timestamps are copied in a
+// single blob after the nodes, so the tape does not depend on the document
+// and must be freed by toml_tape_free(). Lazy entries are parsed first.
+// Returns NULL on error, with the error message stored in errbuf.
+//
+// toml_tape_find() returns the index of the entry with the given key of the
+// table at node idx, or -1 if there is none or if idx is not the index of a
+// table, so that calls can be chained.
+struct toml_node_t {
+	char kind;       // 'v'alue, 'a'rray or 't'able, as in toml_match_t
+	char type;       // for a value: type as in toml_keyval_t; for an array:
+	                 // kind of its items as in toml_array_t
+	int keylen;      // length of the key
+	const char *key; // key of an entry of a table, NULL for an item
+	toml_scalar_t u; // decoded value, or u.sub for a table or an array
+};
+
+struct toml_tape_t {
+	int nnode;
+	toml_node_t *node;
+};
+
+	TOML_EXTERN toml_tape_t *toml_tape_new  (const toml_table_t *table, const toml_array_t *arr, char *errbuf, int errbufsz);
+	TOML_EXTERN void         toml_tape_free (toml_tape_t *tape);
+	TOML_EXTERN int          toml_tape_find (const toml_tape_t *tape, int idx, const char *key);
+
+// Serialization.
+//
+// toml_writer_new() makes a writer which formats TOML text in a large buffer
+// flushed to fp when full, or which keeps the text in memory if fp is NULL;
+// toml_writer_text() then gives the text written so far. The toml_write_*()
+// functions append to the text: raw bytes, a key (quoted if not bare), a
+// value, or a table header made of n keys. toml_write_double() gives the
+// shortest representation which reads back as the same double.
+// toml_write_table() writes all the entries of a table, which may come from
+// toml_parse(), and returns 0, or -1 with the error message stored in errbuf.
+// Sub-tables go under [headers] of at most 10 keys, the most the parser
+// reads; deeper ones are written inline.
+// Errors are sticky: toml_writer_close() flushes the text, frees the writer,
+// but not fp, and returns 0 on success, or -1 with errno set if anything
+// went wrong.
+	TOML_EXTERN toml_writer_t *toml_writer_new      (FILE *fp);
+	TOML_EXTERN const char    *toml_writer_text     (toml_writer_t *w, size_t *len);
+	TOML_EXTERN int            toml_writer_close    (toml_writer_t *w);
+	TOML_EXTERN void           toml_write_raw       (toml_writer_t *w, const char *text, size_t len);
+	TOML_EXTERN void           toml_write_key       (toml_writer_t *w, const char *key, size_t len);
+	TOML_EXTERN void           toml_write_header    (toml_writer_t *w, int n, const char *const *keys, const int *keylens, bool is_array);
+	TOML_EXTERN void           toml_write_bool      (toml_writer_t *w, bool b);
+	TOML_EXTERN void           toml_write_int       (toml_writer_t *w, int64_t i);
+	TOML_EXTERN void           toml_write_double    (toml_writer_t *w, double d);
+	TOML_EXTERN void           toml_write_string    (toml_writer_t *w, const char *s, size_t len);
+	TOML_EXTERN void           toml_write_timestamp (toml_writer_t *w, const toml_timestamp_t *ts);
+	TOML_EXTERN int            toml_write_table     (toml_writer_t *w, const toml_table_t *table, char *errbuf, int errbufsz);
 
 #endif // TOML_H
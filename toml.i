@@ -2,10 +2,40 @@ if (is_func(plug_in)) plug_in, "ytoml";
 
 extern toml_parse;
 extern toml_parse_file;
-/* DOCUMENT tbl = toml_parse(buffer);
-         or tbl = toml_parse_file(filename);
-
-     Extract a TOML table from a string, a byte buffer, or a file.
+/* DOCUMENT tbl = toml_parse(buffer, threads=n);
+         or tbl = toml_parse_file(filename, mmap=0/1, lazy=0/1, cache=0/1,
+                                  threads=n);
+
+     Extract a TOML table from a string, a byte buffer, or a file.  A byte
+     buffer is parsed in place and need not be null-terminated.
+
+     By default, `toml_parse_file` parses the file while reading it, by chunks,
+     so `filename` may also be a named pipe or "/dev/stdin".
+
+     With keyword `mmap` true, `toml_parse_file` maps the file in memory and
+     parses it in place instead of reading it. The mapping lives as long as
+     the root table and string values without escape sequences are not
+     copied, which saves time and memory for very large files.
+
+     With keyword `lazy` true, the file is mapped as with `mmap` but only the
+     entries before the first `[header]` are parsed. The tables and arrays of
+     tables of the root table are parsed when first accessed, so reading a
+     few sections of a large file only costs a quick scan of the rest. The
+     headers are checked at once, but other syntax errors in a section are
+     only reported when it is accessed.
+
+     Keyword `threads` sets the number of threads to parse a large document:
+     its tables and runs of items of its arrays of tables, split at the
+     `[headers]` of the root table, are parsed concurrently. The result is the
+     same as with a single thread, which is the default; `threads=0` uses one
+     thread per processor. With `toml_parse_file`, this implies `mmap` unless
+     `lazy` is true.
+
+     With keyword `cache` true, the root table is kept in a cache and is
+     returned again, at the cost of a single `stat`, as long as the file has
+     the same device, inode, size and modification time; otherwise the file
+     is parsed again. Cached tables are shared, they are read-only anyway.
+     See `toml_cache` to set the memory budget of the cache.
 
      Entries in a table can be accessed by, nothing to yield the number of
      entries, by an integer index `idx` or by a string `key`:
@@ -53,6 +83,102 @@ extern toml_parse_file;
    SEE ALSO: `toml_key`, `toml_length`, and `toml_type`.
  */
 
+extern toml_parse_files;
+/* DOCUMENT lst = toml_parse_files(names, threads=n);
+
+     Parse the TOML files whose names are given by the array of strings
+     `names` concurrently by `n` threads, one per processor by default, and
+     yield their root tables in the order of `names`. Files are parsed as by
+     `toml_parse_file` with `mmap` true. If any file cannot be parsed, an
+     error is raised for the first such file in the order of `names`.
+
+     The result is indexed like a TOML array:
+
+         len = lst();      // number of tables, also lst.len
+         tbl = lst(i);     // root table of i-th file
+
+   SEE ALSO: `toml_parse_file`.
+ */
+
+extern toml_cache;
+/* DOCUMENT toml_cache();
+         or toml_cache(budget);
+
+     The call `toml_cache()` yields `[budget, used, count]`: the memory budget
+     of the cache of files parsed by `toml_parse_file` with keyword `cache`,
+     the memory used by the cached tables, both in bytes, and the number of
+     cached files. The call `toml_cache(budget)` yields the same and sets the
+     budget; the least recently used tables are evicted to meet it, so
+     `toml_cache(0)` empties the cache. The default budget is 64 MiB.
+
+     An evicted table is freed as soon as it is no longer referenced.
+
+   SEE ALSO: `toml_parse_file`.
+ */
+
+func toml_stats(obj, enable=)
+/* DOCUMENT s = toml_stats(obj);
+         or s = toml_stats();
+         or toml_stats, enable=0/1;
+
+     The call `toml_stats(obj)` yields a hash table with statistics about the
+     document to which the TOML table or array `obj` belongs:
+
+         s.bytes        length of the text in bytes;
+         s.tokens       number of tokens;
+         s.tables       number of tables, the root and inline ones included;
+         s.arrays       number of arrays;
+         s.keyvals      number of keys with a scalar value;
+         s.values       number of values in arrays;
+         s.allocs       number of memory blocks owned by the document;
+         s.allocated    their size in bytes;
+         s.read_time    seconds spent reading the file, if read;
+         s.parse_time   seconds spent parsing the text;
+         s.finish_time  seconds spent compacting the tree;
+         s.collected    whether the statistics were collected.
+
+     Tokens and times are only collected for the documents parsed while the
+     statistics are enabled, which is not the case by default, otherwise they
+     are zero. The parser makes a single pass over the text, so tokenizing,
+     decoding the values and building the tree all count in `parse_time`.
+
+     The call `toml_stats()` yields a hash table with the number of Yorick
+     objects made for TOML tables, arrays and timestamps, and the time spent
+     making them, while the statistics were enabled:
+
+         s.objects      number of objects;
+         s.object_time  seconds spent making them;
+         s.enabled      whether the statistics are enabled.
+
+     Keyword `enable` sets whether to collect statistics from now on; it costs
+     nothing when disabled.
+
+   SEE ALSO: `toml_parse`, `toml_parse_file`, and `h_new`.
+ */
+{
+    if (!is_void(obj) && !obj.is_root) obj = obj.root;
+    s = _toml_stats(obj, enable);
+    if (is_void(obj)) {
+        if (am_subroutine()) return;
+        return h_new(objects=long(s(1)), object_time=s(2), enabled=int(s(3)));
+    }
+    return h_new(bytes=long(s(1)), tokens=long(s(2)), tables=long(s(3)),
+                 arrays=long(s(4)), keyvals=long(s(5)), values=long(s(6)),
+                 allocs=long(s(7)), allocated=long(s(8)), read_time=s(9),
+                 parse_time=s(10), finish_time=s(11), collected=int(s(12)));
+}
+
+extern _toml_stats;
+/* DOCUMENT s = _toml_stats(root, enable);
+
+     Private function which yields the statistics of the TOML root table
+     `root`, or of the Yorick objects if `root` is nil, as a vector of doubles
+     in the order of the members documented for `toml_stats`. If `enable` is
+     not nil, it sets whether to collect statistics from now on.
+
+   SEE ALSO: `toml_stats`.
+ */
+
 local TOML_OTHER, TOML_TABLE, TOML_ARRAY, TOML_TIMESTAMP;
 extern toml_type;
 /* DOCUMENT id = toml_type(obj);
@@ -103,6 +229,83 @@ extern toml_keys;
    SEE ALSO: `toml_length`, `toml_parse`, and `toml_type`.
  */
 
+extern toml_query;
+extern toml_path;
+/* DOCUMENT val = toml_query(obj, path);
+         or cpath = toml_path(path);
+
+     The call `toml_query(obj, path)` yields the values found in the TOML
+     table or array `obj` by following `path`. The path is a string made of
+     keys separated by dots, bare or quoted as in TOML, and of selectors in
+     square brackets applying to arrays:
+
+     • `[i]` selects the `i`-th item, Yorick's indexing rules apply: indices
+       start at 1, `[0]` is the last item, `[-1]` the before last and so on;
+     • `[i:j]` and `[i:j:k]` select a range of items, both bounds included;
+       missing bounds are the first and last items;
+     • `[*]` selects all items of an array or all entries of a table, so does
+       `*` in place of a key.
+
+     For instance, `toml_query(cfg, "servers[*].port")` yields the ports of
+     all servers. Items out of range and missing keys match nothing.
+
+     A path without any wildcard or range is single and `toml_query` yields
+     its value, or `(nil)` if it does not exist. Otherwise, `toml_query`
+     yields `(nil)` if there are no matches, a vector if all matches are
+     booleans, integers, floats or strings of the same type, and a TOML
+     matches object, which can be indexed like a TOML array, in any other
+     case.
+
+     The call `toml_path(path)` compiles `path` once for all; the result can
+     be given to `toml_query` in place of the string or called as a function,
+     `cpath(obj)` being the same as `toml_query(obj, cpath)`. This saves
+     parsing the path when the same query is applied to many documents.
+
+   SEE ALSO: `toml_parse`.
+ */
+
+extern toml_values;
+/* DOCUMENT arr = toml_values(obj);
+
+     The call `toml_values(obj)` yields the values of the TOML array `obj` as
+     a regular Yorick array if they are all booleans (as `int`), integers (as
+     `long`), floats (as `double`) or strings, or nested arrays of such values
+     with the same type and dimensions. The result has the same dimensions as
+     given by `toml_collect`, e.g. `[[1,2,3],[4,5,6]]` yields a 3×2 array of
+     `long`'s. Otherwise, `(nil)` is returned.
+
+     This is much faster than extracting the values one by one.
+
+   SEE ALSO: `toml_collect` and `toml_parse`.
+ */
+
+extern toml_epoch;
+extern toml_datetime;
+/* DOCUMENT t = toml_epoch(obj);
+         f = toml_datetime(obj);
+
+     The call `toml_epoch(obj)` yields the timestamps of the TOML array `obj`
+     as a regular Yorick array of `double`'s, the number of seconds since
+     1970-01-01T00:00:00Z with millisecond precision and with the UTC offset
+     of offset datetimes applied. Local datetimes and local dates are taken as
+     UTC, a local date being at midnight, and a local time yields the number
+     of seconds since midnight. As for `toml_values`, `obj` may have nested
+     arrays of the same dimensions but all the timestamps must be of the same
+     kind (local date, local time or datetime), otherwise `(nil)` is returned.
+
+     The call `toml_datetime(obj)` yields the broken-down fields of the same
+     timestamps in one pass as an array of `long`'s with a leading dimension
+     of length 8: `f(1,..)` is the year, `f(2,..)` the month (1 for January),
+     `f(3,..)` the day of the month, `f(4,..)` the hour, `f(5,..)` the
+     minutes, `f(6,..)` the seconds, `f(7,..)` the milliseconds, and
+     `f(8,..)` the UTC offset in minutes (0 for local timestamps). Fields
+     that are not part of a timestamp, e.g. the hour of a local date, are 0.
+
+     This is much faster than extracting the timestamps one by one.
+
+   SEE ALSO: `toml_values`, `toml_timestamp`, and `toml_parse`.
+ */
+
 extern toml_timestamp;
 /* DOCUMENT ts = toml_timestamp();
 
@@ -111,19 +314,32 @@ extern toml_timestamp;
    SEE ALSO: `toml_parse`.
  */
 
-func toml_load(filename, broadcast=)
-/* DOCUMENT data = toml_load(filename, broadcast=false);
+func toml_load(filename, broadcast=, cache=)
+/* DOCUMENT data = toml_load(filename, broadcast=false, cache=false);
 
      `toml_load(filename)` parse the contents of the TOML file `filename` and
      returns it as a hash table. Keyword `broadcast` specifies whether Yorick's
-     broadcasting rules apply when collecting TOML arrays.
+     broadcasting rules apply when collecting TOML arrays. Keyword `cache`
+     specifies whether to use the cache of parsed files.
 
-   SEE ALSO: `toml_parse` and `toml_collect`.
+   SEE ALSO: `toml_parse`, `toml_parse_file`, and `toml_collect`.
  */
 {
-    return toml_collect(toml_parse_file(filename), broadcast=broadcast);
+    return toml_collect(toml_parse_file(filename, cache=cache),
+                        broadcast=broadcast);
 }
 
+extern _toml_collect;
+/* DOCUMENT arr = _toml_collect(obj, broadcast);
+
+     Private function which yields the TOML array `obj` collected as a regular
+     array by the same rules as `toml_collect`, or `(nil)` if `obj` has, at
+     any depth, items which are not booleans, integers, floats or strings of
+     the same type, or which have incompatible dimensions.
+
+   SEE ALSO: `toml_collect`.
+ */
+
 func toml_collect(obj, &change, broadcast=)
 /* DOCUMENT toml_collect(obj);
          or toml_collect(obj, change, broadcast=false);
@@ -144,15 +360,22 @@ func toml_collect(obj, &change, broadcast=)
 {
     if (toml_type(obj) == TOML_TABLE) {
         // Convert TOML table into a hash table.
-        len = obj.len;
+        keys = toml_keys(obj);
+        len = numberof(keys);
         tbl = h_new();
         for (i = 1; i <= len; ++i) {
-            h_set, tbl, toml_key(obj, i), toml_collect(obj(i), broadcast=broadcast);
+            h_set, tbl, keys(i), toml_collect(obj(i), broadcast=broadcast);
         }
         change = 1n;
         return tbl;
     }
     if (toml_type(obj) == TOML_ARRAY) {
+        // Convert TOML array of values, or of arrays of values, at once.
+        arr = _toml_collect(obj, broadcast);
+        if (!is_void(arr)) {
+            change = 1n;
+            return arr;
+        }
         // Convert TOML array into a "mixed vector".
         len = obj.len;
         vec = mvect_create(len);
@@ -238,6 +461,162 @@ func toml_collect(obj, &change, broadcast=)
     return obj;
 }
 
+func toml_write(dest, obj)
+/* DOCUMENT toml_write, dest, obj;
+
+     Write the contents of `obj`, a TOML table or a hash table as built by
+     `toml_collect`, as TOML text into `dest`, a file name or a text stream.
+     Hash tables are written with their keys in alphabetical order, their
+     values first, then their sub-tables and arrays of tables under their own
+     headers. Yorick arrays are written as nested TOML arrays and strings are
+     escaped as needed. Booleans, which are collected as `int`'s, are written
+     as integers.
+
+     The text is formatted by compiled code in a large buffer, this is much
+     faster than formatting the values one by one with `toml_format_*`.
+
+   SEE ALSO: `toml_format`, `toml_collect`, `toml_parse`, and `h_new`.
+ */
+{
+    w = _toml_writer(is_string(dest) ? dest : []);
+    if (toml_type(obj) == TOML_TABLE) {
+        _toml_write, w, [], obj;
+    } else if (is_hash(obj)) {
+        _toml_write_hash, w, obj, [];
+    } else {
+        error, "expecting a TOML table or a hash table";
+    }
+    text = _toml_close(w);
+    if (!is_string(dest)) {
+        write, dest, format="%s", text;
+    }
+}
+
+func _toml_write_hash(w, obj, path)
+/* DOCUMENT _toml_write_hash, w, obj, path;
+
+     Private function to write the contents of hash table `obj` whose keys
+     from the root table are `path` with the TOML writer `w`. Past the
+     deepest header the parser reads, sub-tables are written inline.
+
+   SEE ALSO: `toml_write`.
+ */
+{
+    keys = h_keys(obj);
+    if (is_void(keys)) return;
+    keys = keys(sort(keys));
+    n = numberof(keys);
+    deep = (numberof(path) >= 10); // at most 10 keys in a header
+    later = array(int, n); // 1 for a table, 2 for an array of tables
+    for (i = 1; i <= n; ++i) {
+        local val;
+        eq_nocopy, val, h_get(obj, keys(i));
+        if (is_hash(val) && !deep) {
+            later(i) = 1;
+        } else if (is_hash(val) || is_mvect(val)) {
+            if (!deep && is_mvect(val)) {
+                len = val.len;
+                for (j = 1; j <= len && is_hash(val(j)); ++j);
+                if (len > 0 && j > len) {
+                    later(i) = 2;
+                    continue;
+                }
+            }
+            _toml_append, w, keys(i), 2;
+            _toml_append_inline, w, val;
+            _toml_append, w, "\n", 1;
+        } else {
+            _toml_write, w, keys(i), val;
+        }
+    }
+    for (i = 1; i <= n; ++i) {
+        if (later(i) == 1) {
+            sub = grow(path, keys(i));
+            _toml_header, w, sub, 0n;
+            _toml_write_hash, w, h_get(obj, keys(i)), sub;
+        } else if (later(i) == 2) {
+            sub = grow(path, keys(i));
+            val = h_get(obj, keys(i));
+            for (j = 1; j <= val.len; ++j) {
+                _toml_header, w, sub, 1n;
+                _toml_write_hash, w, val(j), sub;
+            }
+        }
+    }
+}
+
+func _toml_append_inline(w, val)
+/* DOCUMENT _toml_append_inline, w, val;
+
+     Private function to append to the TOML writer `w` the value `val` as an
+     inline table if it is a hash table, as an array if it is a mixed vector,
+     and as any other value otherwise.
+
+   SEE ALSO: `toml_write`.
+ */
+{
+    if (is_hash(val)) {
+        keys = h_keys(val);
+        n = numberof(keys);
+        if (n > 0) keys = keys(sort(keys));
+        _toml_append, w, "{", 1;
+        for (i = 1; i <= n; ++i) {
+            _toml_append, w, (i > 1 ? ", " : " "), 1;
+            _toml_append, w, keys(i), 2;
+            _toml_append_inline, w, h_get(val, keys(i));
+        }
+        _toml_append, w, (n > 0 ? " }" : "}"), 1;
+    } else if (is_mvect(val)) {
+        len = val.len;
+        _toml_append, w, "[", 1;
+        for (i = 1; i <= len; ++i) {
+            if (i > 1) _toml_append, w, ", ", 1;
+            _toml_append_inline, w, val(i);
+        }
+        _toml_append, w, "]", 1;
+    } else {
+        _toml_append, w, val;
+    }
+}
+
+extern _toml_writer;
+extern _toml_write;
+extern _toml_append;
+extern _toml_header;
+extern _toml_close;
+/* DOCUMENT w = _toml_writer(filename);
+         or _toml_write, w, key, val;
+         or _toml_write, w, [], tbl;
+         or _toml_append, w, val;
+         or _toml_append, w, str, mode;
+         or _toml_header, w, keys, is_array;
+         or text = _toml_close(w);
+
+     Private functions to write TOML. `_toml_writer(filename)` yields a writer
+     to the file `filename`, or which keeps the text in memory if `filename`
+     is `[]`. `_toml_write` writes a line with `key` and the value `val`, or
+     all the entries of the TOML table `tbl`. `_toml_append` appends the
+     value `val`, the raw text `str` if `mode` is 1, or the key `str`
+     followed by " = " if `mode` is 2; pieces are joined in the buffer of the
+     writer, not by the interpreter. `_toml_header` writes a table header,
+     or an array of tables header, made of `keys`. `_toml_close(w)` flushes
+     and closes the writer, and yields the text if it is kept in memory.
+
+   SEE ALSO: `toml_write`.
+ */
+
+extern toml_format;
+/* DOCUMENT str = toml_format(val);
+
+     The call `toml_format(val)` yields a string with the TOML representation
+     of `val`: an integer, a float, a string, a TOML timestamp, or an array of
+     these which is represented by nested TOML arrays, the first dimension
+     being the innermost one. Floats are represented by the shortest string
+     which reads back as the same value.
+
+   SEE ALSO: `toml_write` and `toml_format_float`.
+ */
+
 local toml_format_boolean, toml_format_float, toml_format_integer;
 local toml_format_string, toml_format_timestamp;
 /* DOCUMENT toml_format_boolean(b);
@@ -261,14 +640,15 @@ local toml_format_string, toml_format_timestamp;
      `toml_format_timsetamp(t)` yields a string suitable to represent the
      timestamp `t` in a TOML file.
 
-     For efficiency, it is not checked that the argument is of the correct type:
+     Except `toml_format_boolean`, these are shortcuts to `toml_format`. For
+     efficiency, it is not checked that the argument is of the correct type:
      • `b` is a scalar int;
      • `i` is a scalar integer;
      • `f` is a scalar float/double;
      • `s` is a scalar string;
      • `t` is a TOML timestamp.
 
-   SEE ALSO: toml_parse.
+   SEE ALSO: `toml_format` and `toml_parse`.
  */
 
 func toml_format_boolean(b)
@@ -278,67 +658,20 @@ func toml_format_boolean(b)
 
 func toml_format_integer(i)
 {
-    return swrite(format="%ld", i);
+    return toml_format(long(i));
 }
 
 func toml_format_float(f)
 {
-    t = ieee_test(f);
-    if (t != 0) {
-        if (t == -1) return "-inf";
-        if (t == +1) return "+inf";
-        if (t == 3 || t == 5) return "nan";
-    }
-    str = swrite(format="%.17g", f);
-    return strglob("*[.eE]*", str) ? str : str + ".0";
+    return toml_format(double(f));
 }
 
-_TOML_ESC = array(int, 256);
-_TOML_ESC(1 + '"') = 1n;
-_TOML_ESC(1 + '\b') = 1n;
-_TOML_ESC(1 + '\t') = 1n;
-_TOML_ESC(1 + '\n') = 1n;
-_TOML_ESC(1 + '\f') = 1n;
-_TOML_ESC(1 + '\r') = 1n;
-_TOML_ESC(1 + '\\') = 1n;
 func toml_format_string(s)
 {
-    src = strchar(s);
-    len = numberof(src);
-    dst = array(char, 2*len + 2);
-    j = 1;
-    dst(j) = '"';
-    for (i = 1; i < len /* skip last '\0' */; ++i) {
-        c = src(i);
-        if (_TOML_ESC(1 + c)) {
-            dst(++j) = '\\';
-        }
-        dst(++j) = c;
-    }
-    dst(++j) = '"';
-    return strchar(dst(1:j));
+    return toml_format(s);
 }
 
 func toml_format_timestamp(t)
 {
-    kind = t.kind;
-    if (kind == 'd') {
-        // offset datetime
-        return swrite(format="%d-%02d-%02dT%02d:%02d:%06.3f%s",
-                      t.year, t.month, t.day,
-                      t.hour, t.minute, t.second, t.tz);
-    } else if (kind == 'l') {
-        // local datetime
-        return swrite(format="%d-%02d-%02dT%02d:%02d:%06.3f",
-                      t.year, t.month, t.day,
-                      t.hour, t.minute, t.second);
-    } else if (kind == 'D') {
-        // local date
-        return swrite(format="%d-%02d-%02d", t.year, t.month, t.day);
-    } else if (kind == 't') {
-        // local time
-        return swrite(format="%02d:%06.3f", t.hour, t.minute, t.second);
-    } else {
-        error, "invalid timestamp kind";
-    }
+    return toml_format(t);
 }
@@ -5,6 +5,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#  include <pthread.h>
+#  include <unistd.h>
+#endif
 #include <yapi.h>
 #include <ydata.h>
 #include <pstdlib.h>
@@ -35,6 +40,25 @@ typedef struct ytoml_array_ {
 
 #define IN_RANGE(x,a,b)  (((a) <= (x)) & ((x) <= (b)))
 
+// Statistics of the Yorick objects made for TOML tables, arrays and
+// timestamps, only collected when enabled by `toml_stats`.
+static bool stats_enabled = false;
+static long stats_objects = 0;
+static double stats_time = 0.0;
+
+static double stats_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+static void stats_count(double t0)
+{
+    ++stats_objects;
+    stats_time += stats_clock() - t0;
+}
+
 // Push a new TOML table or array with given root table object (NULL if table
 // is a root table).
 static ytoml_table* ytoml_table_push(toml_table_t* table, DataBlock* root);
@@ -42,12 +66,30 @@ static ytoml_array* ytoml_array_push(toml_array_t* array, DataBlock* root);
 
 static void ytoml_timestamp_push(toml_timestamp_t* ts, bool delete);
 
+// Push the value of a TOML entry, a table or an array as found by a query or
+// an accessor.
+static void push_match(const toml_match_t* m, DataBlock* root);
+
 static void push_string(const char* str)
 {
     char** arr = ypush_q(NULL);
     arr[0] = str == NULL ? NULL : p_strcpy(str);
 }
 
+// Make a Yorick string from the len bytes at str, with a single allocation
+// and copy. The bytes need not be NULL-terminated, as for strings pointing
+// into the text of a document. `p_strncat` cannot be used for these: it
+// takes the length of its source with strlen() and len = 0 means no limit.
+static char* new_string(const char* str, long len)
+{
+    char* s = p_malloc(len + 1);
+    if (len > 0) {
+        memcpy(s, str, len);
+    }
+    s[len] = '\0';
+    return s;
+}
+
 static void ytoml_table_free(void* addr)
 {
     ytoml_table* tbl = addr;
@@ -106,8 +148,13 @@ static void ytoml_table_eval(void* addr, int argc)
         y_error("expecting a scalar integer index, a string key, or nothing");
     }
     const char* key = NULL;
+    toml_match_t m;
+    int kind = 0;
     if (type == Y_STRING) {
         key = ygets_q(0);
+        if (key != NULL) {
+            kind = toml_table_lookup(obj->table, key, &m);
+        }
     } else if (IN_RANGE(type, Y_CHAR, Y_LONG)) {
         long idx = ygets_l(0);
         long len = toml_table_len(obj->table);
@@ -119,63 +166,22 @@ static void ytoml_table_eval(void* addr, int argc)
             y_error("index overreach beyond table bounds");
         }
         int keylen;
-        key = toml_table_key(obj->table, idx - 1, &keylen);
+        kind = toml_table_entry(obj->table, idx - 1, &key, &keylen, &m);
     } else {
         goto bad_arg;
     }
-    if (key == NULL) {
-        ypush_nil();
-        return;
-    }
-    // Entry may be a boolean?
-    toml_value_t val = toml_table_bool(obj->table, key);
-    if (val.ok) {
-        ypush_int(val.u.b ? 1 : 0);
-        return;
-    }
-    // Entry may be an integer?
-    val = toml_table_int(obj->table, key);
-    if (val.ok) {
-        ypush_long(val.u.i);
-        return;
-    }
-    // Entry may be a float?
-    val = toml_table_double(obj->table, key);
-    if (val.ok) {
-        ypush_double(val.u.d);
-        return;
-    }
-    // Entry may be a string?
-    val = toml_table_string(obj->table, key);
-    if (val.ok) {
-        push_string(val.u.s);
-        if (val.u.s != NULL) free(val.u.s);
-        return;
-    }
-    // Entry may be an array?
-    toml_array_t* arr = toml_table_array(obj->table, key);
-    if (arr != NULL) {
-        ytoml_array_push(arr, obj->root);
-        return;
-    }
-    // Entry may be a table?
-    toml_table_t* tbl = toml_table_table(obj->table, key);
-    if (tbl != NULL) {
-        ytoml_table_push(tbl, obj->root);
-        return;
+    // Entries of a root table parsed lazily are parsed by the lookup; report
+    // why if this failed.
+    if (kind == 0 && obj->is_root && key != NULL &&
+        toml_table_load(obj->table, key, errbuf, sizeof(errbuf)) != 0) {
+        y_error(errbuf);
     }
-    // Entry may be a timestamp?
-    errno = 0;
-    val = toml_table_timestamp(obj->table, key);
-    if (val.ok) {
-        ytoml_timestamp_push(val.u.ts, true);
+    if (kind == 0) {
+        // Entry does not exist.
+        ypush_nil();
         return;
     }
-    if (errno == ENOMEM) {
-        y_error("insufficient memory for timestamp");
-    }
-    // Entry is nothing known or does not exist.
-    ypush_nil();
+    push_match(&m, obj->root);
 }
 
 static void ytoml_array_eval(void* addr, int argc)
@@ -199,56 +205,12 @@ static void ytoml_array_eval(void* addr, int argc)
     if (!IN_RANGE(idx, 1, len)) {
         y_error("index overreach beyond array bounds");
     }
-    --idx; // 1-based index -> 0-based index
-    // Entry may be a boolean?
-    toml_value_t val = toml_array_bool(obj->array, idx);
-    if (val.ok) {
-        ypush_int(val.u.b ? 1 : 0);
-        return;
-    }
-    // Entry may be an integer?
-    val = toml_array_int(obj->array, idx);
-    if (val.ok) {
-        ypush_long(val.u.i);
-        return;
-    }
-    // Entry may be a float?
-    val = toml_array_double(obj->array, idx);
-    if (val.ok) {
-        ypush_double(val.u.d);
-        return;
-    }
-    // Entry may be a string?
-    val = toml_array_string(obj->array, idx);
-    if (val.ok) {
-        push_string(val.u.s);
-        if (val.u.s != NULL) free(val.u.s);
-        return;
-    }
-    // Entry may be an array?
-    toml_array_t* arr = toml_array_array(obj->array, idx);
-    if (arr != NULL) {
-        ytoml_array_push(arr, obj->root);
-        return;
-    }
-    // Entry may be a table?
-    toml_table_t* tbl = toml_array_table(obj->array, idx);
-    if (tbl != NULL) {
-        ytoml_table_push(tbl, obj->root);
-        return;
-    }
-    // Entry may be a timestamp?
-    errno = 0;
-    val = toml_array_timestamp(obj->array, idx);
-    if (val.ok) {
-        ytoml_timestamp_push(val.u.ts, true);
+    toml_match_t m;
+    if (toml_array_item(obj->array, idx - 1, &m) == 0) {
+        ypush_nil();
         return;
     }
-    if (errno == ENOMEM) {
-        y_error("insufficient memory for timestamp");
-    }
-    // Entry is nothing known or does not exist.
-    ypush_nil();
+    push_match(&m, obj->root);
 }
 
 static void ytoml_table_extract(void* addr, char* name)
@@ -340,6 +302,7 @@ static inline void* incr_nrefs(void *obj)
 
 static ytoml_table* ytoml_table_push(toml_table_t* table, DataBlock* root)
 {
+    double t0 = (stats_enabled ? stats_clock() : 0.0);
     ytoml_table* tbl = ypush_obj(&ytoml_table_type, sizeof(ytoml_table));
     tbl->table = table;
     if (root == NULL) {
@@ -352,16 +315,19 @@ static ytoml_table* ytoml_table_push(toml_table_t* table, DataBlock* root)
         tbl->root = RefNC(root);
         DEBUG("new TOML table at 0x%p with root at 0x%p\n", tbl, tbl->root);
     }
+    if (stats_enabled) stats_count(t0);
     return tbl;
 }
 
 static ytoml_array* ytoml_array_push(toml_array_t* array, DataBlock* root)
 {
     if (root == NULL) y_error("TOML array must have a root table");
+    double t0 = (stats_enabled ? stats_clock() : 0.0);
     ytoml_array* arr = ypush_obj(&ytoml_array_type, sizeof(ytoml_array));
     arr->array = array;
     arr->root = RefNC(root);
     DEBUG("new TOML array at 0x%p with root at 0x%p\n", arr, arr->root);
+    if (stats_enabled) stats_count(t0);
     return arr;
 }
 
@@ -481,86 +447,1533 @@ static y_userobj_t ytoml_timestamp_type = {
 
 static void ytoml_timestamp_push(toml_timestamp_t* ts, bool delete)
 {
+    double t0 = (stats_enabled ? stats_clock() : 0.0);
     void* obj = ypush_obj(&ytoml_timestamp_type, sizeof(toml_timestamp_t));
     if (ts != NULL) {
         memcpy(obj, ts, sizeof(toml_timestamp_t));
         if (delete) free(ts);
     }
+    if (stats_enabled) stats_count(t0);
 }
 
 /*---------------------------------------------------------------------------*/
-/* BUILTIN FUNCTIONS */
+/* QUERIES */
 
-void Y_toml_parse(int argc)
+typedef struct ytoml_path_ {
+    toml_path_t* path;
+} ytoml_path;
+
+// Matches of a query which are not all scalars of the same type. They can be
+// indexed like a TOML array.
+typedef struct ytoml_matches_ {
+    DataBlock*     root; // Yorick object referencing the TOML root table
+    long            len;
+    toml_match_t match[1];
+} ytoml_matches;
+
+static void ytoml_query(int iarg, const toml_path_t* path);
+
+static void push_match(const toml_match_t* m, DataBlock* root)
+{
+    if (m->kind == 't') {
+        ytoml_table_push(m->tab, root);
+        return;
+    }
+    if (m->kind == 'a') {
+        ytoml_array_push(m->arr, root);
+        return;
+    }
+    switch (m->valtype) {
+    case 'b':
+        ypush_int(m->u->b ? 1 : 0);
+        return;
+    case 'i':
+        ypush_long(m->u->i);
+        return;
+    case 'd':
+        ypush_double(m->u->d);
+        return;
+    case 's':
+        ypush_q(NULL)[0] = new_string(m->u->s.ptr, m->u->s.len);
+        return;
+    case 't':
+    case 'D':
+    case 'T':
+        ytoml_timestamp_push(m->u->ts, false);
+        return;
+    }
+    ypush_nil();
+}
+
+static void ytoml_path_free(void* addr)
+{
+    ytoml_path* obj = addr;
+    toml_path_free(obj->path);
+}
+
+static void ytoml_path_print(void* addr)
+{
+    ytoml_path* obj = addr;
+    y_print("TOML Path \"", 0);
+    y_print(obj->path == NULL ? "" : toml_path_source(obj->path), 0);
+    y_print("\"", 1);
+}
+
+static void ytoml_path_eval(void* addr, int argc)
+{
+    if (argc != 1) y_error("expecting exactly one argument");
+    ytoml_path* obj = addr;
+    ytoml_query(0, obj->path);
+}
+
+static y_userobj_t ytoml_path_type = {
+    "toml_path",
+    ytoml_path_free,
+    ytoml_path_print,
+    ytoml_path_eval,
+    NULL,
+    NULL
+};
+
+static void ytoml_matches_free(void* addr)
+{
+    ytoml_matches* obj = addr;
+    if (obj->root != NULL) {
+        Unref(obj->root);
+    }
+}
+
+static void ytoml_matches_print(void* addr)
+{
+    ytoml_matches* obj = addr;
+    char buffer[64];
+    sprintf(buffer, "%ld", obj->len);
+    y_print("TOML Matches (len = ", 0);
+    y_print(buffer, 0);
+    y_print(")", 1);
+}
+
+static void ytoml_matches_eval(void* addr, int argc)
 {
     if (argc != 1) y_error("expecting exactly one argument");
+    ytoml_matches* obj = addr;
     int type = yarg_typeid(0);
-    int rank = yarg_rank(0);
-    char* buffer;
-    if (type == Y_STRING && rank == 0) {
-        buffer = ygets_q(0);
-    } else if (type == Y_CHAR && rank == 1) {
-        buffer = ygeta_c(0, NULL, NULL);
+    if (type == Y_VOID) {
+        ypush_long(obj->len);
+        return;
+    }
+    if (!IN_RANGE(type, Y_CHAR, Y_LONG) || yarg_rank(0) != 0) {
+        y_error("expecting a scalar integer index or nothing");
+    }
+    long idx = ygets_l(0);
+    if (idx <= 0) {
+        // Apply Yorick's indexing rule.
+        idx += obj->len;
+    }
+    if (!IN_RANGE(idx, 1, obj->len)) {
+        y_error("index overreach beyond matches bounds");
+    }
+    push_match(&obj->match[idx - 1], obj->root);
+}
+
+static void ytoml_matches_extract(void* addr, char* name)
+{
+    ytoml_matches* obj = addr;
+    if (strcmp("is_root", name) == 0) {
+        ypush_int(0);
+        return;
+    }
+    if (strcmp("len", name) == 0) {
+        ypush_long(obj->len);
+        return;
+    }
+    if (strcmp("root", name) == 0) {
+        ykeep_use(obj->root);
+        return;
+    }
+    y_error("invalid member of TOML matches");
+}
+
+static y_userobj_t ytoml_matches_type = {
+    "toml_matches",
+    ytoml_matches_free,
+    ytoml_matches_print,
+    ytoml_matches_eval,
+    ytoml_matches_extract,
+    NULL
+};
+
+// Evaluate compiled path from the TOML table or array at position iarg and
+// push the result: nothing if there are no matches, the match itself for a
+// single path, a vector if all matches are scalars of the same type, or a
+// TOML matches object otherwise.
+static void ytoml_query(int iarg, const toml_path_t* path)
+{
+    if (yarg_typeid(iarg) != Y_OPAQUE) {
+        bad_arg:
+        y_error("expecting a TOML table or array");
+    }
+    const char* name = yget_obj(iarg, NULL);
+    ytoml_table* tbl = NULL;
+    ytoml_array* arr = NULL;
+    if (name == ytoml_table_type.type_name) {
+        tbl = yget_obj(iarg, &ytoml_table_type);
+    } else if (name == ytoml_array_type.type_name) {
+        arr = yget_obj(iarg, &ytoml_array_type);
     } else {
-        buffer = NULL;
-        y_error("expecting a stting or a vector of bytes");
+        goto bad_arg;
     }
-    toml_table_t* table = toml_parse(buffer, errbuf, sizeof(errbuf));
-    if (table == NULL) {
-        y_error(errbuf);
+    DataBlock* root = (tbl != NULL ? tbl->root : arr->root);
+
+    // Collect the matches, in a scratch buffer if there are many.
+    toml_match_t buf[32];
+    toml_match_t* m = buf;
+    long n = (tbl != NULL ? toml_table_query(tbl->table, path, buf, 32)
+              : toml_array_query(arr->array, path, buf, 32));
+    if (n > 32) {
+        m = ypush_scratch(n*sizeof(toml_match_t), NULL);
+        if (tbl != NULL) {
+            toml_table_query(tbl->table, path, m, n);
+        } else {
+            toml_array_query(arr->array, path, m, n);
+        }
     }
-    ytoml_table_push(table, NULL);
+    if (n == 0) {
+        ypush_nil();
+        return;
+    }
+    if (toml_path_single(path)) {
+        push_match(&m[0], root);
+        return;
+    }
+
+    // Scalars of the same type make a vector.
+    int type = (m[0].kind == 'v' ? m[0].valtype : 0);
+    for (long i = 1; i < n && type != 0; ++i) {
+        if (m[i].kind != 'v' || m[i].valtype != type) {
+            type = 0;
+        }
+    }
+    long dims[2] = {1, n};
+    switch (type) {
+    case 'b': {
+        int* vec = ypush_i(dims);
+        for (long i = 0; i < n; ++i) vec[i] = (m[i].u->b ? 1 : 0);
+        return;
+    }
+    case 'i': {
+        long* vec = ypush_l(dims);
+        for (long i = 0; i < n; ++i) vec[i] = m[i].u->i;
+        return;
+    }
+    case 'd': {
+        double* vec = ypush_d(dims);
+        for (long i = 0; i < n; ++i) vec[i] = m[i].u->d;
+        return;
+    }
+    case 's': {
+        char** vec = ypush_q(dims);
+        for (long i = 0; i < n; ++i) {
+            vec[i] = new_string(m[i].u->s.ptr, m[i].u->s.len);
+        }
+        return;
+    }
+    }
+    ytoml_matches* res = ypush_obj(&ytoml_matches_type,
+                                   offsetof(ytoml_matches, match) +
+                                   n*sizeof(toml_match_t));
+    memcpy(res->match, m, n*sizeof(toml_match_t));
+    res->len = n;
+    res->root = RefNC(root);
 }
 
-void Y_toml_parse_file(int argc)
+/*---------------------------------------------------------------------------*/
+/* BULK CONVERSION */
+
+// Store the dimensions of TOML array, outermost first, in dims[rank...] and
+// yield the common type ('b', 'i', 'd', 's', or 't', 'D' and 'T' for
+// timestamps) of its values, or 0 if the array is empty, mixed, ragged, or too
+// deeply nested to be converted into a regular Yorick array.
+static int values_type(const toml_array_t* arr, long* dims, int* rank)
 {
-    if (argc != 1) y_error("expecting exactly one argument");
-    char* filename = ygets_q(0);
-    FILE* file = fopen(filename, "r");
-    if (file == NULL) {
-        y_error("cannot open file for reading");
+    if (arr->nitem < 1 || *rank >= Y_DIMSIZE - 1) {
+        return 0;
     }
-    toml_table_t* table = toml_parse_file(file, errbuf, sizeof(errbuf));
-    fclose(file);
-    if (table == NULL) {
-        y_error(errbuf);
+    dims[(*rank)++] = arr->nitem;
+    if (arr->kind == 'v') {
+        switch (arr->type) {
+        case 'b':
+        case 'i':
+        case 'd':
+        case 's':
+        case 't':
+        case 'D':
+        case 'T':
+            return arr->type;
+        }
+        return 0;
     }
-    ytoml_table_push(table, NULL);
+    if (arr->kind != 'a') {
+        return 0;
+    }
+    // All sub-arrays must have the same type and dimensions as the first one.
+    int rank0 = *rank;
+    int type = values_type(arr->item[0].arr, dims, rank);
+    for (int i = 1; i < arr->nitem && type != 0; ++i) {
+        long subdims[Y_DIMSIZE];
+        int subrank = 0;
+        if (values_type(arr->item[i].arr, subdims, &subrank) != type ||
+            subrank != *rank - rank0) {
+            return 0;
+        }
+        for (int j = 0; j < subrank; ++j) {
+            if (subdims[j] != dims[rank0 + j]) {
+                return 0;
+            }
+        }
+    }
+    return type;
 }
 
-void Y_toml_type(int argc)
+// Copy the values of a TOML array of given type, in storage order, at dst
+// and yield the address after the last copied value.
+static void* values_copy(const toml_array_t* arr, int type, void* dst)
 {
-    if (argc != 1) y_error("expecting exactly one argument");
-    int res = 0;
-    int type = yarg_typeid(0);
-    if (type == Y_OPAQUE) {
-        const char* name = yget_obj(0, NULL);
-        if (name == ytoml_table_type.type_name) {
-            res = 1;
-        } else if (name == ytoml_array_type.type_name) {
-            res = 2;
-        } else if (name == ytoml_timestamp_type.type_name) {
-            res = 3;
+    const toml_arritem_t* item = arr->item;
+    long n = arr->nitem;
+    if (arr->kind == 'a') {
+        for (long i = 0; i < n; ++i) {
+            dst = values_copy(item[i].arr, type, dst);
         }
+        return dst;
+    }
+    switch (type) {
+    case 'b': {
+        int* vec = dst;
+        for (long i = 0; i < n; ++i) vec[i] = (item[i].u.b ? 1 : 0);
+        return vec + n;
+    }
+    case 'i': {
+        long* vec = dst;
+        for (long i = 0; i < n; ++i) vec[i] = item[i].u.i;
+        return vec + n;
+    }
+    case 'd': {
+        double* vec = dst;
+        for (long i = 0; i < n; ++i) vec[i] = item[i].u.d;
+        return vec + n;
+    }
+    default: {
+        char** vec = dst;
+        for (long i = 0; i < n; ++i) {
+            vec[i] = new_string(item[i].u.s.ptr, item[i].u.s.len);
+        }
+        return vec + n;
+    }
     }
-    ypush_int(res);
 }
 
-void Y_toml_length(int argc)
+// Number of days from 1970-01-01 to a given date of the proleptic Gregorian
+// calendar (see http://howardhinnant.github.io/date_algorithms.html).
+static long days_from_civil(long y, long m, long d)
 {
-    if (argc != 1) y_error("expecting exactly one argument");
-    long len = -1;
-    if (yarg_typeid(0) == Y_OPAQUE) {
-        const char* name = yget_obj(0, NULL);
-        if (name == ytoml_table_type.type_name) {
-            ytoml_table* obj = yget_obj(0, &ytoml_table_type);
-            len = toml_table_len(obj->table);
-        } else if (name == ytoml_array_type.type_name) {
-            ytoml_array* obj = yget_obj(0, &ytoml_array_type);
-            len = toml_array_len(obj->array);
+    y -= (m <= 2);
+    long era = (y >= 0 ? y : y - 399)/400;
+    long yoe = y - era*400;                              // [0, 399]
+    long doy = (153*(m + (m > 2 ? -3 : 9)) + 2)/5 + d - 1; // [0, 365]
+    long doe = yoe*365 + yoe/4 - yoe/100 + doy;          // [0, 146096]
+    return era*146097 + doe - 719468;
+}
+
+// UTC offset of a timestamp in minutes, 0 for local timestamps.
+static long timestamp_offset(const toml_timestamp_t* ts)
+{
+    const char* z = ts->z;
+    if (ts->kind != 'd' || (z[0] != '+' && z[0] != '-')) {
+        return 0;
+    }
+    long off = ((z[1] - '0')*10 + (z[2] - '0'))*60;
+    if (z[3] == ':') {
+        off += (z[4] - '0')*10 + (z[5] - '0');
+    }
+    return (z[0] == '-' ? -off : off);
+}
+
+// Copy the timestamps of a TOML array, in storage order, at dst and yield the
+// address after the last copied value. If fields is false, dst is an array of
+// double's set with the number of seconds since the epoch; otherwise, dst is
+// an array of long's set with TIMESTAMP_NFIELDS broken-down fields per
+// timestamp.
+#define TIMESTAMP_NFIELDS 8
+static void* timestamps_copy(const toml_array_t* arr, bool fields, void* dst)
+{
+    const toml_arritem_t* item = arr->item;
+    long n = arr->nitem;
+    if (arr->kind == 'a') {
+        for (long i = 0; i < n; ++i) {
+            dst = timestamps_copy(item[i].arr, fields, dst);
         }
+        return dst;
     }
-    ypush_long(len);
+    if (fields) {
+        long* vec = dst;
+        for (long i = 0; i < n; ++i, vec += TIMESTAMP_NFIELDS) {
+            // Fields which are not part of the timestamp are set to -1 by the
+            // parser.
+            const toml_timestamp_t* ts = item[i].u.ts;
+            bool date = (ts->kind != 't'), time = (ts->kind != 'D');
+            vec[0] = date ? ts->year : 0;
+            vec[1] = date ? ts->month : 0;
+            vec[2] = date ? ts->day : 0;
+            vec[3] = time ? ts->hour : 0;
+            vec[4] = time ? ts->minute : 0;
+            vec[5] = time ? ts->second : 0;
+            vec[6] = time ? ts->millisec : 0;
+            vec[7] = timestamp_offset(ts);
+        }
+        return vec;
+    }
+    double* vec = dst;
+    for (long i = 0; i < n; ++i) {
+        const toml_timestamp_t* ts = item[i].u.ts;
+        long sec = 0;
+        double frac = 0.0;
+        if (ts->kind != 'D') {
+            sec = (ts->hour*60L + ts->minute - timestamp_offset(ts))*60L
+                + ts->second;
+            frac = ts->millisec/1000.0;
+        }
+        if (ts->kind != 't') {
+            sec += days_from_civil(ts->year, ts->month, ts->day)*86400L;
+        }
+        vec[i] = sec + frac;
+    }
+    return vec + n;
+}
+
+// Collected values of a TOML array, before being pushed as a regular Yorick
+// array.
+typedef struct collect_ {
+    int type;                  // 'b', 'i', 'd' or 's'
+    int rank;                  // number of dimensions
+    long dims[Y_DIMSIZE];      // dimensions, fastest varying first
+    long n;                    // number of values
+    const toml_scalar_t** val; // values, in storage order
+    const toml_scalar_t* one;  // storage for a scalar
+} collect_t;
+
+static void collect_free(collect_t* c)
+{
+    if (c->val != NULL && c->val != &c->one) {
+        free(c->val);
+    }
+    c->val = NULL;
+}
+
+static int collect_array(const toml_array_t* arr, bool broadcast,
+                         collect_t* c);
+
+// Collect a TOML array item following the same rules as `toml_collect` in
+// `toml.i`. Yield 1 on success, 0 if the item cannot be part of a regular
+// array, and -1 if memory is exhausted.
+static int collect_item(const toml_arritem_t* item, bool broadcast,
+                        collect_t* c)
+{
+    if (item->arr != NULL) {
+        return collect_array(item->arr, broadcast, c);
+    }
+    if (item->tab != NULL) {
+        return 0;
+    }
+    switch (item->valtype) {
+    case 'b':
+    case 'i':
+    case 'd':
+    case 's':
+        c->type = item->valtype;
+        c->rank = 0;
+        c->n = 1;
+        c->one = &item->u;
+        c->val = &c->one;
+        return 1;
+    }
+    return 0;
+}
+
+// Copy the values of src in dst whose dimensions are the common dimensions
+// of all items, applying broadcasting rules if needed.
+static void collect_copy(const collect_t* src, const collect_t* dst,
+                         const toml_scalar_t** val)
+{
+    if (src->n == dst->n) {
+        // Same dimensions.
+        memcpy(val, src->val, src->n*sizeof(*val));
+        return;
+    }
+    long stride[Y_DIMSIZE];
+    long s = 1;
+    for (int j = 0; j < dst->rank; ++j) {
+        bool same = (j < src->rank && src->dims[j] != 1);
+        stride[j] = (same ? s : 0);
+        if (j < src->rank) {
+            s *= src->dims[j];
+        }
+    }
+    for (long k = 0; k < dst->n; ++k) {
+        long r = k, off = 0;
+        for (int j = 0; j < dst->rank; ++j) {
+            off += (r % dst->dims[j])*stride[j];
+            r /= dst->dims[j];
+        }
+        val[k] = src->val[off];
+    }
+}
+
+// Collect a TOML array, see collect_item().
+static int collect_array(const toml_array_t* arr, bool broadcast,
+                         collect_t* c)
+{
+    long n = arr->nitem;
+    c->val = NULL;
+    if (n < 1) {
+        return 0;
+    }
+    if (arr->kind == 'v') {
+        // Vector of values.
+        switch (arr->type) {
+        case 'b':
+        case 'i':
+        case 'd':
+        case 's':
+            break;
+        default:
+            return 0;
+        }
+        c->val = malloc(n*sizeof(*c->val));
+        if (c->val == NULL) {
+            return -1;
+        }
+        for (long i = 0; i < n; ++i) {
+            c->val[i] = &arr->item[i].u;
+        }
+        c->type = arr->type;
+        c->rank = 1;
+        c->dims[0] = n;
+        c->n = n;
+        return 1;
+    }
+
+    // Collect all items and determine their common dimensions.
+    collect_t* sub = malloc(n*sizeof(collect_t));
+    if (sub == NULL) {
+        return -1;
+    }
+    long nsub = 0;
+    collect_t com; // common type and dimensions
+    int status = 1;
+    for (long i = 0; i < n && status == 1; ++i) {
+        collect_t* it = &sub[nsub];
+        status = collect_item(&arr->item[i], broadcast, it);
+        if (status != 1) {
+            break;
+        }
+        ++nsub;
+        if (i == 0) {
+            com.type = it->type;
+            com.rank = it->rank;
+            memcpy(com.dims, it->dims, it->rank*sizeof(long));
+            continue;
+        }
+        if (it->type != com.type) {
+            status = 0;
+        } else if (broadcast) {
+            int min_rank = (it->rank < com.rank ? it->rank : com.rank);
+            for (int j = 0; j < min_rank; ++j) {
+                long dim = it->dims[j];
+                if (dim == 1 || dim == com.dims[j]) continue;
+                if (com.dims[j] != 1) {
+                    status = 0;
+                    break;
+                }
+                com.dims[j] = dim;
+            }
+            for (int j = com.rank; j < it->rank; ++j) {
+                com.dims[j] = it->dims[j];
+            }
+            if (it->rank > com.rank) {
+                com.rank = it->rank;
+            }
+        } else if (it->rank != com.rank ||
+                   memcmp(it->dims, com.dims, it->rank*sizeof(long)) != 0) {
+            status = 0;
+        }
+    }
+    if (status == 1 && com.rank >= Y_DIMSIZE - 1) {
+        status = 0;
+    }
+    if (status == 1) {
+        // Pack the items along a last dimension.
+        com.n = 1;
+        for (int j = 0; j < com.rank; ++j) {
+            com.n *= com.dims[j];
+        }
+        c->type = com.type;
+        c->rank = com.rank + 1;
+        memcpy(c->dims, com.dims, com.rank*sizeof(long));
+        c->dims[com.rank] = n;
+        c->n = com.n*n;
+        c->val = malloc(c->n*sizeof(*c->val));
+        if (c->val == NULL) {
+            status = -1;
+        } else {
+            for (long i = 0; i < n; ++i) {
+                collect_copy(&sub[i], &com, c->val + i*com.n);
+            }
+        }
+    }
+    for (long i = 0; i < nsub; ++i) {
+        collect_free(&sub[i]);
+    }
+    free(sub);
+    return status;
+}
+
+/*---------------------------------------------------------------------------*/
+/* WRITING */
+
+typedef struct ytoml_writer_ {
+    toml_writer_t* writer;
+    FILE*              fp; // output file, NULL if text is kept in memory
+} ytoml_writer;
+
+static void ytoml_writer_free(void* addr)
+{
+    ytoml_writer* obj = addr;
+    if (obj->writer != NULL) {
+        toml_writer_close(obj->writer);
+    }
+    if (obj->fp != NULL) {
+        fclose(obj->fp);
+    }
+}
+
+static void ytoml_writer_print(void* addr)
+{
+    ytoml_writer* obj = addr;
+    y_print(obj->fp != NULL ? "TOML Writer (to file)" :
+            "TOML Writer (to memory)", 1);
+}
+
+static y_userobj_t ytoml_writer_type = {
+    "toml_writer",
+    ytoml_writer_free,
+    ytoml_writer_print,
+    NULL,
+    NULL,
+    NULL
+};
+
+static ytoml_writer* get_writer(int iarg)
+{
+    ytoml_writer* obj = yget_obj(iarg, &ytoml_writer_type);
+    if (obj->writer == NULL) {
+        y_error("TOML writer has been closed");
+    }
+    return obj;
+}
+
+// Write the n values of type at data, a Yorick array with dimensions dims,
+// as nested TOML arrays. The first dimension is the innermost one.
+static void write_array(toml_writer_t* w, int type, const void* data,
+                        long ntot, const long* dims)
+{
+    int rank = dims[0];
+    long cnt[Y_DIMSIZE];
+    for (int j = 0; j < rank; ++j) {
+        cnt[j] = 0;
+        toml_write_raw(w, "[", 1);
+    }
+    for (long k = 0; k < ntot; ++k) {
+        switch (type) {
+        case Y_CHAR:
+            toml_write_int(w, ((const unsigned char*)data)[k]);
+            break;
+        case Y_SHORT:
+            toml_write_int(w, ((const short*)data)[k]);
+            break;
+        case Y_INT:
+            toml_write_int(w, ((const int*)data)[k]);
+            break;
+        case Y_LONG:
+            toml_write_int(w, ((const long*)data)[k]);
+            break;
+        case Y_FLOAT:
+            toml_write_double(w, ((const float*)data)[k]);
+            break;
+        case Y_DOUBLE:
+            toml_write_double(w, ((const double*)data)[k]);
+            break;
+        default: {
+            const char* str = ((char* const*)data)[k];
+            if (str == NULL) str = "";
+            toml_write_string(w, str, strlen(str));
+        }
+        }
+        // Close the arrays whose last item has been written.
+        int j = 0;
+        while (j < rank && ++cnt[j] == dims[j + 1]) {
+            cnt[j++] = 0;
+            toml_write_raw(w, "]", 1);
+        }
+        if (j < rank) {
+            toml_write_raw(w, ", ", 2);
+            for (int i = 0; i < j; ++i) {
+                toml_write_raw(w, "[", 1);
+            }
+        }
+    }
+}
+
+// Write the Yorick value at position iarg as a TOML value.
+static void write_value(toml_writer_t* w, int iarg)
+{
+    int type = yarg_typeid(iarg);
+    if (type == Y_OPAQUE) {
+        toml_timestamp_t* ts = yget_obj(iarg, &ytoml_timestamp_type);
+        toml_write_timestamp(w, ts);
+        return;
+    }
+    if (type > Y_STRING || type == Y_COMPLEX) {
+        y_error("value cannot be written in TOML");
+    }
+    long ntot, dims[Y_DIMSIZE];
+    void* data = ygeta_any(iarg, &ntot, dims, &type);
+    write_array(w, type, data, ntot, dims);
+}
+
+// Stack the keys of a string vector for toml_write_header().
+static int get_keys(int iarg, const char** keys, int* keylens, int maxkeys)
+{
+    long n;
+    char** q = ygeta_q(iarg, &n, NULL);
+    if (n > maxkeys) {
+        y_error("too many keys");
+    }
+    for (long i = 0; i < n; ++i) {
+        keys[i] = (q[i] == NULL ? "" : q[i]);
+        keylens[i] = strlen(keys[i]);
+    }
+    return n;
+}
+
+/*---------------------------------------------------------------------------*/
+/* CACHE */
+
+// Root tables of the files parsed with the cache, most recently used first.
+// An entry keeps a reference on the Yorick object of its root table.
+typedef struct cache_entry_ cache_entry;
+struct cache_entry_ {
+    cache_entry*  prev;
+    cache_entry*  next;
+    dev_t          dev;
+    ino_t          ino;
+    off_t         size;
+    long long    mtime; // modification time in nanoseconds
+    bool          lazy;
+    void*         root; // use handle of the root table object
+    size_t   footprint;
+};
+
+#define CACHE_BUDGET (64L*1024L*1024L)
+
+static cache_entry* cache_first = NULL;
+static cache_entry* cache_last = NULL;
+static size_t cache_used = 0;
+static size_t cache_budget = CACHE_BUDGET;
+
+static void cache_unlink(cache_entry* e)
+{
+    if (e->prev != NULL) e->prev->next = e->next; else cache_first = e->next;
+    if (e->next != NULL) e->next->prev = e->prev; else cache_last = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void cache_link_first(cache_entry* e)
+{
+    e->prev = NULL;
+    e->next = cache_first;
+    if (cache_first != NULL) cache_first->prev = e; else cache_last = e;
+    cache_first = e;
+}
+
+static void cache_drop(cache_entry* e)
+{
+    cache_unlink(e);
+    cache_used -= e->footprint;
+    void* root = e->root;
+    free(e);
+    ydrop_use(root);
+}
+
+// Evict the least recently used entries until the budget is met.
+static void cache_trim(void)
+{
+    while (cache_last != NULL && cache_used > cache_budget) {
+        cache_drop(cache_last);
+    }
+}
+
+static long long stat_mtime(const struct stat* st)
+{
+#if defined(_WIN32)
+    return (long long)st->st_mtime*1000000000LL;
+#elif defined(__APPLE__)
+    return (long long)st->st_mtimespec.tv_sec*1000000000LL +
+        st->st_mtimespec.tv_nsec;
+#else
+    return (long long)st->st_mtim.tv_sec*1000000000LL + st->st_mtim.tv_nsec;
+#endif
+}
+
+// Push the cached root table of the file with status st and yield true, or
+// yield false if there is none. Entries of older versions of the file are
+// dropped.
+static bool cache_push(const struct stat* st, bool lazy)
+{
+    for (cache_entry* e = cache_first; e != NULL; e = e->next) {
+        if (e->dev != st->st_dev || e->ino != st->st_ino || e->lazy != lazy) {
+            continue;
+        }
+        if (e->size != st->st_size || e->mtime != stat_mtime(st)) {
+            cache_drop(e);
+            return false;
+        }
+        ykeep_use(e->root);
+        cache_unlink(e);
+        cache_link_first(e);
+        // Sections parsed lazily since then count too.
+        ytoml_table* tbl = yget_obj(0, &ytoml_table_type);
+        size_t footprint = toml_footprint(tbl->table);
+        cache_used += footprint - e->footprint;
+        e->footprint = footprint;
+        cache_trim();
+        return true;
+    }
+    return false;
+}
+
+// Remember the root table on top of the stack as the contents of the file
+// with status st.
+static void cache_insert(const struct stat* st, bool lazy)
+{
+    ytoml_table* tbl = yget_obj(0, &ytoml_table_type);
+    size_t footprint = toml_footprint(tbl->table);
+    if (footprint > cache_budget) {
+        return;
+    }
+    cache_entry* e = malloc(sizeof(cache_entry));
+    if (e == NULL) {
+        return;
+    }
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    e->size = st->st_size;
+    e->mtime = stat_mtime(st);
+    e->lazy = lazy;
+    e->footprint = footprint;
+    e->root = yget_use(0);
+    cache_link_first(e);
+    cache_used += footprint;
+    cache_trim();
+}
+
+/*---------------------------------------------------------------------------*/
+/* BATCH PARSING */
+
+// Root tables of files parsed together, in the order of their names. They can
+// be indexed like a TOML array.
+typedef struct ytoml_tables_ {
+    long            len;
+    DataBlock*  root[1]; // Yorick objects of the root tables
+} ytoml_tables;
+
+static void ytoml_tables_free(void* addr)
+{
+    ytoml_tables* obj = addr;
+    for (long i = 0; i < obj->len; ++i) {
+        if (obj->root[i] != NULL) {
+            Unref(obj->root[i]);
+        }
+    }
+}
+
+static void ytoml_tables_print(void* addr)
+{
+    ytoml_tables* obj = addr;
+    char buffer[64];
+    sprintf(buffer, "%ld", obj->len);
+    y_print("TOML Tables (len = ", 0);
+    y_print(buffer, 0);
+    y_print(")", 1);
+}
+
+static void ytoml_tables_eval(void* addr, int argc)
+{
+    if (argc != 1) y_error("expecting exactly one argument");
+    ytoml_tables* obj = addr;
+    int type = yarg_typeid(0);
+    if (type == Y_VOID) {
+        ypush_long(obj->len);
+        return;
+    }
+    if (!IN_RANGE(type, Y_CHAR, Y_LONG) || yarg_rank(0) != 0) {
+        y_error("expecting a scalar integer index or nothing");
+    }
+    long idx = ygets_l(0);
+    if (idx <= 0) {
+        // Apply Yorick's indexing rule.
+        idx += obj->len;
+    }
+    if (!IN_RANGE(idx, 1, obj->len)) {
+        y_error("index overreach beyond tables bounds");
+    }
+    ykeep_use(obj->root[idx - 1]);
+}
+
+static void ytoml_tables_extract(void* addr, char* name)
+{
+    ytoml_tables* obj = addr;
+    if (strcmp("len", name) == 0) {
+        ypush_long(obj->len);
+        return;
+    }
+    y_error("invalid member of TOML tables");
+}
+
+static y_userobj_t ytoml_tables_type = {
+    "toml_tables",
+    ytoml_tables_free,
+    ytoml_tables_print,
+    ytoml_tables_eval,
+    ytoml_tables_extract,
+    NULL
+};
+
+// Files parsed by a pool of threads. Each file is parsed by the first idle
+// worker, and its result is stored at its index so that the order of the
+// names is kept whatever the order of completion. Workers do not call
+// Yorick, which is not thread-safe, and have their own error buffer.
+typedef struct batch_ {
+    long             len;
+    char**         names;
+    toml_table_t** table;
+    char**         error; // error messages, allocated by malloc()
+    long            next; // next file to parse
+#ifndef _WIN32
+    pthread_mutex_t mutex;
+#endif
+} batch;
+
+static void* batch_worker(void* arg)
+{
+    batch* b = arg;
+    char buf[256];
+    for (;;) {
+#ifndef _WIN32
+        pthread_mutex_lock(&b->mutex);
+#endif
+        long i = (b->next < b->len ? b->next++ : -1);
+#ifndef _WIN32
+        pthread_mutex_unlock(&b->mutex);
+#endif
+        if (i < 0) {
+            break;
+        }
+        const char* name = (b->names[i] == NULL ? "" : b->names[i]);
+        b->table[i] = toml_parse_mmap(name, buf, sizeof(buf));
+        if (b->table[i] == NULL) {
+            size_t len = strlen(buf);
+            if ((b->error[i] = malloc(len + 1)) != NULL) {
+                memcpy(b->error[i], buf, len + 1);
+            }
+        }
+    }
+    return NULL;
+}
+
+// Release the tables and the error messages not claimed yet.
+static void batch_free(void* addr)
+{
+    batch* b = addr;
+    for (long i = 0; i < b->len; ++i) {
+        if (b->table[i] != NULL) {
+            toml_free(b->table[i]);
+        }
+        free(b->error[i]);
+    }
+}
+
+static long online_processors(void)
+{
+#if !defined(_WIN32) && defined(_SC_NPROCESSORS_ONLN)
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return (n > 0 ? n : 1);
+#else
+    return 1;
+#endif
+}
+
+#define BATCH_MAXTHREADS 64
+
+// Parse the files of batch b with nthreads threads.
+static void batch_run(batch* b, long nthreads)
+{
+    if (nthreads > b->len) {
+        nthreads = b->len;
+    }
+#ifndef _WIN32
+    pthread_t thread[BATCH_MAXTHREADS];
+    long nstarted = 0;
+    if (nthreads > BATCH_MAXTHREADS) {
+        nthreads = BATCH_MAXTHREADS;
+    }
+    pthread_mutex_init(&b->mutex, NULL);
+    while (nstarted < nthreads - 1 &&
+           pthread_create(&thread[nstarted], NULL, batch_worker, b) == 0) {
+        ++nstarted;
+    }
+    batch_worker(b); // the calling thread works too
+    for (long i = 0; i < nstarted; ++i) {
+        pthread_join(thread[i], NULL);
+    }
+    pthread_mutex_destroy(&b->mutex);
+#else
+    batch_worker(b);
+#endif
+}
+
+/*---------------------------------------------------------------------------*/
+/* BUILTIN FUNCTIONS */
+
+static char* parse_knames[] = {"threads", 0};
+static long parse_kglobs[2];
+
+// Get the number of threads given by keyword `threads`: 1 if not set, 0 to
+// use one thread per processor.
+static int get_threads(int iarg)
+{
+    if (iarg < 0 || yarg_nil(iarg)) {
+        return 1;
+    }
+    long n = ygets_l(iarg);
+    return (n < 0 ? 1 : n > 1024 ? 1024 : n);
+}
+
+void Y_toml_parse(int argc)
+{
+    int kiargs[1];
+    int iarg, pos = -1;
+    yarg_kw_init(parse_knames, parse_kglobs, kiargs);
+    for (iarg = argc - 1; iarg >= 0; ) {
+        iarg = yarg_kw(iarg, parse_kglobs, kiargs);
+        if (iarg >= 0) {
+            if (pos >= 0) y_error("expecting exactly one argument");
+            pos = iarg--;
+        }
+    }
+    if (pos < 0) y_error("expecting exactly one argument");
+    int nthreads = get_threads(kiargs[0]);
+    int type = yarg_typeid(pos);
+    int rank = yarg_rank(pos);
+    char* buffer;
+    long size;
+    if (type == Y_STRING && rank == 0) {
+        buffer = ygets_q(pos);
+        size = (buffer == NULL ? 0 : strlen(buffer));
+    } else if (type == Y_CHAR && rank == 1) {
+        /* Parse the bytes in place, ignoring trailing nulls as produced by
+           `strchar`. */
+        buffer = ygeta_c(pos, &size, NULL);
+        while (size > 0 && buffer[size-1] == '\0') {
+            --size;
+        }
+    } else {
+        buffer = NULL;
+        size = 0;
+        y_error("expecting a stting or a vector of bytes");
+    }
+    toml_table_t* table;
+    if (nthreads == 1) {
+        table = toml_parse_n(buffer == NULL ? "" : buffer, size,
+                             errbuf, sizeof(errbuf));
+    } else {
+        table = toml_parse_parallel(buffer == NULL ? "" : buffer, size,
+                                    nthreads, errbuf, sizeof(errbuf));
+    }
+    if (table == NULL) {
+        y_error(errbuf);
+    }
+    ytoml_table_push(table, NULL);
+}
+
+static char* parse_file_knames[] = {"cache", "lazy", "mmap", "threads", 0};
+static long parse_file_kglobs[5];
+
+void Y_toml_parse_file(int argc)
+{
+    int kiargs[4];
+    int iarg, pos = -1;
+    yarg_kw_init(parse_file_knames, parse_file_kglobs, kiargs);
+    for (iarg = argc - 1; iarg >= 0; ) {
+        iarg = yarg_kw(iarg, parse_file_kglobs, kiargs);
+        if (iarg >= 0) {
+            if (pos >= 0) y_error("expecting exactly one argument");
+            pos = iarg--;
+        }
+    }
+    if (pos < 0) y_error("expecting exactly one argument");
+    char* filename = ygets_q(pos);
+    bool cache = (kiargs[0] >= 0 && yarg_true(kiargs[0]));
+    bool lazy = (kiargs[1] >= 0 && yarg_true(kiargs[1]));
+    int nthreads = get_threads(kiargs[3]);
+    struct stat st;
+    if (cache && stat(filename, &st) == 0) {
+        if (cache_push(&st, lazy)) {
+            return;
+        }
+    } else {
+        cache = false;
+    }
+    toml_table_t* table;
+    if (lazy) {
+        table = toml_parse_lazy(filename, errbuf, sizeof(errbuf));
+    } else if (nthreads != 1) {
+        table = toml_parse_mmap_parallel(filename, nthreads,
+                                         errbuf, sizeof(errbuf));
+    } else if (kiargs[2] >= 0 && yarg_true(kiargs[2])) {
+        table = toml_parse_mmap(filename, errbuf, sizeof(errbuf));
+    } else {
+        FILE* file = fopen(filename, "r");
+        if (file == NULL) {
+            y_error("cannot open file for reading");
+        }
+        /* Parse while reading, this also works for pipes. */
+        table = toml_parse_fd(fileno(file), errbuf, sizeof(errbuf));
+        fclose(file);
+    }
+    if (table == NULL) {
+        y_error(errbuf);
+    }
+    ytoml_table_push(table, NULL);
+    if (cache) {
+        cache_insert(&st, lazy);
+    }
+}
+
+static char* parse_files_knames[] = {"threads", 0};
+static long parse_files_kglobs[2];
+
+void Y_toml_parse_files(int argc)
+{
+    int kiargs[1];
+    int iarg, pos = -1;
+    yarg_kw_init(parse_files_knames, parse_files_kglobs, kiargs);
+    for (iarg = argc - 1; iarg >= 0; ) {
+        iarg = yarg_kw(iarg, parse_files_kglobs, kiargs);
+        if (iarg >= 0) {
+            if (pos >= 0) y_error("expecting exactly one argument");
+            pos = iarg--;
+        }
+    }
+    if (pos < 0) y_error("expecting exactly one argument");
+    long nthreads = get_threads(kiargs[0]);
+    if (kiargs[0] < 0 || yarg_nil(kiargs[0]) || nthreads == 0) {
+        nthreads = online_processors();
+    }
+    long n;
+    char** names = ygeta_q(pos, &n, NULL);
+
+    // The scratch object owns the results until they are given to Yorick
+    // objects, so that nothing leaks on errors.
+    size_t size = sizeof(batch) + n*(sizeof(toml_table_t*) + sizeof(char*));
+    batch* b = ypush_scratch(size, batch_free);
+    b->table = (toml_table_t**)(b + 1);
+    b->error = (char**)(b->table + n);
+    memset(b->table, 0, n*(sizeof(toml_table_t*) + sizeof(char*)));
+    b->names = names;
+    b->next = 0;
+    b->len = n;
+    batch_run(b, nthreads);
+
+    // Report the first error in the order of the names.
+    for (long i = 0; i < n; ++i) {
+        if (b->table[i] == NULL) {
+            snprintf(errbuf, sizeof(errbuf), "%s: %s",
+                     names[i] == NULL ? "" : names[i],
+                     b->error[i] == NULL ? "out of memory" : b->error[i]);
+            y_error(errbuf);
+        }
+    }
+    ytoml_tables* res = ypush_obj(&ytoml_tables_type,
+                                  offsetof(ytoml_tables, root) +
+                                  n*sizeof(DataBlock*));
+    for (long i = 0; i < n; ++i) {
+        ytoml_table_push(b->table[i], NULL);
+        b->table[i] = NULL;
+        res->root[i] = RefNC(sp->value.db);
+        res->len = i + 1;
+        yarg_drop(1);
+    }
+}
+
+void Y__toml_stats(int argc)
+{
+    if (argc != 2) y_error("expecting exactly two arguments");
+    if (!yarg_nil(0)) {
+        stats_enabled = yarg_true(0);
+        toml_enable_stats(stats_enabled);
+    }
+    if (yarg_nil(1)) {
+        long dims[2] = {1, 3};
+        double* res = ypush_d(dims);
+        res[0] = stats_objects;
+        res[1] = stats_time;
+        res[2] = stats_enabled;
+        return;
+    }
+    ytoml_table* tbl = yget_obj(1, &ytoml_table_type);
+    if (!tbl->is_root) y_error("expecting a root TOML table");
+    toml_stats_t st;
+    bool collected = toml_stats(tbl->table, &st);
+    long dims[2] = {1, 12};
+    double* res = ypush_d(dims);
+    res[0] = st.bytes;
+    res[1] = st.tokens;
+    res[2] = st.tables;
+    res[3] = st.arrays;
+    res[4] = st.keyvals;
+    res[5] = st.values;
+    res[6] = st.allocs;
+    res[7] = st.allocated;
+    res[8] = st.read_time;
+    res[9] = st.parse_time;
+    res[10] = st.finish_time;
+    res[11] = collected;
+}
+
+void Y_toml_cache(int argc)
+{
+    if (argc != 1) y_error("expecting exactly one argument");
+    long n = 0;
+    for (cache_entry* e = cache_first; e != NULL; e = e->next) {
+        ++n;
+    }
+    long dims[2] = {1, 3};
+    long* res = ypush_l(dims);
+    res[0] = cache_budget;
+    res[1] = cache_used;
+    res[2] = n;
+    if (!yarg_nil(1)) {
+        long budget = ygets_l(1);
+        cache_budget = (budget > 0 ? budget : 0);
+        cache_trim();
+    }
+}
+
+void Y_toml_path(int argc)
+{
+    if (argc != 1) y_error("expecting exactly one argument");
+    char* src = ygets_q(0);
+    ytoml_path* obj = ypush_obj(&ytoml_path_type, sizeof(ytoml_path));
+    obj->path = toml_path_compile(src == NULL ? "" : src,
+                                  errbuf, sizeof(errbuf));
+    if (obj->path == NULL) {
+        y_error(errbuf);
+    }
+}
+
+void Y_toml_query(int argc)
+{
+    if (argc != 2) y_error("expecting exactly two arguments");
+    if (yarg_typeid(0) == Y_STRING) {
+        // Replace the string by a temporary compiled path.
+        Y_toml_path(1);
+        yarg_swap(0, 1);
+        yarg_drop(1);
+    }
+    ytoml_path* obj = yget_obj(0, &ytoml_path_type);
+    ytoml_query(1, obj->path);
+}
+
+void Y_toml_type(int argc)
+{
+    if (argc != 1) y_error("expecting exactly one argument");
+    int res = 0;
+    int type = yarg_typeid(0);
+    if (type == Y_OPAQUE) {
+        const char* name = yget_obj(0, NULL);
+        if (name == ytoml_table_type.type_name) {
+            res = 1;
+        } else if (name == ytoml_array_type.type_name ||
+                   name == ytoml_matches_type.type_name) {
+            res = 2;
+        } else if (name == ytoml_timestamp_type.type_name) {
+            res = 3;
+        }
+    }
+    ypush_int(res);
+}
+
+void Y_toml_length(int argc)
+{
+    if (argc != 1) y_error("expecting exactly one argument");
+    long len = -1;
+    if (yarg_typeid(0) == Y_OPAQUE) {
+        const char* name = yget_obj(0, NULL);
+        if (name == ytoml_table_type.type_name) {
+            ytoml_table* obj = yget_obj(0, &ytoml_table_type);
+            len = toml_table_len(obj->table);
+        } else if (name == ytoml_array_type.type_name) {
+            ytoml_array* obj = yget_obj(0, &ytoml_array_type);
+            len = toml_array_len(obj->array);
+        } else if (name == ytoml_matches_type.type_name) {
+            ytoml_matches* obj = yget_obj(0, &ytoml_matches_type);
+            len = obj->len;
+        }
+    }
+    ypush_long(len);
+}
+
+void Y_toml_values(int argc)
+{
+    if (argc != 1) y_error("expecting exactly one argument");
+    ytoml_array* obj = yget_obj(0, &ytoml_array_type);
+    long tmp[Y_DIMSIZE], dims[Y_DIMSIZE];
+    int rank = 0;
+    int type = values_type(obj->array, tmp, &rank);
+    if (type == 0 || type == 't' || type == 'D' || type == 'T') {
+        ypush_nil();
+        return;
+    }
+    // TOML arrays are stored in row-major order, Yorick's dimensions list the
+    // fastest varying one first.
+    dims[0] = rank;
+    for (int j = 0; j < rank; ++j) {
+        dims[j + 1] = tmp[rank - 1 - j];
+    }
+    void* dst;
+    switch (type) {
+    case 'b': dst = ypush_i(dims); break;
+    case 'i': dst = ypush_l(dims); break;
+    case 'd': dst = ypush_d(dims); break;
+    default:  dst = ypush_q(dims); break;
+    }
+    values_copy(obj->array, type, dst);
+}
+
+// Push the timestamps of a TOML array as seconds since the epoch or as
+// broken-down fields.
+static void push_timestamps(int iarg, bool fields)
+{
+    ytoml_array* obj = yget_obj(iarg, &ytoml_array_type);
+    long tmp[Y_DIMSIZE], dims[Y_DIMSIZE];
+    int rank = 0;
+    int type = values_type(obj->array, tmp, &rank);
+    if ((type != 't' && type != 'D' && type != 'T') ||
+        (fields && rank >= Y_DIMSIZE - 1)) {
+        ypush_nil();
+        return;
+    }
+    int off = 0;
+    if (fields) {
+        dims[++off] = TIMESTAMP_NFIELDS;
+    }
+    dims[0] = rank + off;
+    for (int j = 0; j < rank; ++j) {
+        dims[off + j + 1] = tmp[rank - 1 - j];
+    }
+    if (fields) {
+        timestamps_copy(obj->array, true, ypush_l(dims));
+    } else {
+        timestamps_copy(obj->array, false, ypush_d(dims));
+    }
+}
+
+void Y_toml_epoch(int argc)
+{
+    if (argc != 1) y_error("expecting exactly one argument");
+    push_timestamps(0, false);
+}
+
+void Y_toml_datetime(int argc)
+{
+    if (argc != 1) y_error("expecting exactly one argument");
+    push_timestamps(0, true);
+}
+
+void Y__toml_collect(int argc)
+{
+    if (argc != 2) y_error("expecting exactly two arguments");
+    ytoml_array* obj = yget_obj(1, &ytoml_array_type);
+    bool broadcast = yarg_true(0);
+    collect_t c;
+    int status = collect_array(obj->array, broadcast, &c);
+    if (status < 0) {
+        y_error("insufficient memory to collect TOML array");
+    }
+    if (status == 0) {
+        ypush_nil();
+        return;
+    }
+    long dims[Y_DIMSIZE];
+    dims[0] = c.rank;
+    memcpy(dims + 1, c.dims, c.rank*sizeof(long));
+    switch (c.type) {
+    case 'b': {
+        int* arr = ypush_i(dims);
+        for (long i = 0; i < c.n; ++i) arr[i] = (c.val[i]->b ? 1 : 0);
+        break;
+    }
+    case 'i': {
+        long* arr = ypush_l(dims);
+        for (long i = 0; i < c.n; ++i) arr[i] = c.val[i]->i;
+        break;
+    }
+    case 'd': {
+        double* arr = ypush_d(dims);
+        for (long i = 0; i < c.n; ++i) arr[i] = c.val[i]->d;
+        break;
+    }
+    default: {
+        char** arr = ypush_q(dims);
+        for (long i = 0; i < c.n; ++i) {
+            arr[i] = new_string(c.val[i]->s.ptr, c.val[i]->s.len);
+        }
+        break;
+    }
+    }
+    collect_free(&c);
+}
+
+void Y__toml_writer(int argc)
+{
+    if (argc != 1) y_error("expecting exactly one argument");
+    char* filename = (yarg_nil(0) ? NULL : ygets_q(0));
+    ytoml_writer* obj = ypush_obj(&ytoml_writer_type, sizeof(ytoml_writer));
+    if (filename != NULL) {
+        obj->fp = fopen(filename, "w");
+        if (obj->fp == NULL) {
+            y_error("cannot open file for writing");
+        }
+    }
+    obj->writer = toml_writer_new(obj->fp);
+    if (obj->writer == NULL) {
+        y_error("insufficient memory for TOML writer");
+    }
+}
+
+void Y__toml_write(int argc)
+{
+    if (argc != 3) y_error("expecting exactly 3 arguments");
+    ytoml_writer* obj = get_writer(2);
+    if (yarg_nil(1)) {
+        // Whole TOML table.
+        ytoml_table* tbl = yget_obj(0, &ytoml_table_type);
+        if (toml_write_table(obj->writer, tbl->table, errbuf,
+                             sizeof(errbuf)) != 0) {
+            y_error(errbuf);
+        }
+    } else {
+        const char* key = ygets_q(1);
+        if (key == NULL) key = "";
+        toml_write_key(obj->writer, key, strlen(key));
+        toml_write_raw(obj->writer, " = ", 3);
+        write_value(obj->writer, 0);
+        toml_write_raw(obj->writer, "\n", 1);
+    }
+    ypush_nil();
+}
+
+void Y__toml_append(int argc)
+{
+    if (argc < 2 || argc > 3) y_error("expecting 2 or 3 arguments");
+    ytoml_writer* obj = get_writer(argc - 1);
+    int iarg = argc - 2;
+    long mode = (argc == 3 && !yarg_nil(0) ? ygets_l(0) : 0);
+    if (mode == 0) {
+        write_value(obj->writer, iarg);
+    } else if (mode == 1 || mode == 2) {
+        const char* str = ygets_q(iarg);
+        if (str == NULL) str = "";
+        if (mode == 1) {
+            toml_write_raw(obj->writer, str, strlen(str));
+        } else {
+            toml_write_key(obj->writer, str, strlen(str));
+            toml_write_raw(obj->writer, " = ", 3);
+        }
+    } else {
+        y_error("invalid mode");
+    }
+    ypush_nil();
+}
+
+void Y__toml_header(int argc)
+{
+    if (argc != 3) y_error("expecting exactly 3 arguments");
+    ytoml_writer* obj = get_writer(2);
+    const char* keys[64];
+    int keylens[64];
+    int n = get_keys(1, keys, keylens, 64);
+    toml_write_header(obj->writer, n, keys, keylens, yarg_true(0));
+    ypush_nil();
+}
+
+void Y__toml_close(int argc)
+{
+    if (argc != 1) y_error("expecting exactly one argument");
+    ytoml_writer* obj = get_writer(0);
+    toml_writer_t* w = obj->writer;
+    char** text = NULL;
+    if (obj->fp == NULL) {
+        size_t len;
+        const char* str = toml_writer_text(w, &len);
+        text = ypush_q(NULL);
+        if (str != NULL) {
+            text[0] = new_string(str, len);
+        }
+    }
+    obj->writer = NULL;
+    int status = toml_writer_close(w);
+    if (status == 0 && obj->fp != NULL && fclose(obj->fp) != 0) {
+        status = -1;
+    }
+    obj->fp = NULL;
+    if (status != 0) {
+        y_error(errno == ENOMEM ? "insufficient memory to write TOML" :
+                "failed to write TOML");
+    }
+    if (text == NULL) {
+        ypush_nil();
+    }
+}
+
+void Y_toml_format(int argc)
+{
+    if (argc != 1) y_error("expecting exactly one argument");
+    toml_writer_t* w = toml_writer_new(NULL);
+    if (w == NULL) {
+        y_error("insufficient memory");
+    }
+    // Free the writer in case of errors.
+    ytoml_writer* obj = ypush_obj(&ytoml_writer_type, sizeof(ytoml_writer));
+    obj->writer = w;
+    write_value(w, 1);
+    size_t len;
+    const char* str = toml_writer_text(w, &len);
+    if (str == NULL) {
+        y_error("insufficient memory");
+    }
+    ypush_q(NULL)[0] = new_string(str, len);
 }
 
 void Y_toml_key(int argc)
@@ -577,7 +1990,7 @@ void Y_toml_key(int argc)
     if (IN_RANGE(idx, 1, len)) {
         int keylen;
         const char* key = toml_table_key(obj->table, idx - 1, &keylen);
-        arr[0] = key == NULL ? NULL : p_strcpy(key);
+        arr[0] = key == NULL ? NULL : new_string(key, keylen);
     }
 }
 
@@ -591,7 +2004,7 @@ void Y_toml_keys(int argc)
     for (long idx = 0; idx < len; ++idx) {
         int keylen;
         const char* key = toml_table_key(obj->table, idx, &keylen);
-        arr[idx] = key == NULL ? NULL : p_strcpy(key);
+        arr[idx] = key == NULL ? NULL : new_string(key, keylen);
     }
 }
 